@@ -1,3 +1,7 @@
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include "7z.h"
 
 #include "DeflateEncoder.h"
@@ -5,15 +9,88 @@
 
 #include "zlib.h"
 
-bool compress_deflate_7z(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned& out_size, unsigned num_passes, unsigned num_fast_bytes) throw ()
+#include "../thread.h"
+
+#include <vector>
+
+/**
+ * Pool of the deflate coders not in use.
+ * The coders are kept to be reused by the next calls with the same options,
+ * avoiding to allocate the match finder every time.
+ * Each coder is used by a single thread at time.
+ * Like the libdeflate pool, it survives the threads of thread_for().
+ */
+class deflate_7z_pool {
+	struct entry {
+		unsigned num_passes;
+		unsigned num_fast_bytes;
+		NDeflate::NEncoder::CCoder* coder;
+	};
+
+	thread_mutex mutex;
+	std::vector<entry> free;
+
+public:
+	~deflate_7z_pool();
+
+	NDeflate::NEncoder::CCoder* get(unsigned num_passes, unsigned num_fast_bytes);
+	void put(unsigned num_passes, unsigned num_fast_bytes, NDeflate::NEncoder::CCoder* coder);
+};
+
+static deflate_7z_pool pool;
+
+deflate_7z_pool::~deflate_7z_pool()
 {
-	try {
-		NDeflate::NEncoder::CCoder cc;
+	for(unsigned i=0;i<free.size();++i)
+		delete free[i].coder;
+}
 
-		if (cc.SetEncoderNumPasses(num_passes) != S_OK)
-			return false;
+NDeflate::NEncoder::CCoder* deflate_7z_pool::get(unsigned num_passes, unsigned num_fast_bytes)
+{
+	{
+		thread_auto_lock lock(mutex);
+
+		for(unsigned i=0;i<free.size();++i) {
+			if (free[i].num_passes == num_passes && free[i].num_fast_bytes == num_fast_bytes) {
+				NDeflate::NEncoder::CCoder* coder = free[i].coder;
+				free[i] = free.back();
+				free.pop_back();
+				return coder;
+			}
+		}
+	}
 
-		if (cc.SetEncoderNumFastBytes(num_fast_bytes) != S_OK)
+	NDeflate::NEncoder::CCoder* coder = new NDeflate::NEncoder::CCoder;
+
+	if (coder->SetEncoderNumPasses(num_passes) != S_OK
+		|| coder->SetEncoderNumFastBytes(num_fast_bytes) != S_OK) {
+		delete coder;
+		return 0;
+	}
+
+	return coder;
+}
+
+void deflate_7z_pool::put(unsigned num_passes, unsigned num_fast_bytes, NDeflate::NEncoder::CCoder* coder)
+{
+	entry e;
+
+	e.num_passes = num_passes;
+	e.num_fast_bytes = num_fast_bytes;
+	e.coder = coder;
+
+	thread_auto_lock lock(mutex);
+
+	free.push_back(e);
+}
+
+bool compress_deflate_7z(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned& out_size, unsigned num_passes, unsigned num_fast_bytes) throw ()
+{
+	NDeflate::NEncoder::CCoder* cc = 0;
+
+	try {
+		cc = pool.get(num_passes, num_fast_bytes);
+		if (!cc)
 			return false;
 
 		ISequentialInStream in(reinterpret_cast<const char*>(in_data), in_size);
@@ -21,7 +98,13 @@ bool compress_deflate_7z(const unsigned char* in_data, unsigned in_size, unsigne
 
 		UINT64 in_size_l = in_size;
 
-		if (cc.Code(&in, &out, &in_size_l) != S_OK)
+		// the coder state is fully initialized at each call, so it can always be reused
+		bool ok = cc->Code(&in, &out, &in_size_l) == S_OK;
+
+		pool.put(num_passes, num_fast_bytes, cc);
+		cc = 0;
+
+		if (!ok)
 			return false;
 
 		out_size = out.size_get();
@@ -31,6 +114,7 @@ bool compress_deflate_7z(const unsigned char* in_data, unsigned in_size, unsigne
 
 		return true;
 	} catch (...) {
+		delete cc;
 		return false;
 	}
 }
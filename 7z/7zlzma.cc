@@ -1,14 +1,26 @@
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include "7z.h"
 
 #include "LZMAEncoder.h"
 #include "LZMADecoder.h"
 
+#include "../thread.h"
+
+/**
+ * Minimum size of the data to use the multi-thread match finder.
+ */
+#define LZMA_MT_SIZE (1 << 20)
+
 bool compress_lzma_7z(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned& out_size, unsigned algo, unsigned dictionary_size, unsigned num_fast_bytes) throw () {
 	try {
 		NCompress::NLZMA::CEncoder cc;
 
-		// reduce the dictionary size if the file is small
-		while (dictionary_size > 8 && dictionary_size / 2 >= out_size)
+		// reduce the dictionary size if the file is small,
+		// as the window and the tree of the match finder are allocated with it
+		while (dictionary_size > 8 && dictionary_size / 2 >= in_size)
 			dictionary_size /= 2;
 
 		if (cc.SetDictionarySize(dictionary_size) != S_OK)
@@ -20,6 +32,10 @@ bool compress_lzma_7z(const unsigned char* in_data, unsigned in_size, unsigned c
 		if (cc.SetEncoderAlgorithm(algo) != S_OK)
 			return false;
 
+		// search the matches in a second thread, if the data is big enough
+		if (cc.SetEncoderMultiThread(in_size >= LZMA_MT_SIZE && thread_cpu() > 1) != S_OK)
+			return false;
+
 		ISequentialInStream in(reinterpret_cast<const char*>(in_data), in_size);
 		ISequentialOutStream out(reinterpret_cast<char*>(out_data), out_size);
 
@@ -34,6 +34,7 @@ class CInTree: public NStream::NWindow::CIn
   void NormalizeLinks(CIndex *anArray, UINT32 aNumItems, INT32 aSubValue);
   void Normalize();
   void FreeMemory();
+  void ClearHash();
 
 protected:
   virtual void AfterMoveBlock();
@@ -0,0 +1,228 @@
+#include "Portable.h"
+#include "BinTree2MT.h"
+
+namespace NBT2 {
+
+CMatchFinderMT::CMatchFinderMT():
+  m_In(&m_Tree),
+  m_TreeStream(0),
+  m_MatchMaxLen(0),
+  m_MultiThread(false),
+  m_Running(false),
+  m_Distances(0)
+{
+  for (int i = 0; i < kNumBlocks; i++)
+    m_Blocks[i] = 0;
+}
+
+CMatchFinderMT::~CMatchFinderMT()
+{
+  Stop();
+  FreeMemory();
+}
+
+void CMatchFinderMT::FreeMemory()
+{
+  for (int i = 0; i < kNumBlocks; i++)
+  {
+    delete [] m_Blocks[i];
+    m_Blocks[i] = 0;
+  }
+  delete [] m_Distances;
+  m_Distances = 0;
+  delete m_TreeStream;
+  m_TreeStream = 0;
+}
+
+HRESULT CMatchFinderMT::Create(UINT32 aSizeHistory,
+      UINT32 aKeepAddBufferBefore, UINT32 aMatchMaxLen,
+      UINT32 aKeepAddBufferAfter)
+{
+  Stop();
+  FreeMemory();
+
+  RETURN_IF_NOT_S_OK(m_Tree.Create(aSizeHistory, aKeepAddBufferBefore, aMatchMaxLen,
+      aKeepAddBufferAfter));
+  m_MatchMaxLen = aMatchMaxLen;
+
+  if (!m_MultiThread)
+    return S_OK;
+
+  // same sizes of the window of the tree
+  const UINT32 kAlignMask = (1 << 16) - 1;
+  UINT32 aWindowReservSize = aSizeHistory / 2;
+  aWindowReservSize += kAlignMask;
+  aWindowReservSize &= ~(kAlignMask);
+
+  const int kMinDictSize = (1 << 19);
+  if (aWindowReservSize < kMinDictSize)
+    aWindowReservSize = kMinDictSize;
+  aWindowReservSize += 256;
+
+  try
+  {
+    m_Window.Create(aSizeHistory + aKeepAddBufferBefore,
+        aMatchMaxLen + aKeepAddBufferAfter, aWindowReservSize);
+    for (int i = 0; i < kNumBlocks; i++)
+      m_Blocks[i] = new UINT32[kBlockSize];
+    m_Distances = new UINT32[aMatchMaxLen + 1];
+  }
+  catch(...)
+  {
+    return E_OUTOFMEMORY;
+  }
+
+  return S_OK;
+}
+
+HRESULT CMatchFinderMT::Init(ISequentialInStream *aStream)
+{
+  Stop();
+
+  m_In = &m_Tree;
+
+#if HAVE_PTHREAD_H
+  if (m_MultiThread)
+  {
+    // the tree reads the same data with its own stream
+    delete m_TreeStream;
+    m_TreeStream = 0;
+    try
+    {
+      m_TreeStream = new ISequentialInStream(*aStream);
+    }
+    catch(...)
+    {
+      return E_OUTOFMEMORY;
+    }
+
+    RETURN_IF_NOT_S_OK(m_Tree.Init(m_TreeStream));
+    RETURN_IF_NOT_S_OK(m_Window.Init(aStream));
+
+    for (int i = 0; i < kNumBlocks; i++)
+      m_BlockFull[i] = false;
+    m_TreeEnd = false;
+    m_Stop = false;
+    m_Read = 0;
+    m_ReadEnd = 0;
+    m_ReadBlock = 0;
+    m_ReadStarted = false;
+
+    // if the thread cannot start, the tree is used directly
+    if (pthread_create(&m_Thread, 0, TreeThread, this) != 0)
+      return S_OK;
+
+    m_Running = true;
+    m_In = &m_Window;
+    return S_OK;
+  }
+#endif
+
+  return m_Tree.Init(aStream);
+}
+
+void CMatchFinderMT::Stop()
+{
+#if HAVE_PTHREAD_H
+  if (!m_Running)
+    return;
+
+  {
+    thread_auto_lock aLock(m_Mutex);
+    m_Stop = true;
+    m_CanWrite.broadcast();
+  }
+
+  pthread_join(m_Thread, 0);
+
+  m_Running = false;
+  m_In = &m_Tree;
+#endif
+}
+
+void *CMatchFinderMT::TreeThread(void *anArg)
+{
+  static_cast<CMatchFinderMT *>(anArg)->TreeRun();
+  return 0;
+}
+
+void CMatchFinderMT::TreeRun()
+{
+  UINT32 aBlock = 0;
+
+  while (true)
+  {
+    {
+      thread_auto_lock aLock(m_Mutex);
+      while (m_BlockFull[aBlock] && !m_Stop)
+        m_CanWrite.wait(m_Mutex);
+      if (m_Stop)
+        return;
+    }
+
+    // each position stores the length followed by the distances from 2 to the length
+    UINT32 *aData = m_Blocks[aBlock];
+    UINT32 aFill = 0;
+    bool anEnd = false;
+    while (aFill + m_MatchMaxLen <= kBlockSize)
+    {
+      if (m_Tree.GetNumAvailableBytes() == 0)
+      {
+        anEnd = true;
+        break;
+      }
+      UINT32 aLen = m_Tree.GetLongestMatch(m_Distances);
+      aData[aFill++] = aLen;
+      for (UINT32 i = 2; i <= aLen; i++)
+        aData[aFill++] = m_Distances[i];
+      if (m_Tree.MovePos() != S_OK)
+      {
+        anEnd = true;
+        break;
+      }
+    }
+
+    thread_auto_lock aLock(m_Mutex);
+    if (aFill != 0)
+    {
+      m_BlockFill[aBlock] = aFill;
+      m_BlockFull[aBlock] = true;
+    }
+    m_TreeEnd = anEnd;
+    m_CanRead.signal();
+    if (anEnd)
+      return;
+
+    aBlock = (aBlock + 1) % kNumBlocks;
+  }
+}
+
+bool CMatchFinderMT::NextBlock()
+{
+  thread_auto_lock aLock(m_Mutex);
+
+  if (m_ReadStarted)
+  {
+    m_BlockFull[m_ReadBlock] = false;
+    m_CanWrite.signal();
+    m_ReadBlock = (m_ReadBlock + 1) % kNumBlocks;
+  }
+  m_ReadStarted = true;
+
+  while (!m_BlockFull[m_ReadBlock])
+  {
+    // no more positions, like the tree at the end of the stream
+    if (m_TreeEnd)
+    {
+      m_Read = m_ReadEnd = 0;
+      return false;
+    }
+    m_CanRead.wait(m_Mutex);
+  }
+
+  m_Read = m_Blocks[m_ReadBlock];
+  m_ReadEnd = m_Read + m_BlockFill[m_ReadBlock];
+  return true;
+}
+
+}
@@ -0,0 +1,111 @@
+#ifndef __BINTREE2MT__H
+#define __BINTREE2MT__H
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "BinTree2.h"
+
+#include "../thread.h"
+
+namespace NBT2 {
+
+// Match finder running the binary tree in a second thread.
+// The tree thread searches the matches of all the positions ahead,
+// and stores them in a ring of blocks, read by the encoder thread.
+// The encoder reads the data from its own window, a copy of the tree one.
+// The tree does the same work for GetLongestMatch() and DummyLongestMatch(),
+// so the matches are always the same of the single thread mode.
+class CMatchFinderMT
+{
+  enum { kNumBlocks = 4, kBlockSize = 1 << 16 };
+
+  CMatchFinderBinTree m_Tree;
+  NStream::NWindow::CIn m_Window;
+  NStream::NWindow::CIn *m_In; // window used for the data, m_Tree or m_Window
+  ISequentialInStream *m_TreeStream;
+  UINT32 m_MatchMaxLen;
+
+  bool m_MultiThread;
+  bool m_Running;
+
+  UINT32 *m_Blocks[kNumBlocks];
+  UINT32 m_BlockFill[kNumBlocks];
+  bool m_BlockFull[kNumBlocks];
+  bool m_TreeEnd;
+  bool m_Stop;
+  UINT32 *m_Distances;
+
+  const UINT32 *m_Read;
+  const UINT32 *m_ReadEnd;
+  UINT32 m_ReadBlock;
+  bool m_ReadStarted;
+
+  thread_mutex m_Mutex;
+  thread_cond m_CanRead;
+  thread_cond m_CanWrite;
+#if HAVE_PTHREAD_H
+  pthread_t m_Thread;
+#endif
+
+  static void *TreeThread(void *anArg);
+  void TreeRun();
+  bool NextBlock();
+  void Stop();
+  void FreeMemory();
+public:
+  CMatchFinderMT();
+  ~CMatchFinderMT();
+
+  // To call before Create()
+  void SetMultiThread(bool aMultiThread) { m_MultiThread = aMultiThread; }
+
+  HRESULT Create(UINT32 aSizeHistory, UINT32 aKeepAddBufferBefore, UINT32 aMatchMaxLen,
+      UINT32 aKeepAddBufferAfter);
+  HRESULT Init(ISequentialInStream *aStream);
+
+  UINT32 GetLongestMatch(UINT32 *aDistances)
+  {
+    if (!m_Running)
+      return m_Tree.GetLongestMatch(aDistances);
+    if (m_Read == m_ReadEnd && !NextBlock())
+      return 0;
+    UINT32 aLen = *m_Read++;
+    for (UINT32 i = 2; i <= aLen; i++)
+      aDistances[i] = *m_Read++;
+    return aLen;
+  }
+  void DummyLongestMatch()
+  {
+    if (!m_Running)
+    {
+      m_Tree.DummyLongestMatch();
+      return;
+    }
+    if (m_Read == m_ReadEnd && !NextBlock())
+      return;
+    UINT32 aLen = *m_Read++;
+    if (aLen >= 2)
+      m_Read += aLen - 1;
+  }
+  HRESULT MovePos()
+  {
+    if (!m_Running)
+      return m_Tree.MovePos();
+    return m_Window.MovePos();
+  }
+
+  BYTE GetIndexByte(INT anIndex) const
+    { return m_In->GetIndexByte(anIndex); }
+  INT GetMatchLen(INT aIndex, INT aBack, INT aLimit) const
+    { return m_In->GetMatchLen(aIndex, aBack, aLimit); }
+  const BYTE *GetPointerToCurrentPos() const
+    { return m_In->GetPointerToCurrentPos(); }
+  INT GetNumAvailableBytes() const
+    { return m_In->GetNumAvailableBytes(); }
+};
+
+}
+
+#endif
@@ -30,6 +30,9 @@ namespace BT_NAMESPACE {
   #endif
 #endif
 
+// size of the streams where the hash is cleared only in the used entries
+static const INT kSmallStreamSize = kHashSize / 16;
+
 CInTree::CInTree():
   #ifdef HASH_ARRAY_2
   m_Hash2(0),
@@ -102,18 +105,12 @@ static const UINT32 kEmptyHashValue = 0;
 HRESULT CInTree::Init(ISequentialInStream *aStream)
 {
   RETURN_IF_NOT_S_OK(CIn::Init(aStream));
-  unsigned i;
-  for(i = 0; i < kHashSize; i++)
-    m_Hash[i] = kEmptyHashValue;
 
-  #ifdef HASH_ARRAY_2
-  for(i = 0; i < kHash2Size; i++)
-    m_Hash2[i] = kEmptyHashValue;
-  #ifdef HASH_ARRAY_3
-  for(i = 0; i < kHash3Size; i++)
-    m_Hash3[i] = kEmptyHashValue;
-  #endif
-  #endif
+  // read all the data if it's small, to know if the stream is at the end
+  if (!IsStreamEnd() && m_StreamPos < kSmallStreamSize)
+    RETURN_IF_NOT_S_OK(ReadBlock());
+
+  ClearHash();
 
   m_Son = m_Base;
 
@@ -154,6 +151,46 @@ inline UINT32 Hash(const BYTE *aPointer)
 #endif // HASH_ZIP
 #endif // HASH_ARRAY_2
 
+void CInTree::ClearHash()
+{
+  unsigned i;
+
+  // for small streams clears only the entries used by the data,
+  // as the other entries are never read
+  if (IsStreamEnd() && m_StreamPos < kSmallStreamSize)
+  {
+    for(i = 0; i + kNumHashBytes <= UINT32(m_StreamPos); i++)
+    {
+      #ifdef HASH_ARRAY_2
+      UINT32 aHash2Value;
+      #ifdef HASH_ARRAY_3
+      UINT32 aHash3Value;
+      m_Hash[Hash(m_Buffer + i, aHash2Value, aHash3Value)] = kEmptyHashValue;
+      m_Hash3[aHash3Value] = kEmptyHashValue;
+      #else
+      m_Hash[Hash(m_Buffer + i, aHash2Value)] = kEmptyHashValue;
+      #endif
+      m_Hash2[aHash2Value] = kEmptyHashValue;
+      #else
+      m_Hash[Hash(m_Buffer + i)] = kEmptyHashValue;
+      #endif
+    }
+    return;
+  }
+
+  for(i = 0; i < kHashSize; i++)
+    m_Hash[i] = kEmptyHashValue;
+
+  #ifdef HASH_ARRAY_2
+  for(i = 0; i < kHash2Size; i++)
+    m_Hash2[i] = kEmptyHashValue;
+  #ifdef HASH_ARRAY_3
+  for(i = 0; i < kHash3Size; i++)
+    m_Hash3[i] = kEmptyHashValue;
+  #endif
+  #endif
+}
+
 UINT32 CInTree::GetLongestMatch(UINT32 *aDistances)
 {
   UINT32 aCurrentLimit;
@@ -86,6 +86,12 @@ HRESULT CEncoder::SetEncoderNumFastBytes(INT A) {
   return S_OK;
 }
 
+HRESULT CEncoder::SetEncoderMultiThread(bool A) {
+  m_MatchFinder.SetMultiThread(A);
+
+  return S_OK;
+}
+
 HRESULT CEncoder::SetDictionarySize(INT aDictionarySize)
 {
   if (aDictionarySize > INT(1 << kDicLogSizeMax))
@@ -9,8 +9,8 @@
 #include "AriConst.h"
 
 // NOTE Here is choosen the MatchFinder
-#include "BinTree2.h"
-#define MATCH_FINDER NBT2::CMatchFinderBinTree
+#include "BinTree2MT.h"
+#define MATCH_FINDER NBT2::CMatchFinderMT
 
 namespace NCompress {
 namespace NLZMA {
@@ -195,6 +195,7 @@ public:
 
   HRESULT SetEncoderAlgorithm(INT A);
   HRESULT SetEncoderNumFastBytes(INT A);
+  HRESULT SetEncoderMultiThread(bool A);
   HRESULT SetDictionarySize(INT aDictionarySize);
   HRESULT SetLiteralProperties(INT aLiteralPosStateBits, INT aLiteralContextBits);
   HRESULT SetPosBitsProperties(INT aNumPosStateBits);
@@ -77,6 +77,7 @@ public:
   }
 
   INT GetNumAvailableBytes() const { return m_StreamPos - m_Pos; }
+  bool IsStreamEnd() const { return m_StreamEndWasReached; }
 
   void ReduceOffsets(INT aSubValue)
   {
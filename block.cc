@@ -0,0 +1,635 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2024 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "portable.h"
+
+#include "block.h"
+#include "compress.h"
+#include "data.h"
+#include "except.h"
+
+#include "zopfli/parse.h"
+
+#include <algorithm>
+
+using namespace std;
+
+static const unsigned short dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+/**
+ * Reader of the bits of a deflate stream.
+ */
+class bit_reader {
+	const unsigned char* data;
+	unsigned long long size; /**< Size in bits. */
+	unsigned long long pos; /**< Position in bits. */
+public:
+	bit_reader(const unsigned char* Adata, unsigned Asize) : data(Adata), size(Asize * 8ULL), pos(0) { }
+
+	void pos_set(unsigned long long Apos) { pos = Apos; }
+
+	/**
+	 * Read the specified number of bits, up to 16.
+	 * Return false at the end of the stream.
+	 */
+	bool get(unsigned bits, unsigned& value)
+	{
+		if (pos + bits > size)
+			return false;
+		value = 0;
+		for(unsigned i=0;i<bits;++i) {
+			value |= ((data[pos >> 3] >> (pos & 7)) & 1) << i;
+			++pos;
+		}
+		return true;
+	}
+};
+
+/**
+ * Writer of the bits of a deflate stream.
+ */
+class bit_writer {
+	unsigned char* data;
+	unsigned long long pos; /**< Position in bits. */
+public:
+	bit_writer(unsigned char* Adata) : data(Adata), pos(0) { }
+
+	unsigned size_get() const { return static_cast<unsigned>((pos + 7) >> 3); }
+
+	void put(unsigned value, unsigned bits)
+	{
+		for(unsigned i=0;i<bits;++i) {
+			if ((pos & 7) == 0)
+				data[pos >> 3] = 0;
+			data[pos >> 3] |= ((value >> i) & 1) << (pos & 7);
+			++pos;
+		}
+	}
+
+	void align()
+	{
+		put(0, (8 - (pos & 7)) & 7);
+	}
+
+	void copy(const unsigned char* src, unsigned size)
+	{
+		assert((pos & 7) == 0);
+		memcpy(data + (pos >> 3), src, size);
+		pos += size * 8ULL;
+	}
+};
+
+/**
+ * State of deflate_block_parse(), passed to the zopfli parser callbacks.
+ */
+struct deflate_parse {
+	const unsigned char* data;
+	vector<deflate_block>* block;
+	vector<deflate_symbol>* symbol;
+	deflate_block current; /**< Counters of the block being parsed. */
+	bool ok;
+};
+
+static void deflate_parse_clear(deflate_parse& p)
+{
+	p.current.literal = 0;
+	p.current.match = 0;
+	for(unsigned i=0;i<30;++i)
+		p.current.dist[i] = 0;
+	p.current.symbol = p.symbol ? p.symbol->size() : 0;
+}
+
+static int deflate_parse_symbol(void* context, size_t bit, size_t pos, unsigned litlen, unsigned dist)
+{
+	deflate_parse& p = *static_cast<deflate_parse*>(context);
+
+	if (dist == 0) {
+		if (pos >= 0xFFFFFFFF) {
+			p.ok = false;
+			return 0;
+		}
+		++p.current.literal;
+	} else {
+		if (litlen > 0xFFFFFFFF - pos) {
+			p.ok = false;
+			return 0;
+		}
+		++p.current.match;
+		++p.current.dist[upper_bound(dist_base, dist_base + 30, dist) - dist_base - 1];
+	}
+
+	if (p.symbol) {
+		deflate_symbol y;
+		y.pos = pos;
+		y.bit = bit;
+		p.symbol->push_back(y);
+	}
+
+	return 1;
+}
+
+static int deflate_parse_stored(void* context, const unsigned char* data, size_t size, size_t pos)
+{
+	deflate_parse& p = *static_cast<deflate_parse*>(context);
+
+	if (size > 0xFFFFFFFF - pos) {
+		p.ok = false;
+		return 0;
+	}
+
+	// the whole stored data is a single symbol
+	if (p.symbol && size) {
+		deflate_symbol y;
+		y.pos = pos;
+		y.bit = (data - p.data) * 8;
+		p.symbol->push_back(y);
+	}
+
+	return 1;
+}
+
+static int deflate_parse_block(void* context, const ZopfliParseBlock* block)
+{
+	deflate_parse& p = *static_cast<deflate_parse*>(context);
+	deflate_block& b = p.current;
+
+	b.type = block->type;
+	b.bit_begin = block->bitbegin;
+	b.bit_data = block->bitdata;
+	b.bit_eob = block->biteob;
+	b.bit_end = block->bitend;
+	b.pos_begin = block->posbegin;
+	b.pos_end = block->posend;
+
+	p.block->push_back(b);
+
+	deflate_parse_clear(p);
+
+	return 1;
+}
+
+/**
+ * Parse the blocks of a deflate stream.
+ * The data is decoded without storing it, checking only that the
+ * stream is valid up to the final block.
+ * \param block Where the blocks are appended.
+ * \param symbol Where the symbols are appended. It may be 0.
+ * The data of a stored block is a single symbol. If not 0, the stream
+ * must be smaller than 512 MB, to have the bit positions in 32 bits.
+ * \param out_size Size of the uncompressed data.
+ */
+bool deflate_block_parse(const unsigned char* data, unsigned size, vector<deflate_block>& block, vector<deflate_symbol>* symbol, unsigned& out_size)
+{
+	ZopfliParseCallback callback;
+	deflate_parse p;
+
+	if (symbol && size > 0x1FFFFFFF)
+		return false;
+
+	p.data = data;
+	p.block = &block;
+	p.symbol = symbol;
+	p.ok = true;
+	deflate_parse_clear(p);
+
+	callback.context = &p;
+	callback.symbol = deflate_parse_symbol;
+	callback.stored = deflate_parse_stored;
+	callback.block = deflate_parse_block;
+
+	if (!ZopfliParseDeflate(data, size, &callback) || !p.ok)
+		return false;
+
+	out_size = block.empty() ? 0 : block.back().pos_end;
+
+	return true;
+}
+
+/**
+ * Print the blocks of a deflate stream, one for line.
+ * The fields are the stream and block indexes, the type, the uncompressed
+ * position and size, the size in bits, the size of the header in bits
+ * with the Huffman codes, the number of literals and matches, the number of
+ * matches for each of the 30 distance codes separated by commas, and at last
+ * the name.
+ * \param stream Index of the stream, for files with more than one.
+ */
+void deflate_block_print(ostream& os, const unsigned char* data, unsigned size, unsigned stream, const string& name)
+{
+	static const char* type_name[3] = { "stored", "fixed", "dynamic" };
+	vector<deflate_block> block;
+	unsigned out_size;
+
+	if (!deflate_block_parse(data, size, block, 0, out_size))
+		throw error_invalid() << "Invalid compressed data on " << name;
+
+	for(unsigned i=0;i<block.size();++i) {
+		const deflate_block& b = block[i];
+
+		os << stream << " " << i << " " << type_name[b.type];
+		os << " " << b.pos_begin << " " << b.pos_end - b.pos_begin;
+		os << " " << b.bit_end - b.bit_begin;
+		os << " " << b.bit_data - b.bit_begin;
+		os << " " << b.literal << " " << b.match << " ";
+		for(unsigned j=0;j<30;++j) {
+			if (j)
+				os << ",";
+			os << b.dist[j];
+		}
+		os << " " << name << "\n";
+	}
+}
+
+/**
+ * Like deflate_block_print(), but for zlib streams.
+ */
+void zlib_block_print(ostream& os, const unsigned char* data, unsigned size, unsigned stream, const string& name)
+{
+	// deflate method without a preset dictionary
+	if (size < 2 || (data[0] & 0x0F) != 8 || (data[0] * 256 + data[1]) % 31 != 0 || (data[1] & 0x20) != 0)
+		throw error_unsupported() << "Unsupported zlib stream on " << name;
+
+	deflate_block_print(os, data + 2, size - 2, stream, name);
+}
+
+/**
+ * Copy a range of bits.
+ */
+static void bit_copy(bit_writer& w, const unsigned char* data, unsigned size, unsigned long long begin, unsigned long long end)
+{
+	bit_reader r(data, size);
+
+	r.pos_set(begin);
+	while (begin < end) {
+		unsigned bits = end - begin < 16 ? static_cast<unsigned>(end - begin) : 16;
+		unsigned value = 0;
+		r.get(bits, value);
+		w.put(value, bits);
+		begin += bits;
+	}
+}
+
+/**
+ * Bits of the block header.
+ * For stored blocks the alignment padding may change, and the largest is assumed.
+ */
+unsigned long long deflate_mixer::header_bits(const stream& s, unsigned k) const
+{
+	const deflate_block& b = s.block[k];
+	if (b.type == 0)
+		return 3 + 7 + 32;
+	return b.bit_data - b.bit_begin;
+}
+
+/**
+ * Bits of the end of block symbol.
+ */
+unsigned long long deflate_mixer::eob_bits(const stream& s, unsigned k) const
+{
+	const deflate_block& b = s.block[k];
+	return b.bit_end - b.bit_eob;
+}
+
+/**
+ * Symbol after the last one of a block.
+ */
+unsigned deflate_mixer::symbol_end(const stream& s, unsigned k) const
+{
+	if (k + 1 < s.block.size())
+		return s.block[k + 1].symbol;
+	return s.symbol.size();
+}
+
+/**
+ * Block of a symbol.
+ * Blocks without symbols are never returned.
+ */
+unsigned deflate_mixer::symbol_block(const stream& s, unsigned t) const
+{
+	unsigned begin = 0;
+	unsigned end = s.block.size();
+
+	// last block starting at or before the symbol
+	while (end - begin > 1) {
+		unsigned mid = begin + (end - begin) / 2;
+		if (s.block[mid].symbol <= t)
+			begin = mid;
+		else
+			end = mid;
+	}
+
+	return begin;
+}
+
+/**
+ * Bits of a symbol of the specified block.
+ */
+unsigned long long deflate_mixer::symbol_bits(const stream& s, unsigned k, unsigned t) const
+{
+	if (t + 1 < symbol_end(s, k))
+		return s.symbol[t + 1].bit - s.symbol[t].bit;
+	return s.block[k].bit_eob - s.symbol[t].bit;
+}
+
+deflate_mixer::deflate_mixer(unsigned Ain_size) : in_size(Ain_size)
+{
+}
+
+deflate_mixer::~deflate_mixer()
+{
+	for(unsigned i=0;i<list.size();++i)
+		data_free(list[i].data);
+}
+
+/**
+ * If the data is small enough to mix.
+ * The mixer keeps about 21 bytes for each symbol of each stream.
+ */
+bool deflate_mixer::enabled() const
+{
+	return in_size != 0 && in_size <= DEFLATE_MIXER_SIZE_MAX;
+}
+
+/**
+ * Add a deflate stream to mix.
+ * The data is copied. Invalid streams, and streams with only stored
+ * blocks, are ignored.
+ */
+void deflate_mixer::add(const unsigned char* data, unsigned size)
+{
+	unsigned out_size;
+
+	if (!enabled() || !data || !size)
+		return;
+
+	list.push_back(stream());
+
+	stream& s = list.back();
+
+	if (!deflate_block_parse(data, size, s.block, &s.symbol, out_size) || out_size != in_size) {
+		list.pop_back();
+		return;
+	}
+
+	unsigned stored = 0;
+	for(unsigned i=0;i<s.block.size();++i)
+		if (s.block[i].type == 0)
+			++stored;
+	if (stored == s.block.size()) {
+		list.pop_back();
+		return;
+	}
+
+	s.data = data_dup(data, size);
+	s.size = size;
+}
+
+/**
+ * Part of a block to write in the mixed stream.
+ */
+struct block_slice {
+	unsigned stream;
+	unsigned block;
+	unsigned begin; /**< First symbol. */
+	unsigned end; /**< Symbol after the last one. */
+};
+
+/**
+ * Join the cheapest parts of the streams.
+ * All the streams must be of the uncompressed data specified.
+ * As they all produce the same data, the matches reference the same
+ * window in any stream, and the symbols are copied without decoding them.
+ * At any position where two streams have a symbol starting, the mixed
+ * stream can switch from one to the other, closing the current block
+ * and repeating the header of the block of the other stream.
+ * The cheapest path is found keeping for each stream the cost of
+ * reaching each of its symbols.
+ * \param out_size Size of the output buffer. The mixed stream is
+ * used only if smaller. On return, the size of the mixed stream.
+ * \return If the mixed stream is produced and verified.
+ */
+bool deflate_mixer::run(unsigned char* out_data, unsigned& out_size, const unsigned char* in_data)
+{
+	const unsigned long long none = ~0ULL;
+	const unsigned char direct = 0xFF;
+	unsigned n = list.size();
+
+	if (n < 2 || n >= direct)
+		return false;
+
+	// for each symbol, and for the end of the stream, the cost of reaching it
+	// and the symbol of the other stream it's reached from
+	vector< vector<unsigned long long> > cost(n);
+	vector< vector<unsigned char> > from_stream(n);
+	vector< vector<unsigned> > from_symbol(n);
+	vector<unsigned> cursor(n, 0);
+	vector<unsigned> cursor_block(n, 0); // block of the symbol at the cursor
+	vector<unsigned> prev_block(n, 0); // block of the symbol before the cursor
+
+	for(unsigned i=0;i<n;++i) {
+		cost[i].resize(list[i].symbol.size() + 1, none);
+		from_stream[i].resize(list[i].symbol.size() + 1, direct);
+		from_symbol[i].resize(list[i].symbol.size() + 1, 0);
+		cursor_block[i] = symbol_block(list[i], 0);
+	}
+
+	unsigned best_stream;
+	unsigned best_symbol;
+
+	while (true) {
+		unsigned pos = in_size;
+
+		for(unsigned i=0;i<n;++i)
+			if (cursor[i] < list[i].symbol.size() && list[i].symbol[cursor[i]].pos < pos)
+				pos = list[i].symbol[cursor[i]].pos;
+
+		// continue each stream, and get the cheapest one to close here
+		unsigned long long best = none;
+		best_stream = 0;
+		best_symbol = 0;
+		for(unsigned i=0;i<n;++i) {
+			const stream& s = list[i];
+			unsigned t = cursor[i];
+			unsigned k = cursor_block[i];
+			unsigned long long c;
+			unsigned long long closed;
+
+			if (t < s.symbol.size() && s.symbol[t].pos != pos)
+				continue;
+
+			bool at_end = t == s.symbol.size();
+			bool at_block = at_end || s.block[k].symbol == t;
+
+			if (t == 0) {
+				c = header_bits(s, k);
+			} else {
+				c = cost[i][t - 1] + symbol_bits(s, prev_block[i], t - 1);
+				if (at_block) {
+					c += eob_bits(s, prev_block[i]);
+					if (!at_end)
+						c += header_bits(s, k);
+				}
+			}
+
+			if (c < cost[i][t])
+				cost[i][t] = c;
+			c = cost[i][t];
+
+			if (at_end)
+				closed = c;
+			else if (at_block)
+				closed = c - header_bits(s, k);
+			else
+				closed = c + eob_bits(s, k);
+
+			if (closed < best) {
+				best = closed;
+				best_stream = i;
+				best_symbol = t;
+			}
+		}
+
+		if (pos == in_size)
+			break;
+
+		// switch to the other streams
+		for(unsigned i=0;i<n;++i) {
+			const stream& s = list[i];
+			unsigned t = cursor[i];
+
+			if (t == s.symbol.size() || s.symbol[t].pos != pos)
+				continue;
+
+			unsigned long long c = best + header_bits(s, cursor_block[i]);
+			if (i != best_stream && c < cost[i][t]) {
+				cost[i][t] = c;
+				from_stream[i][t] = best_stream;
+				from_symbol[i][t] = best_symbol;
+			}
+		}
+
+		for(unsigned i=0;i<n;++i) {
+			const stream& s = list[i];
+
+			if (cursor[i] == s.symbol.size() || s.symbol[cursor[i]].pos != pos)
+				continue;
+
+			prev_block[i] = cursor_block[i];
+			++cursor[i];
+			while (cursor_block[i] + 1 < s.block.size() && s.block[cursor_block[i] + 1].symbol <= cursor[i] && cursor[i] < s.symbol.size())
+				++cursor_block[i];
+		}
+	}
+
+	unsigned long long bits = cost[best_stream][best_symbol];
+	if ((bits + 7) / 8 >= out_size)
+		return false;
+
+	// walk back the path
+	vector<block_slice> slice;
+	unsigned i = best_stream;
+	unsigned t = best_symbol;
+	unsigned end = t;
+	while (true) {
+		bool first = from_stream[i][t] != direct || t == 0;
+
+		if (first) {
+			// split the run of the stream in blocks
+			const stream& s = list[i];
+			unsigned k = end;
+			while (k > t) {
+				block_slice b;
+				b.stream = i;
+				b.block = symbol_block(s, k - 1);
+				b.end = k;
+				k = s.block[b.block].symbol > t ? s.block[b.block].symbol : t;
+				b.begin = k;
+				slice.push_back(b);
+			}
+
+			if (from_stream[i][t] == direct)
+				break;
+
+			unsigned j = from_stream[i][t];
+			t = from_symbol[i][t];
+			i = j;
+			end = t;
+		} else {
+			--t;
+		}
+	}
+	reverse(slice.begin(), slice.end());
+
+	unsigned char* mix_data = data_alloc((bits + 7) / 8 + 8);
+	bit_writer w(mix_data);
+
+	for(unsigned i=0;i<slice.size();++i) {
+		const stream& s = list[slice[i].stream];
+		const deflate_block& b = s.block[slice[i].block];
+		const deflate_symbol& y = s.symbol[slice[i].begin];
+		unsigned final = i + 1 == slice.size();
+		unsigned long long data_end;
+
+		if (slice[i].end < symbol_end(s, slice[i].block))
+			data_end = s.symbol[slice[i].end].bit;
+		else
+			data_end = b.bit_eob;
+
+		w.put(final, 1);
+
+		if (b.type == 0) {
+			unsigned len = b.pos_end - b.pos_begin;
+			w.put(0, 2);
+			w.align();
+			w.put(len, 16);
+			w.put(~len & 0xFFFF, 16);
+			w.copy(s.data + (y.bit >> 3), len);
+		} else {
+			bit_copy(w, s.data, s.size, b.bit_begin + 1, b.bit_data);
+			bit_copy(w, s.data, s.size, y.bit, data_end);
+			bit_copy(w, s.data, s.size, b.bit_eob, b.bit_end);
+		}
+	}
+
+	unsigned mix_size = w.size_get();
+
+	bool ok = mix_size < out_size;
+
+	if (ok) {
+		unsigned char* check_data = data_alloc(in_size);
+
+		ok = decompress_deflate(mix_data, mix_size, check_data, in_size)
+			&& memcmp(check_data, in_data, in_size) == 0;
+
+		data_free(check_data);
+	}
+
+	if (ok) {
+		memcpy(out_data, mix_data, mix_size);
+		out_size = mix_size;
+	}
+
+	data_free(mix_data);
+
+	return ok;
+}
@@ -0,0 +1,91 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2024 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __BLOCK_H
+#define __BLOCK_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * Block of a deflate stream.
+ */
+struct deflate_block {
+	unsigned type; /**< 0 stored, 1 fixed Huffman, 2 dynamic Huffman. */
+	unsigned long long bit_begin; /**< Bit position of the block header. */
+	unsigned long long bit_data; /**< Bit position of the first symbol, or of the stored data. */
+	unsigned long long bit_eob; /**< Bit position of the end of block symbol. */
+	unsigned long long bit_end; /**< Bit position after the end of block. */
+	unsigned pos_begin; /**< Uncompressed position of the first byte. */
+	unsigned pos_end; /**< Uncompressed position after the last byte. */
+	unsigned literal; /**< Number of literals. */
+	unsigned match; /**< Number of matches. */
+	unsigned dist[30]; /**< Number of matches for each distance code. */
+	unsigned symbol; /**< Index of the first symbol. */
+};
+
+/**
+ * Literal or match of a deflate stream.
+ * The block is the last one with the first symbol at or before it.
+ */
+struct deflate_symbol {
+	unsigned pos; /**< Uncompressed position. */
+	unsigned bit; /**< Bit position. */
+};
+
+bool deflate_block_parse(const unsigned char* data, unsigned size, std::vector<deflate_block>& block, std::vector<deflate_symbol>* symbol, unsigned& out_size);
+void deflate_block_print(std::ostream& os, const unsigned char* data, unsigned size, unsigned stream, const std::string& name);
+void zlib_block_print(std::ostream& os, const unsigned char* data, unsigned size, unsigned stream, const std::string& name);
+
+#define DEFLATE_MIXER_SIZE_MAX (4 * 1024 * 1024) /**< Max uncompressed size of the data to mix. */
+
+/**
+ * Mixer of deflate streams of the same data.
+ * The streams are cut at the positions where they have a symbol starting,
+ * and the cheapest parts are joined in a new stream.
+ */
+class deflate_mixer {
+	struct stream {
+		unsigned char* data;
+		unsigned size;
+		std::vector<deflate_block> block;
+		std::vector<deflate_symbol> symbol;
+	};
+
+	unsigned in_size;
+	std::vector<stream> list;
+
+	unsigned long long header_bits(const stream& s, unsigned k) const;
+	unsigned long long eob_bits(const stream& s, unsigned k) const;
+	unsigned symbol_end(const stream& s, unsigned k) const;
+	unsigned symbol_block(const stream& s, unsigned t) const;
+	unsigned long long symbol_bits(const stream& s, unsigned k, unsigned t) const;
+
+public:
+	deflate_mixer(unsigned Ain_size);
+	~deflate_mixer();
+
+	bool enabled() const;
+	void add(const unsigned char* data, unsigned size);
+	bool run(unsigned char* out_data, unsigned& out_size, const unsigned char* in_data);
+};
+
+#endif
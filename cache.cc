@@ -0,0 +1,507 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2024 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "portable.h"
+
+#include "cache.h"
+#include "compress.h"
+#include "file.h"
+#include "data.h"
+#include "thread.h"
+#include "lib/endianrw.h"
+
+#include <map>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * Signature of the cache files.
+ */
+#define CACHE_MAGIC "ADVCACH2"
+#define CACHE_MAGIC_SIZE 8
+
+/**
+ * Size of the fixed part of the cache file after the key.
+ * It contains the info, the type, the size, the CRC of the uncompressed data
+ * and the CRC of the stored data.
+ */
+#define CACHE_HEADER_SIZE 20
+
+/**
+ * Type of the cached result.
+ */
+#define CACHE_TYPE_NOGAIN 0 /**< The size was not improved. */
+#define CACHE_TYPE_DATA 1 /**< Compressed data. */
+
+/***************************************************************************/
+/* Hash */
+
+static inline unsigned long long hash_rotl(unsigned long long x, unsigned r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline unsigned long long hash_fmix(unsigned long long k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static inline unsigned long long hash_read(const unsigned char* ptr, unsigned size)
+{
+	unsigned long long v = 0;
+	for(unsigned i=0;i<size;++i)
+		v |= (unsigned long long)ptr[i] << (i * 8);
+	return v;
+}
+
+/**
+ * Compute a 128 bits hash of the data.
+ * It's the MurmurHash3 x64 128 function, public domain by Austin Appleby.
+ */
+static void hash128(const unsigned char* data, unsigned size, unsigned long long* h)
+{
+	const unsigned long long c1 = 0x87c37b91114253d5ULL;
+	const unsigned long long c2 = 0x4cf5ad432745937fULL;
+	unsigned long long h1 = 0;
+	unsigned long long h2 = 0;
+	unsigned blocks = size / 16;
+
+	for(unsigned i=0;i<blocks;++i) {
+		unsigned long long k1 = hash_read(data + i * 16, 8);
+		unsigned long long k2 = hash_read(data + i * 16 + 8, 8);
+
+		k1 *= c1; k1 = hash_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = hash_rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+		k2 *= c2; k2 = hash_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = hash_rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	const unsigned char* tail = data + blocks * 16;
+	unsigned rest = size & 15;
+
+	if (rest > 8) {
+		unsigned long long k2 = hash_read(tail + 8, rest - 8);
+		k2 *= c2; k2 = hash_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+	}
+
+	if (rest > 0) {
+		unsigned long long k1 = hash_read(tail, rest > 8 ? 8 : rest);
+		k1 *= c1; k1 = hash_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= size;
+	h2 ^= size;
+
+	h1 += h2;
+	h2 += h1;
+
+	h1 = hash_fmix(h1);
+	h2 = hash_fmix(h2);
+
+	h1 += h2;
+	h2 += h1;
+
+	h[0] = h1;
+	h[1] = h2;
+}
+
+/***************************************************************************/
+/* Key */
+
+cache_key::cache_key() : crc(0)
+{
+}
+
+/**
+ * Set the key.
+ * \param kind Kind of compressed data.
+ * \param level Compression level, with all its options.
+ * \param flags Other options affecting the compression.
+ * \param data Uncompressed data.
+ * \param size Size of the uncompressed data.
+ */
+void cache_key::set(cache_kind_t kind, const shrink_t& level, unsigned flags, const unsigned char* data, unsigned size)
+{
+	unsigned long long h[2];
+
+	hash128(data, size, h);
+
+	ostringstream os;
+	os << hex << setfill('0') << setw(16) << h[0] << setw(16) << h[1];
+	os << dec << "-" << (unsigned)kind << "-" << (unsigned)level.level << "-" << level.iter << "-" << level.stop;
+	if (level.epsilon != 0) {
+		// the exact bits of the double, with only the characters allowed in the name
+		unsigned long long epsilon;
+		memcpy(&epsilon, &level.epsilon, sizeof(epsilon));
+		os << "-" << hex << setw(16) << epsilon << dec;
+	}
+	os << "-" << level.seed << "-" << level.tree << "-" << flags << "-" << size;
+
+	name = os.str();
+	crc = crc_compute((const char*)data, size);
+}
+
+/***************************************************************************/
+/* Cache */
+
+struct cache_item {
+	time_t time; /**< Time of the last use. */
+	unsigned long long size; /**< Size of the file. */
+};
+
+typedef map<string, cache_item> cache_map;
+
+static struct cache_state {
+	bool enabled;
+	string dir;
+	unsigned long long size_max;
+	unsigned long long size;
+	cache_map item;
+	unsigned counter; /**< Counter used for temporary names. */
+	unsigned hit;
+	unsigned miss;
+	unsigned evict;
+	thread_mutex mutex;
+} cache;
+
+static bool cache_name_is_valid(const string& name)
+{
+	// the temporary files, and any other file, are ignored
+	if (name.length() < 32)
+		return false;
+
+	return name.find_first_not_of("0123456789abcdef-") == string::npos;
+}
+
+/**
+ * Enable the cache.
+ * \param dir Directory of the cache. It's created if missing.
+ * \param size_max Maximum size of the cache in bytes.
+ */
+void cache_init(const string& dir, unsigned long long size_max)
+{
+	string path = dir;
+
+	if (path.length() > 1 && path[path.length() - 1] == '/')
+		path.erase(path.length() - 1, 1);
+
+	file_mktree(path + "/");
+
+	DIR* d = opendir(path.c_str());
+	if (!d)
+		throw error() << "Failed open dir " << path;
+
+	cache.size = 0;
+	cache.item.clear();
+
+	struct dirent* dd;
+	while ((dd = readdir(d)) != 0) {
+		string name = dd->d_name;
+
+		if (!cache_name_is_valid(name))
+			continue;
+
+		struct stat st;
+		if (stat((path + "/" + name).c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		cache_item i;
+		i.time = st.st_mtime;
+		i.size = st.st_size;
+
+		cache.item[name] = i;
+		cache.size += i.size;
+	}
+
+	closedir(d);
+
+	cache.dir = path;
+	cache.size_max = size_max;
+	cache.counter = 0;
+	cache.hit = 0;
+	cache.miss = 0;
+	cache.evict = 0;
+	cache.enabled = true;
+}
+
+bool cache_enabled()
+{
+	return cache.enabled;
+}
+
+/**
+ * Remove the least recently used items until the cache is below the limit.
+ * \note Call with the mutex locked.
+ */
+static void cache_shrink()
+{
+	if (cache.size <= cache.size_max)
+		return;
+
+	vector< pair<time_t, string> > order;
+	for(cache_map::const_iterator i=cache.item.begin();i!=cache.item.end();++i)
+		order.push_back(make_pair(i->second.time, i->first));
+	sort(order.begin(), order.end());
+
+	// remove a bit more, to not repeat the sort at every new item
+	unsigned long long limit = cache.size_max / 10 * 9;
+
+	for(vector< pair<time_t, string> >::iterator i=order.begin();i!=order.end() && cache.size > limit;++i) {
+		cache_map::iterator j = cache.item.find(i->second);
+
+		remove((cache.dir + "/" + i->second).c_str());
+
+		cache.size -= j->second.size;
+		cache.item.erase(j);
+		++cache.evict;
+	}
+}
+
+/**
+ * Update the item after a read or write.
+ * \note Call with the mutex locked.
+ */
+static void cache_touch(const string& name, unsigned long long size)
+{
+	cache_map::iterator i = cache.item.find(name);
+	if (i != cache.item.end()) {
+		cache.size -= i->second.size;
+	} else {
+		i = cache.item.insert(make_pair(name, cache_item())).first;
+	}
+
+	i->second.time = time(0);
+	i->second.size = size;
+	cache.size += size;
+}
+
+/**
+ * Read a cache file.
+ * \return If the file is valid. On failure the data may be allocated.
+ */
+static bool cache_read(FILE* f, const cache_key& key, unsigned& info, unsigned char*& data, unsigned& size, unsigned long long& length)
+{
+	const string& name = key.name_get();
+	unsigned char buf[CACHE_MAGIC_SIZE + 4];
+	unsigned char header[CACHE_HEADER_SIZE];
+
+	if (fread(buf, sizeof(buf), 1, f) != 1)
+		return false;
+
+	if (memcmp(buf, CACHE_MAGIC, CACHE_MAGIC_SIZE) != 0 || le_uint32_read(buf + CACHE_MAGIC_SIZE) != name.length())
+		return false;
+
+	// the full key is stored to detect any mismatch
+	string stored(name.length(), ' ');
+	if (fread(&stored[0], name.length(), 1, f) != 1 || stored != name)
+		return false;
+
+	if (fread(header, CACHE_HEADER_SIZE, 1, f) != 1)
+		return false;
+
+	info = le_uint32_read(header);
+	unsigned type = le_uint32_read(header + 4);
+	size = le_uint32_read(header + 8);
+
+	// a different uncompressed data with the same hash
+	if (le_uint32_read(header + 12) != key.crc_get())
+		return false;
+
+	length = CACHE_MAGIC_SIZE + 4 + name.length() + CACHE_HEADER_SIZE;
+
+	if (type == CACHE_TYPE_NOGAIN)
+		return true;
+
+	if (type != CACHE_TYPE_DATA)
+		return false;
+
+	data = data_alloc(size);
+
+	if (size && fread(data, size, 1, f) != 1)
+		return false;
+
+	// a damaged file
+	if (le_uint32_read(header + 16) != crc_compute((const char*)data, size))
+		return false;
+
+	length += size;
+
+	return true;
+}
+
+/**
+ * Search a result in the cache.
+ * \param key Key of the result.
+ * \param info Resulting information stored with the data.
+ * \param data Resulting data allocated with data_alloc(), or 0 if the result is a "no gain" marker.
+ * \param size Resulting size of the data, or for a "no gain" marker, the size that the compression was not able to improve.
+ * \return If the result was found.
+ */
+bool cache_get(const cache_key& key, unsigned& info, unsigned char*& data, unsigned& size)
+{
+	if (!cache.enabled)
+		return false;
+
+	const string& name = key.name_get();
+	string path = cache.dir + "/" + name;
+
+	FILE* f = fopen(path.c_str(), "rb");
+	if (!f)
+		return false;
+
+	unsigned long long length;
+
+	data = 0;
+
+	// an invalid file is handled as missing
+	if (!cache_read(f, key, info, data, size, length)) {
+		fclose(f);
+		data_free(data);
+		data = 0;
+		return false;
+	}
+
+	fclose(f);
+
+	// mark as recently used, also for other processes
+	utime(path.c_str(), 0);
+
+	thread_auto_lock lock(cache.mutex);
+
+	cache_touch(name, length);
+
+	return true;
+}
+
+/**
+ * Store a result in the cache.
+ * Any failure is ignored, as the cache is only an optimization.
+ * \param key Key of the result.
+ * \param type Type of the result.
+ * \param info Information to store with the data.
+ * \param data Compressed data, or 0 for a "no gain" marker.
+ * \param size Size of the data, or for a "no gain" marker, the size that the compression was not able to improve.
+ */
+static void cache_write(const cache_key& key, unsigned type, unsigned info, const unsigned char* data, unsigned size)
+{
+	if (!cache.enabled)
+		return;
+
+	const string& name = key.name_get();
+	string path = cache.dir + "/" + name;
+
+	ostringstream os;
+	{
+		thread_auto_lock lock(cache.mutex);
+		os << path << ".tmp" << getpid() << "-" << cache.counter++;
+	}
+	string tmp = os.str();
+
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if (!f)
+		return;
+
+	unsigned char buf[CACHE_MAGIC_SIZE + 4];
+	unsigned char header[CACHE_HEADER_SIZE];
+	unsigned long long length = CACHE_MAGIC_SIZE + 4 + name.length() + CACHE_HEADER_SIZE;
+
+	memcpy(buf, CACHE_MAGIC, CACHE_MAGIC_SIZE);
+	le_uint32_write(buf + CACHE_MAGIC_SIZE, name.length());
+	le_uint32_write(header, info);
+	le_uint32_write(header + 4, type);
+	le_uint32_write(header + 8, size);
+	le_uint32_write(header + 12, key.crc_get());
+	le_uint32_write(header + 16, type == CACHE_TYPE_DATA ? crc_compute((const char*)data, size) : 0);
+
+	bool ok = fwrite(buf, sizeof(buf), 1, f) == 1
+		&& fwrite(name.c_str(), name.length(), 1, f) == 1
+		&& fwrite(header, CACHE_HEADER_SIZE, 1, f) == 1;
+
+	if (ok && type == CACHE_TYPE_DATA && size) {
+		ok = fwrite(data, size, 1, f) == 1;
+		length += size;
+	}
+
+	if (fclose(f) != 0)
+		ok = false;
+
+#ifdef __WIN32__
+	// rename() doesn't overwrite on Windows
+	if (ok)
+		remove(path.c_str());
+#endif
+
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+		remove(tmp.c_str());
+		return;
+	}
+
+	thread_auto_lock lock(cache.mutex);
+
+	cache_touch(name, length);
+
+	cache_shrink();
+}
+
+void cache_put(const cache_key& key, unsigned info, const unsigned char* data, unsigned size)
+{
+	cache_write(key, CACHE_TYPE_DATA, info, data, size);
+}
+
+void cache_put_nogain(const cache_key& key, unsigned size)
+{
+	cache_write(key, CACHE_TYPE_NOGAIN, 0, 0, size);
+}
+
+/**
+ * Count a cache search.
+ * \param hit If the search found a usable result.
+ */
+void cache_stat(bool hit)
+{
+	thread_auto_lock lock(cache.mutex);
+
+	if (hit)
+		++cache.hit;
+	else
+		++cache.miss;
+}
+
+/**
+ * Print the cache statistics.
+ */
+void cache_print(ostream& os)
+{
+	thread_auto_lock lock(cache.mutex);
+
+	os << "Cache " << cache.hit << " hits, " << cache.miss << " misses";
+	if (cache.evict)
+		os << ", " << cache.evict << " evicted";
+	os << endl;
+}
+
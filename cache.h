@@ -0,0 +1,73 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2024 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include "except.h"
+
+#include <string>
+
+struct shrink_t;
+
+/**
+ * Kind of compressed data stored in the cache.
+ */
+enum cache_kind_t {
+	cache_zlib = 1, /**< Stream of compress_zlib(). */
+	cache_deflate = 2, /**< Stream of compress_deflate(). */
+	cache_zip = 3 /**< Best stream of zip_entry::shrink(). */
+};
+
+/**
+ * Default size limit of the cache in MB.
+ */
+#define CACHE_SIZE_DEFAULT 1024
+
+/**
+ * Key of a cached result.
+ * It's a hash of the uncompressed data with all the parameters
+ * affecting the compression.
+ */
+class cache_key {
+	std::string name;
+	unsigned crc; /**< CRC of the uncompressed data, stored to detect a hash collision. */
+public:
+	cache_key();
+
+	void set(cache_kind_t kind, const shrink_t& level, unsigned flags, const unsigned char* data, unsigned size);
+	bool is_set() const { return name.length() != 0; }
+
+	const std::string& name_get() const { return name; }
+	unsigned crc_get() const { return crc; }
+};
+
+void cache_init(const std::string& dir, unsigned long long size_max);
+bool cache_enabled();
+
+bool cache_get(const cache_key& key, unsigned& info, unsigned char*& data, unsigned& size);
+void cache_put(const cache_key& key, unsigned info, const unsigned char* data, unsigned size);
+void cache_put_nogain(const cache_key& key, unsigned size);
+
+void cache_stat(bool hit);
+void cache_print(std::ostream& os);
+
+#endif
+
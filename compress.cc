@@ -21,7 +21,19 @@
 #include "portable.h"
 
 #include "compress.h"
+#include "block.h"
+#include "cache.h"
 #include "data.h"
+#include "file.h"
+#include "thread.h"
+
+extern "C" {
+#include "zopfli/deflate.h"
+}
+
+#include <vector>
+
+using namespace std;
 
 bool decompress_deflate_zlib(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned out_size)
 {
@@ -180,15 +192,135 @@ bool compress_rfc1950_zlib(const unsigned char* in_data, unsigned in_size, unsig
 	return true;
 }
 
+/**
+ * Pool of the libdeflate contexts not in use.
+ * The contexts are kept to be reused by the next calls, avoiding to allocate
+ * and initialize them every time. At the higher levels they are large.
+ * Each context is used by a single thread at time.
+ * A __thread pointer isn't used because thread_for() starts new threads at
+ * each call, and their contexts would be lost at the thread exit, as __thread
+ * doesn't run destructors. The pool keeps them for the next threads.
+ */
+class libdeflate_pool {
+	thread_mutex mutex;
+	vector<struct libdeflate_compressor*> compressor[13]; // by compression level
+	vector<struct libdeflate_decompressor*> decompressor;
+
+public:
+	~libdeflate_pool();
+
+	struct libdeflate_compressor* compressor_get(int level);
+	void compressor_put(int level, struct libdeflate_compressor* c);
+	struct libdeflate_decompressor* decompressor_get();
+	void decompressor_put(struct libdeflate_decompressor* d);
+};
+
+static libdeflate_pool pool;
+
+libdeflate_pool::~libdeflate_pool()
+{
+	for(unsigned i=0;i<13;++i)
+		for(unsigned j=0;j<compressor[i].size();++j)
+			libdeflate_free_compressor(compressor[i][j]);
+	for(unsigned j=0;j<decompressor.size();++j)
+		libdeflate_free_decompressor(decompressor[j]);
+}
+
+struct libdeflate_compressor* libdeflate_pool::compressor_get(int level)
+{
+	if (level >= 0 && level < 13) {
+		thread_auto_lock lock(mutex);
+
+		if (!compressor[level].empty()) {
+			struct libdeflate_compressor* c = compressor[level].back();
+			compressor[level].pop_back();
+			return c;
+		}
+	}
+
+	return libdeflate_alloc_compressor(level);
+}
+
+void libdeflate_pool::compressor_put(int level, struct libdeflate_compressor* c)
+{
+	if (!c)
+		return;
+
+	if (level >= 0 && level < 13) {
+		thread_auto_lock lock(mutex);
+
+		compressor[level].push_back(c);
+		return;
+	}
+
+	libdeflate_free_compressor(c);
+}
+
+struct libdeflate_decompressor* libdeflate_pool::decompressor_get()
+{
+	{
+		thread_auto_lock lock(mutex);
+
+		if (!decompressor.empty()) {
+			struct libdeflate_decompressor* d = decompressor.back();
+			decompressor.pop_back();
+			return d;
+		}
+	}
+
+	return libdeflate_alloc_decompressor();
+}
+
+void libdeflate_pool::decompressor_put(struct libdeflate_decompressor* d)
+{
+	if (!d)
+		return;
+
+	thread_auto_lock lock(mutex);
+
+	decompressor.push_back(d);
+}
+
+bool decompress_deflate_libdeflate(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned out_size)
+{
+	struct libdeflate_decompressor* decompressor;
+	enum libdeflate_result r;
+
+	decompressor = pool.decompressor_get();
+	if (!decompressor)
+		return false;
+
+	// without the actual size, the data must decompress exactly to out_size
+	r = libdeflate_deflate_decompress(decompressor, in_data, in_size, out_data, out_size, 0);
+
+	pool.decompressor_put(decompressor);
+
+	return r == LIBDEFLATE_SUCCESS;
+}
+
+/**
+ * Decompress a deflate stream.
+ * It uses libdeflate, and zlib for the streams that libdeflate rejects.
+ */
+bool decompress_deflate(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned out_size)
+{
+	if (decompress_deflate_libdeflate(in_data, in_size, out_data, out_size))
+		return true;
+
+	return decompress_deflate_zlib(in_data, in_size, out_data, out_size);
+}
+
 bool compress_deflate_libdeflate(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned& out_size, int compression_level)
 {
 	struct libdeflate_compressor* compressor;
 
-	compressor = libdeflate_alloc_compressor(compression_level);
+	compressor = pool.compressor_get(compression_level);
+	if (!compressor)
+		return false;
 
 	out_size = libdeflate_deflate_compress(compressor, in_data, in_size, out_data, out_size);
 
-	libdeflate_free_compressor(compressor);
+	pool.compressor_put(compression_level, compressor);
 
 	if (!out_size)
 		return false;
@@ -200,11 +332,13 @@ bool compress_rfc1950_libdeflate(const unsigned char* in_data, unsigned in_size,
 {
 	struct libdeflate_compressor* compressor;
 
-	compressor = libdeflate_alloc_compressor(compression_level);
+	compressor = pool.compressor_get(compression_level);
+	if (!compressor)
+		return false;
 
 	out_size = libdeflate_zlib_compress(compressor, in_data, in_size, out_data, out_size);
 
-	libdeflate_free_compressor(compressor);
+	pool.compressor_put(compression_level, compressor);
 
 	if (!out_size)
 		return false;
@@ -232,21 +366,129 @@ bool decompress_bzip2(const unsigned char* in_data, unsigned in_size, unsigned c
 }
 #endif
 
-bool compress_zlib(shrink_t level, unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size)
+static struct compress_zopfli_state {
+	ZopfliStats stats;
+	thread_mutex mutex;
+} zopfli;
+
+/**
+ * Set the iteration stop from the N[,E] argument of the -I option.
+ */
+void shrink_stop_option(shrink_t& level, const char* arg)
+{
+	const char* e;
+
+	e = option_scan(arg, level.stop);
+	if (!e || (*e != 0 && *e != ','))
+		throw error() << "Invalid option -I";
+
+	if (*e == ',')
+		level.epsilon = option_double(e + 1, 'I', 0);
+}
+
+/**
+ * Initialize the zopfli options for the level.
+ * If requested, the data is compressed with libdeflate to seed zopfli.
+ * \param stats Statistics of the run, to pass later to compress_zopfli_done().
+ */
+void compress_zopfli_init(shrink_t level, const unsigned char* in_data, unsigned in_size, ZopfliOptions& opt, ZopfliStats& stats)
+{
+	ZopfliInitOptions(&opt);
+	opt.numiterations = level.iter > 5 ? level.iter : 5;
+	opt.binarytree = level.tree;
+	opt.stopiterations = level.stop;
+	opt.stopepsilon = level.epsilon * 8;
+	opt.cachelength = level.cache;
+
+	memset(&stats, 0, sizeof(stats));
+	opt.stats = &stats;
+
+	if (level.seed) {
+		unsigned seed_size = oversize_deflate(in_size);
+		unsigned char* seed_data = data_alloc(seed_size);
+
+		if (compress_deflate_libdeflate(in_data, in_size, seed_data, seed_size, 12)) {
+			opt.seed = seed_data;
+			opt.seedsize = seed_size;
+		} else {
+			data_free(seed_data);
+		}
+	}
+}
+
+/**
+ * Free the zopfli options, and add the statistics of the run to the global ones.
+ */
+void compress_zopfli_done(ZopfliOptions& opt, const ZopfliStats& stats)
+{
+	data_free(const_cast<unsigned char*>(opt.seed));
+	opt.seed = 0;
+
+	thread_auto_lock lock(zopfli.mutex);
+
+	zopfli.stats.blocks += stats.blocks;
+	zopfli.stats.iterations += stats.iterations;
+	zopfli.stats.stopped += stats.stopped;
+	zopfli.stats.skipped += stats.skipped;
+	for (unsigned i = 0; i < ZOPFLI_STATS_RANGES; ++i) {
+		zopfli.stats.gains[i] += stats.gains[i];
+		zopfli.stats.gain[i] += stats.gain[i];
+	}
+	if (stats.cachememory > zopfli.stats.cachememory)
+		zopfli.stats.cachememory = stats.cachememory;
+}
+
+/**
+ * Print the statistics of the zopfli iterations.
+ * For each range of iterations it's printed how many times they
+ * reduced the size of a block, and by how many bytes.
+ * It's also printed the biggest memory used by the match cache of a block.
+ */
+void compress_zopfli_print(ostream& os)
+{
+	thread_auto_lock lock(zopfli.mutex);
+
+	os << "Zopfli " << zopfli.stats.blocks << " blocks, " << zopfli.stats.iterations << " iterations";
+	if (zopfli.stats.stopped)
+		os << ", " << zopfli.stats.stopped << " blocks stopped early skipping " << zopfli.stats.skipped << " iterations";
+	os << endl;
+	if (zopfli.stats.blocks)
+		os << "Zopfli match cache " << zopfli.stats.cachememory / 1024 << " kB at most for a block" << endl;
+
+	unsigned last = 0;
+	for (unsigned i = 0; i < ZOPFLI_STATS_RANGES; ++i)
+		if (zopfli.stats.gains[i])
+			last = i;
+
+	for (unsigned i = 0; i <= last && zopfli.stats.blocks; ++i) {
+		unsigned begin = 1U << i;
+		unsigned end = 2 * begin - 1;
+		os << "Zopfli iterations " << begin;
+		if (i == ZOPFLI_STATS_RANGES - 1)
+			os << "+";
+		else if (end != begin)
+			os << "-" << end;
+		os << ": " << zopfli.stats.gains[i] << " gains, " << (unsigned long long)(zopfli.stats.gain[i] / 8) << " bytes" << endl;
+	}
+}
+
+static bool compress_zlib_run(shrink_t level, unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size)
 {
 	if (level.level == shrink_insane) {
 		ZopfliOptions opt_zopfli;
+		ZopfliStats stats;
 		unsigned char* data;
 		size_t size;
 
-		ZopfliInitOptions(&opt_zopfli);
-		opt_zopfli.numiterations = level.iter > 5 ? level.iter : 5;
+		compress_zopfli_init(level, in_data, in_size, opt_zopfli, stats);
 
 		size = 0;
 		data = 0;
 
 		ZopfliCompress(&opt_zopfli, ZOPFLI_FORMAT_ZLIB, in_data, in_size, &data, &size);
 
+		compress_zopfli_done(opt_zopfli, stats);
+
 		if (size < out_size) {
 			memcpy(out_data, data, size);
 			out_size = static_cast<unsigned>(size);
@@ -347,29 +589,63 @@ bool compress_zlib(shrink_t level, unsigned char* out_data, unsigned& out_size,
 	return true;
 }
 
-bool compress_deflate(shrink_t level, unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size)
+static bool compress_deflate_run(shrink_t level, unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size)
 {
+	// streams to mix, keeping the best blocks of each one
+	deflate_mixer mixer(in_size);
+
 	if (level.level == shrink_insane) {
 		ZopfliOptions opt_zopfli;
+		ZopfliStats stats;
 		unsigned char* data;
 		size_t size;
 		
-		ZopfliInitOptions(&opt_zopfli);
-		opt_zopfli.numiterations = level.iter > 5 ? level.iter : 5;
+		compress_zopfli_init(level, in_data, in_size, opt_zopfli, stats);
 
 		size = 0;
 		data = 0;
 
 		ZopfliCompress(&opt_zopfli, ZOPFLI_FORMAT_DEFLATE, in_data, in_size, &data, &size);
 
+		compress_zopfli_done(opt_zopfli, stats);
+
 		if (size < out_size) {
 			memcpy(out_data, data, size);
 			out_size = static_cast<unsigned>(size);
 		}
 
+		mixer.add(data, static_cast<unsigned>(size));
+
 		free(data);
 	}
 
+	// run 7z only to have another stream to mix, as libdeflate is usually better
+	if (level.level == shrink_extra && mixer.enabled()) {
+		unsigned sz_passes;
+		unsigned sz_fastbytes;
+		unsigned char* data;
+		unsigned size;
+
+		sz_passes = level.iter > 15 ? level.iter : 15;
+		if (sz_passes > 255)
+			sz_passes = 255;
+		sz_fastbytes = 255;
+
+		// the stream is useful to mix even if bigger
+		size = oversize_deflate(in_size);
+		data = data_alloc(size);
+
+		if (compress_deflate_7z(in_data, in_size, data, size, sz_passes, sz_fastbytes)) {
+			if (size <= out_size) {
+				memcpy(out_data, data, size);
+				out_size = size;
+			}
+			mixer.add(data, size);
+		}
+
+		data_free(data);
+	}
+
 	// note that in some case, 7z is better than zopfli
 	if (level.level == shrink_normal || level.level == shrink_extra || level.level == shrink_insane) {
 		int compression_level;
@@ -391,17 +667,23 @@ bool compress_deflate(shrink_t level, unsigned char* out_data, unsigned& out_siz
 			assert(0);
 		}
 
-		size = out_size;
+		size = oversize_deflate(in_size);
 		data = data_alloc(size);
 
 		if (compress_deflate_libdeflate(in_data, in_size, data, size, compression_level)) {
-			memcpy(out_data, data, size);
-			out_size = size;
+			if (size <= out_size) {
+				memcpy(out_data, data, size);
+				out_size = size;
+			}
+			mixer.add(data, size);
 		}
 
 		data_free(data);
 	}
 
+	if (level.level == shrink_extra || level.level == shrink_insane)
+		mixer.run(out_data, out_size, in_data);
+
 	if (level.level == shrink_none || level.level == shrink_fast) {
 		int libz_level;
 		unsigned char* data;
@@ -430,6 +712,144 @@ bool compress_deflate(shrink_t level, unsigned char* out_data, unsigned& out_siz
 	return true;
 }
 
+/**
+ * Compress using the result of a previous run, if present in the cache.
+ * The result is the same of the compression, as it depends only
+ * on the data and on the level, with the exception of the
+ * "no gain" marker, that is used only if out_size is not bigger.
+ */
+static bool compress_cached(cache_kind_t kind, bool (*run)(shrink_t, unsigned char*, unsigned&, const unsigned char*, unsigned), shrink_t level, unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size)
+{
+	if (!cache_enabled() || level.level == shrink_none)
+		return run(level, out_data, out_size, in_data, in_size);
+
+	cache_key key;
+	unsigned char* data;
+	unsigned size;
+	unsigned info;
+
+	key.set(kind, level, 0, in_data, in_size);
+
+	if (cache_get(key, info, data, size)) {
+		if (data) {
+			if (size < out_size) {
+				memcpy(out_data, data, size);
+				out_size = size;
+			}
+			data_free(data);
+			cache_stat(true);
+			return true;
+		}
+
+		// the compression was not able to go below this size
+		if (out_size <= size) {
+			cache_stat(true);
+			return true;
+		}
+	}
+
+	cache_stat(false);
+
+	unsigned limit = out_size;
+
+	if (!run(level, out_data, out_size, in_data, in_size))
+		return false;
+
+	if (out_size < limit)
+		cache_put(key, 0, out_data, out_size);
+	else
+		cache_put_nogain(key, limit);
+
+	return true;
+}
+
+bool compress_zlib(shrink_t level, unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size)
+{
+	return compress_cached(cache_zlib, compress_zlib_run, level, out_data, out_size, in_data, in_size);
+}
+
+bool compress_deflate(shrink_t level, unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size)
+{
+	return compress_cached(cache_deflate, compress_deflate_run, level, out_data, out_size, in_data, in_size);
+}
+
+/**
+ * Compress keeping the LZ77 data of an existing deflate stream of the same data.
+ * Only the block splitting and the Huffman codes are computed again,
+ * that is a lot faster than compressing.
+ * If the result is not smaller, the existing stream is kept.
+ * \return false if the existing stream is invalid, or of other data.
+ */
+bool compress_deflate_reentropy(unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size, const unsigned char* stream_data, unsigned stream_size)
+{
+	ZopfliOptions opt_zopfli;
+	unsigned char* data;
+	size_t size;
+	unsigned char bp;
+
+	ZopfliInitOptions(&opt_zopfli);
+
+	data = 0;
+	size = 0;
+	bp = 0;
+
+	if (!ZopfliDeflateReentropy(&opt_zopfli, 1, stream_data, stream_size, in_data, in_size, &bp, &data, &size)) {
+		free(data);
+		return false;
+	}
+
+	if (size < stream_size) {
+		if (size > out_size) {
+			free(data);
+			return false;
+		}
+		memcpy(out_data, data, size);
+		out_size = static_cast<unsigned>(size);
+	} else {
+		if (stream_size > out_size) {
+			free(data);
+			return false;
+		}
+		memcpy(out_data, stream_data, stream_size);
+		out_size = stream_size;
+	}
+
+	free(data);
+
+	return true;
+}
+
+/**
+ * Like compress_deflate_reentropy(), but for zlib streams.
+ */
+bool compress_zlib_reentropy(unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size, const unsigned char* stream_data, unsigned stream_size)
+{
+	// 2 bytes of header and 4 of adler32
+	if (stream_size < 6 || out_size < 6)
+		return false;
+
+	// deflate method without a preset dictionary
+	if ((stream_data[0] & 0x0F) != 8 || (stream_data[0] * 256 + stream_data[1]) % 31 != 0 || (stream_data[1] & 0x20) != 0)
+		return false;
+
+	unsigned size = out_size - 6;
+
+	if (!compress_deflate_reentropy(out_data + 2, size, in_data, in_size, stream_data + 2, stream_size - 6))
+		return false;
+
+	unsigned adler = libdeflate_adler32(1, in_data, in_size);
+
+	out_data[0] = stream_data[0];
+	out_data[1] = stream_data[1];
+	out_data[size + 2] = adler >> 24;
+	out_data[size + 3] = adler >> 16;
+	out_data[size + 4] = adler >> 8;
+	out_data[size + 5] = adler;
+	out_size = size + 6;
+
+	return true;
+}
+
 unsigned oversize_deflate(unsigned size)
 {
 	return size + size / 10 + 12;
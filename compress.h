@@ -37,6 +37,8 @@ extern "C" {
 
 #include <zlib.h>
 
+#include <iostream>
+
 #define RETRY_FOR_SMALL_FILES 65536 /**< Size for which we try multiple algorithms */
 
 unsigned oversize_deflate(unsigned size);
@@ -51,9 +53,12 @@ bool compress_bzip2(const unsigned char* in_data, unsigned in_size, unsigned cha
 bool decompress_rfc1950_zlib(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned out_size);
 bool compress_rfc1950_zlib(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned& out_size, int compression_level, int strategy, int mem_level);
 
+bool decompress_deflate_libdeflate(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned out_size);
 bool compress_deflate_libdeflate(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned& out_size, int compression_level);
 bool compress_rfc1950_libdeflate(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned& out_size, int compression_level);
 
+bool decompress_deflate(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned out_size);
+
 enum shrink_level_t {
 	shrink_none,
 	shrink_fast,
@@ -62,11 +67,27 @@ enum shrink_level_t {
 	shrink_insane
 };
 
+#define SHRINK_CACHE_DEFAULT 8 /**< Default of shrink_t::cache, the zopfli ZOPFLI_CACHE_LENGTH. */
+
 struct shrink_t {
 	enum shrink_level_t level;
 	unsigned iter;
+	unsigned stop; /**< Iterations without gain before stopping. 0 for never. */
+	double epsilon; /**< Bytes of gain ignored by the stop. */
+	bool seed; /**< Start zopfli from the libdeflate compression. */
+	bool tree; /**< Find the zopfli matches with a binary tree. */
+	unsigned cache; /**< Match distances cached by zopfli for each position. */
 };
 
+void shrink_stop_option(shrink_t& level, const char* arg);
+
+void compress_zopfli_init(shrink_t level, const unsigned char* in_data, unsigned in_size, ZopfliOptions& opt, ZopfliStats& stats);
+void compress_zopfli_done(ZopfliOptions& opt, const ZopfliStats& stats);
+void compress_zopfli_print(std::ostream& os);
+
+bool compress_deflate_reentropy(unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size, const unsigned char* stream_data, unsigned stream_size);
+bool compress_zlib_reentropy(unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size, const unsigned char* stream_data, unsigned stream_size);
+
 bool compress_zlib(shrink_t level, unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size);
 bool compress_deflate(shrink_t level, unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size);
 
@@ -29,7 +29,7 @@ using namespace std;
 /**
  * Duplicate a memory buffer.
  */
-unsigned char* data_dup(const unsigned char* Adata, unsigned Asize)
+unsigned char* data_dup(const unsigned char* Adata, size_t Asize)
 {
 	if (Adata) {
 		unsigned char* data = (unsigned char*)malloc(Asize);
@@ -46,7 +46,7 @@ unsigned char* data_dup(const unsigned char* Adata, unsigned Asize)
 /**
  * Allocate a memory buffer.
  */
-unsigned char* data_alloc(unsigned size)
+unsigned char* data_alloc(size_t size)
 {
 	unsigned char* data = (unsigned char*)malloc(size);
 	if (!data)
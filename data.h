@@ -21,8 +21,8 @@
 #ifndef __DATA_H
 #define __DATA_H
 
-unsigned char* data_dup(const unsigned char* Adata, unsigned Asize);
-unsigned char* data_alloc(unsigned size);
+unsigned char* data_dup(const unsigned char* Adata, size_t Asize);
+unsigned char* data_alloc(size_t size);
 void data_free(unsigned char* data);
 
 class data_ptr {
@@ -24,6 +24,14 @@
 
 #include <zlib.h>
 
+#if HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 using namespace std;
 
 crc_t crc_compute(const char* data, unsigned len)
@@ -131,6 +139,66 @@ void file_write(const string& path, const char* data, unsigned size)
 	fclose(f);
 }
 
+/**
+ * Create an empty file, reserving the space for its data.
+ * The data is then written with file_write_at(), also from different threads.
+ */
+void file_allocate(const string& path, unsigned long long size)
+{
+	int f = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (f < 0)
+		throw error() << "Failed open for write file " << path;
+
+#if HAVE_POSIX_FALLOCATE
+	// it's only an hint to reduce fragmentation, the writes extend the file anyway
+	if (size > 0)
+		posix_fallocate(f, 0, size);
+#else
+	(void)size;
+#endif
+
+	if (close(f) != 0)
+		throw error() << "Failed close file " << path;
+}
+
+/**
+ * Write data at the specified position of an existing file.
+ */
+void file_write_at(const string& path, const unsigned char* data, unsigned long long size, off_t offset)
+{
+	int f = open(path.c_str(), O_WRONLY | O_BINARY);
+	if (f < 0)
+		throw error() << "Failed open for write file " << path;
+
+#if !HAVE_PWRITE
+	if (lseek(f, offset, SEEK_SET) != offset) {
+		close(f);
+		throw error() << "Failed seek file " << path;
+	}
+#endif
+
+	while (size > 0) {
+		unsigned run = size > 0x40000000 ? 0x40000000 : size;
+
+#if HAVE_PWRITE
+		ssize_t done = pwrite(f, data, run, offset);
+#else
+		ssize_t done = write(f, data, run);
+#endif
+		if (done <= 0) {
+			close(f);
+			throw error() << "Failed write file " << path;
+		}
+
+		data += done;
+		size -= done;
+		offset += done;
+	}
+
+	if (close(f) != 0)
+		throw error() << "Failed close file " << path;
+}
+
 /**
  * Read a whole file.
  */
@@ -192,7 +260,7 @@ void file_utime(const string& path, time_t tod)
 /**
  * Get the size of a file.
  */
-unsigned file_size(const string& path)
+unsigned long long file_size(const string& path)
 {
 	struct stat s;
 	if (stat(path.c_str(), &s)!=0)
@@ -246,6 +314,99 @@ void file_copy(const string& path1, const string& path2)
 	operator delete(data);
 }
 
+#define COPY_RANGE_BLOCK_SIZE 0x40000000
+#define COPY_RANGE_BUFFER_SIZE (64*1024)
+
+/**
+ * Copy a file range in the kernel, without passing the data in user space.
+ * Where the filesystem supports it, the data extents may be also shared.
+ * \return The number of bytes copied, it may be less than requested if the kernel copy isn't supported.
+ */
+static unsigned long long file_copy_range_kernel(int fd_out, off_t& out, int fd_in, off_t& in, unsigned long long size)
+{
+	unsigned long long done = 0;
+
+#if HAVE_COPY_FILE_RANGE
+	while (done < size) {
+		unsigned long long remaining = size - done;
+		size_t run = remaining > COPY_RANGE_BLOCK_SIZE ? COPY_RANGE_BLOCK_SIZE : remaining;
+
+		ssize_t ret = copy_file_range(fd_in, &in, fd_out, &out, run, 0);
+		if (ret <= 0)
+			break; // not supported, like across filesystems in old kernels
+
+		done += ret;
+	}
+#endif
+
+#if HAVE_SENDFILE && HAVE_SYS_SENDFILE_H
+	if (done < size && lseek(fd_out, out, SEEK_SET) == out) {
+		while (done < size) {
+			unsigned long long remaining = size - done;
+			size_t run = remaining > COPY_RANGE_BLOCK_SIZE ? COPY_RANGE_BLOCK_SIZE : remaining;
+
+			ssize_t ret = sendfile(fd_out, fd_in, &in, run);
+			if (ret <= 0)
+				break; // not supported
+
+			out += ret;
+			done += ret;
+		}
+	}
+#else
+	(void)fd_out;
+	(void)fd_in;
+#endif
+
+	return done;
+}
+
+/**
+ * Copy a range of a file at the current position of another file.
+ * \param fo File to write, at its current position.
+ * \param fi File to read.
+ * \param offset Position of the data to copy in the file to read.
+ * \param size Size of the data to copy.
+ */
+void file_copy_range(FILE* fo, FILE* fi, off_t offset, unsigned long long size)
+{
+	// the copy is done on the file descriptor, and the buffered data must be written before
+	if (fflush(fo) != 0)
+		throw error() << "Failed flush";
+
+	off_t pos = ftello(fo);
+	if (pos < 0)
+		throw error() << "Failed tell";
+
+	unsigned long long done = file_copy_range_kernel(fileno(fo), pos, fileno(fi), offset, size);
+
+	// copy the remaining data with read and write
+	if (done < size) {
+		unsigned char buf[COPY_RANGE_BUFFER_SIZE];
+
+		if (fseeko(fi, offset, SEEK_SET) != 0)
+			throw error() << "Failed seek";
+		if (fseeko(fo, pos, SEEK_SET) != 0)
+			throw error() << "Failed seek";
+
+		while (done < size) {
+			unsigned long long remaining = size - done;
+			unsigned run = remaining > COPY_RANGE_BUFFER_SIZE ? COPY_RANGE_BUFFER_SIZE : remaining;
+
+			if (fread(buf, run, 1, fi) != 1)
+				throw error() << "Failed read";
+			if (fwrite(buf, run, 1, fo) != 1)
+				throw error() << "Failed write";
+
+			done += run;
+		}
+	} else {
+		// move the stream after the data written by the kernel
+		if (fseeko(fo, pos, SEEK_SET) != 0)
+			throw error() << "Failed seek";
+	}
+}
+
 /**
  * Move a file.
  */
@@ -438,3 +599,61 @@ void file_mktree(const std::string& path)
 }
 
 
+
+/**
+ * Scan an unsigned decimal number at the start of an option argument.
+ * \return The position after the number, or 0 if there isn't a valid number.
+ */
+const char* option_scan(const char* arg, unsigned& value)
+{
+	unsigned v = 0;
+
+	if (*arg < '0' || *arg > '9')
+		return 0;
+
+	while (*arg >= '0' && *arg <= '9') {
+		unsigned d = *arg - '0';
+		if (v > (UINT_MAX - d) / 10)
+			return 0;
+		v = v * 10 + d;
+		++arg;
+	}
+
+	value = v;
+	return arg;
+}
+
+/**
+ * Get the unsigned number argument of an option.
+ * The whole argument must be a number in the specified range.
+ */
+unsigned option_unsigned(const char* arg, char opt, unsigned min, unsigned max)
+{
+	unsigned v;
+	const char* e;
+
+	e = option_scan(arg, v);
+	if (!e || *e != 0)
+		throw error() << "Invalid option -" << string(1, opt);
+	if (v < min || v > max)
+		throw error() << "Invalid argument for option -" << string(1, opt);
+
+	return v;
+}
+
+/**
+ * Get the floating point argument of an option.
+ */
+double option_double(const char* arg, char opt, double min)
+{
+	char* e;
+	double v;
+
+	v = strtod(arg, &e);
+	if (e == arg || *e != 0)
+		throw error() << "Invalid option -" << string(1, opt);
+	if (!(v >= min))
+		throw error() << "Invalid argument for option -" << string(1, opt);
+
+	return v;
+}
@@ -69,13 +69,16 @@ crc_t crc_compute(crc_t pred, const char* data, unsigned len);
 
 bool file_exists(const std::string& file);
 void file_write(const std::string& path, const char* data, unsigned size);
+void file_allocate(const std::string& path, unsigned long long size);
+void file_write_at(const std::string& path, const unsigned char* data, unsigned long long size, off_t offset);
 void file_read(const std::string& path, char* data, unsigned size);
 void file_read(const std::string& path, char* data, unsigned offset, unsigned size);
 time_t file_time(const std::string& path);
 void file_utime(const std::string& path, time_t tod);
-unsigned file_size(const std::string& path);
+unsigned long long file_size(const std::string& path);
 crc_t file_crc(const std::string& path);
 void file_copy(const std::string& path1, const std::string& path2);
+void file_copy_range(FILE* fo, FILE* fi, off_t offset, unsigned long long size);
 void file_move(const std::string& path1, const std::string& path2);
 void file_remove(const std::string& path1);
 void file_mktree(const std::string& path1);
@@ -90,5 +93,9 @@ std::string file_ext(const std::string& file) throw ();
 int file_compare(const std::string& path1, const std::string& path2) throw ();
 std::string file_adjust(const std::string& path) throw ();
 
+const char* option_scan(const char* arg, unsigned& value);
+unsigned option_unsigned(const char* arg, char opt, unsigned min, unsigned max);
+double option_double(const char* arg, char opt, double min);
+
 #endif
 
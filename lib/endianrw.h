@@ -294,6 +294,29 @@ static inline void le_uint32_write(void* ptr, unsigned v)
 #endif
 }
 
+static inline void cpu_uint64_write(void* ptr, uint64 v)
+{
+	uint64* ptr64 = (uint64*)ptr;
+	ptr64[0] = v;
+}
+
+static inline void le_uint64_write(void* ptr, uint64 v)
+{
+#ifdef USE_LSB
+	cpu_uint64_write(ptr, v);
+#else
+	unsigned char* ptr8 = (unsigned char*)ptr;
+	ptr8[0] = (unsigned char)(v & 0xFF);
+	ptr8[1] = (unsigned char)((v >> 8) & 0xFF);
+	ptr8[2] = (unsigned char)((v >> 16) & 0xFF);
+	ptr8[3] = (unsigned char)((v >> 24) & 0xFF);
+	ptr8[4] = (unsigned char)((v >> 32) & 0xFF);
+	ptr8[5] = (unsigned char)((v >> 40) & 0xFF);
+	ptr8[6] = (unsigned char)((v >> 48) & 0xFF);
+	ptr8[7] = (unsigned char)((v >> 56) & 0xFF);
+#endif
+}
+
 static inline void be_uint32_write(void* ptr, unsigned v)
 {
 #ifdef USE_MSB
@@ -47,15 +47,25 @@
  */
 #define ERROR_DESC_MAX 2048
 
+/**
+ * Storage of the error state.
+ * Each thread has its own error, if supported.
+ */
+#if HAVE_THREAD_LOCAL
+#define ERROR_LOCAL __thread
+#else
+#define ERROR_LOCAL
+#endif
+
 /**
  * Last error description.
  */
-static char error_desc_buffer[ERROR_DESC_MAX];
+static ERROR_LOCAL char error_desc_buffer[ERROR_DESC_MAX];
 
 /**
  * Flag set if an unsupported feature is found.
  */
-static adv_bool error_unsupported_flag;
+static ERROR_LOCAL adv_bool error_unsupported_flag;
 
 /**
  * Flag for cat mode.
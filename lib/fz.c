@@ -326,7 +326,7 @@ err:
  * \param offset Offset in the archive.
  * \param size Size of the data.
  */
-adv_fz* fzopenzipuncompressed(const char* file, off_t offset, unsigned size)
+adv_fz* fzopenzipuncompressed(const char* file, off_t offset, off_t size)
 {
 	unsigned char buf[ZIP_LO_FIXED];
 	unsigned filename_length;
@@ -413,7 +413,7 @@ static void compressed_done(adv_fz* f)
  * \param size_compressed Size of the compressed data.
  * \param size_uncompressed Size of the uncompressed data.
  */
-adv_fz* fzopenzipcompressed(const char* file, off_t offset, unsigned size_compressed, unsigned size_uncompressed)
+adv_fz* fzopenzipcompressed(const char* file, off_t offset, off_t size_compressed, off_t size_uncompressed)
 {
 	unsigned char buf[ZIP_LO_FIXED];
 	unsigned filename_length;
@@ -83,8 +83,8 @@ typedef struct adv_fz_struct {
 
 adv_fz* fzopen(const char* file, const char* mode);
 adv_fz* fzopennullwrite(const char* file, const char* mode);
-adv_fz* fzopenzipuncompressed(const char* file, off_t offset, unsigned size);
-adv_fz* fzopenzipcompressed(const char* file, off_t offset, unsigned size_compressed, unsigned size_uncompressed);
+adv_fz* fzopenzipuncompressed(const char* file, off_t offset, off_t size);
+adv_fz* fzopenzipcompressed(const char* file, off_t offset, off_t size_compressed, off_t size_uncompressed);
 adv_fz* fzopenmemory(const unsigned char* data, unsigned size);
 
 size_t fzread(void *buffer, size_t size, size_t number, adv_fz* f);
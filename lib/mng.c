@@ -80,7 +80,7 @@ adv_error adv_mng_write_signature(adv_fz* f, unsigned* count)
 	return 0;
 }
 
-static adv_error mng_read_ihdr(adv_mng* mng, adv_fz* f, const unsigned char* ihdr, unsigned ihdr_size)
+static adv_error mng_read_ihdr(adv_mng* mng, adv_fz* f, const unsigned char* ihdr, unsigned ihdr_size, adv_bool skip)
 {
 	unsigned type;
 	unsigned char* data;
@@ -185,6 +185,14 @@ static adv_error mng_read_ihdr(adv_mng* mng, adv_fz* f, const unsigned char* ihd
 		goto err_data;
 	}
 
+	/* an image is always a keyframe */
+	mng->key_flag = 1;
+
+	if (skip) {
+		free(data);
+		goto iend;
+	}
+
 	if (bit_per_pixel == 8) {
 		/* plain read */
 		dat_size = mng->dat_size;
@@ -303,6 +311,7 @@ static adv_error mng_read_ihdr(adv_mng* mng, adv_fz* f, const unsigned char* ihd
 	else if (mng->pixel == 4)
 		adv_png_unfilter_32(mng->dat_width * mng->pixel, mng->dat_height, mng->dat_ptr, mng->dat_line);
 
+iend:
 	if (adv_png_read_chunk(f, &data, &size, &type) != 0)
 		goto err;
 
@@ -450,7 +459,7 @@ static int mng_delta_addition(adv_mng* mng, unsigned dlt_size, unsigned pos_x, u
 	return 0;
 }
 
-static adv_error mng_read_delta(adv_mng* mng, adv_fz* f, unsigned char* dhdr, unsigned dhdr_size)
+static adv_error mng_read_delta(adv_mng* mng, adv_fz* f, unsigned char* dhdr, unsigned dhdr_size, adv_bool skip)
 {
 	unsigned type;
 	unsigned char* data;
@@ -484,17 +493,6 @@ static adv_error mng_read_delta(adv_mng* mng, adv_fz* f, unsigned char* dhdr, un
 		goto err;
 	}
 
-	if (!mng->dat_ptr) {
-		error_set("Invalid delta context in DHDR chunk");
-		goto err;
-	}
-
-	if (!mng->dlt_ptr) {
-		mng->dlt_line = mng->frame_width * mng->pixel + 1; /* +1 for the filter byte */
-		mng->dlt_size = mng->frame_height * mng->dlt_line;
-		mng->dlt_ptr = malloc(mng->dlt_size);
-	}
-
 	if (dhdr_size >= 12) {
 		width = be_uint32_read(dhdr + 4);
 		height = be_uint32_read(dhdr + 8);
@@ -511,6 +509,26 @@ static adv_error mng_read_delta(adv_mng* mng, adv_fz* f, unsigned char* dhdr, un
 		pos_y = 0;
 	}
 
+	/* a replacement of the whole image doesn't depend on the previous frames */
+	mng->key_flag = (ope == 0 || ope == 4)
+		&& pos_x == 0 && pos_y == 0
+		&& width == mng->dat_width && height == mng->dat_height;
+
+	if (!mng->dat_ptr) {
+		/* a keyframe is able to restart the decoding without the previous image */
+		if (!mng->key_flag || mng->dat_size == 0) {
+			error_set("Invalid delta context in DHDR chunk");
+			goto err;
+		}
+		mng->dat_ptr = malloc(mng->dat_size);
+	}
+
+	if (!mng->dlt_ptr) {
+		mng->dlt_line = mng->frame_width * mng->pixel + 1; /* +1 for the filter byte */
+		mng->dlt_size = mng->frame_height * mng->dlt_line;
+		mng->dlt_ptr = malloc(mng->dlt_size);
+	}
+
 	if (adv_png_read_chunk(f, &data, &size, &type) != 0)
 		goto err;
 
@@ -578,6 +596,13 @@ static adv_error mng_read_delta(adv_mng* mng, adv_fz* f, unsigned char* dhdr, un
 			goto err_data;
 		}
 
+		if (skip) {
+			free(data);
+			if (adv_png_read_chunk(f, &data, &size, &type) != 0)
+				goto err;
+			goto iend;
+		}
+
 		dlt_size = mng->dlt_size;
 		if (uncompress(mng->dlt_ptr, &dlt_size, data, size) != Z_OK) {
 			error_set("Corrupt compressed data in IDAT chunk");
@@ -610,6 +635,7 @@ static adv_error mng_read_delta(adv_mng* mng, adv_fz* f, unsigned char* dhdr, un
 		}
 	}
 
+iend:
 	if (adv_png_read_iend(f, data, size, type) != 0)
 		goto err_data;
 
@@ -666,7 +692,8 @@ static adv_error mng_read(
 	unsigned char** pal_ptr, unsigned* pal_size,
 	unsigned* tick,
 	adv_fz* f,
-	adv_bool own)
+	adv_bool own,
+	adv_bool skip)
 {
 	unsigned type;
 	unsigned char* data;
@@ -693,16 +720,18 @@ static adv_error mng_read(
 				free(data);
 				break;
 			case ADV_PNG_CN_IHDR :
-				if (mng_read_ihdr(mng, f, data, size) != 0)
+				if (mng_read_ihdr(mng, f, data, size, skip) != 0)
 					goto err_data;
 				free(data);
-				mng_import(mng, pix_width, pix_height, pix_pixel, dat_ptr, dat_size, pix_ptr, pix_scanline, pal_ptr, pal_size, own);
+				if (!skip)
+					mng_import(mng, pix_width, pix_height, pix_pixel, dat_ptr, dat_size, pix_ptr, pix_scanline, pal_ptr, pal_size, own);
 				return 0;
 			case ADV_MNG_CN_DHDR :
-				if (mng_read_delta(mng, f, data, size) != 0)
+				if (mng_read_delta(mng, f, data, size, skip) != 0)
 					goto err_data;
 				free(data);
-				mng_import(mng, pix_width, pix_height, pix_pixel, dat_ptr, dat_size, pix_ptr, pix_scanline, pal_ptr, pal_size, own);
+				if (!skip)
+					mng_import(mng, pix_width, pix_height, pix_pixel, dat_ptr, dat_size, pix_ptr, pix_scanline, pal_ptr, pal_size, own);
 				return 0;
 			case ADV_MNG_CN_MEND :
 				mng->end_flag = 1;
@@ -793,7 +822,7 @@ adv_error adv_mng_read(
 {
 	return mng_read(mng, pix_width, pix_height, pix_pixel,
 		dat_ptr, dat_size, pix_ptr, pix_scanline,
-		pal_ptr, pal_size, tick, f, 0);
+		pal_ptr, pal_size, tick, f, 0, 0);
 }
 
 /**
@@ -815,7 +844,7 @@ adv_error adv_mng_read_done(
 
 	r = mng_read(mng, pix_width, pix_height, pix_pixel,
 		dat_ptr, dat_size, pix_ptr, pix_scanline,
-		pal_ptr, pal_size, tick, f, 1);
+		pal_ptr, pal_size, tick, f, 1, 0);
 
 	if (r != 0)
 		free(mng->dat_ptr);
@@ -825,6 +854,66 @@ adv_error adv_mng_read_done(
 	return r;
 }
 
+/**
+ * Skip a MNG image.
+ * The chunks of the image are read, but the image data is not decoded.
+ * It's used to scan the stream searching for keyframes with adv_mng_key_get().
+ * After a skip, adv_mng_read() is able to continue the decoding only
+ * from a keyframe.
+ * \param mng MNG context previously returned by mng_init().
+ * \param tick Where to put the number of tick of the frame.
+ * \param f File to read.
+ * \return
+ *   - == 0 ok
+ *   - == 1 end of the mng stream
+ *   - < 0 error
+ */
+adv_error adv_mng_skip(adv_mng* mng, unsigned* tick, adv_fz* f)
+{
+	return mng_read(mng, 0, 0, 0, 0, 0, 0, 0, 0, 0, tick, f, 0, 1);
+}
+
+/**
+ * Check if the last image read is a keyframe.
+ * A keyframe replaces the whole image, and it doesn't depend on the previous ones.
+ * \param mng MNG context.
+ */
+adv_bool adv_mng_key_get(adv_mng* mng)
+{
+	return mng->key_flag;
+}
+
+/**
+ * Duplicate a MNG context.
+ * The duplicated context continues the decoding from the same position.
+ * If the image buffer of the context is 0, the decoding can continue
+ * only from a keyframe.
+ * \param mng MNG context to duplicate.
+ * \return Return the new MNG context. It must be destroied calling mng_done(). On error return 0.
+ */
+adv_mng* adv_mng_dup(const adv_mng* mng)
+{
+	adv_mng* dup;
+
+	dup = malloc(sizeof(adv_mng));
+	if (!dup)
+		return 0;
+
+	*dup = *mng;
+
+	if (mng->dat_ptr) {
+		dup->dat_ptr = malloc(mng->dat_size);
+		memcpy(dup->dat_ptr, mng->dat_ptr, mng->dat_size);
+	}
+
+	if (mng->dlt_ptr) {
+		dup->dlt_ptr = malloc(mng->dlt_size);
+		memcpy(dup->dlt_ptr, mng->dlt_ptr, mng->dlt_size);
+	}
+
+	return dup;
+}
+
 /**
  * Initialize a MNG reading stream.
  * \param f File to read.
@@ -843,6 +932,7 @@ adv_mng* adv_mng_init(adv_fz* f)
 		goto err;
 
 	mng->end_flag = 0;
+	mng->key_flag = 0;
 	mng->pixel = 0;
 	mng->dat_ptr = 0;
 	mng->dat_size = 0;
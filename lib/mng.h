@@ -63,6 +63,7 @@ extern "C" {
  */
 typedef struct adv_mng_struct {
 	int end_flag; /**< End flag. */
+	int key_flag; /**< If the last image read is a keyframe. */
 	unsigned pixel; /**< Bytes per pixel. */
 	unsigned char* dat_ptr; /**< Current image buffer. */
 	unsigned dat_size; /**< Size of the buffer image. */
@@ -119,6 +120,9 @@ adv_error adv_mng_read_done(
 	unsigned* tick,
 	adv_fz* f
 );
+adv_error adv_mng_skip(adv_mng* mng, unsigned* tick, adv_fz* f);
+adv_bool adv_mng_key_get(adv_mng* mng);
+adv_mng* adv_mng_dup(const adv_mng* mng);
 unsigned adv_mng_frequency_get(adv_mng* mng);
 unsigned adv_mng_width_get(adv_mng* mng);
 unsigned adv_mng_height_get(adv_mng* mng);
@@ -28,8 +28,105 @@
 #include <iostream>
 #include <iomanip>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
+static inline unsigned long long hash_rotl(unsigned long long v, int r)
+{
+	return (v << r) | (v >> (64 - r));
+}
+
+static inline unsigned long long hash_fmix(unsigned long long v)
+{
+	v ^= v >> 33;
+	v *= 0xff51afd7ed558ccdULL;
+	v ^= v >> 33;
+	v *= 0xc4ceb9fe1a85ec53ULL;
+	v ^= v >> 33;
+	return v;
+}
+
+/**
+ * Add data at the hash.
+ * It's the MurmurHash3 x64 128 bit mixing, applied in sequence at each block of data.
+ */
+static void hash_update(adv_mng_hash* hash, const unsigned char* ptr, unsigned size)
+{
+	const unsigned long long c1 = 0x87c37b91114253d5ULL;
+	const unsigned long long c2 = 0x4cf5ad432745937fULL;
+	unsigned long long h1 = hash->h1;
+	unsigned long long h2 = hash->h2;
+	unsigned long long k1;
+	unsigned long long k2;
+	unsigned char tail[16];
+
+	while (size >= 16) {
+		memcpy(&k1, ptr, 8);
+		memcpy(&k2, ptr + 8, 8);
+
+		k1 *= c1; k1 = hash_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = hash_rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = hash_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = hash_rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+
+		ptr += 16;
+		size -= 16;
+	}
+
+	if (size) {
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, ptr, size);
+		memcpy(&k1, tail, 8);
+		memcpy(&k2, tail + 8, 8);
+
+		k1 *= c1; k1 = hash_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+		k2 *= c2; k2 = hash_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+		h1 = hash_rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		h2 = hash_rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	hash->h1 = h1;
+	hash->h2 = h2;
+}
+
+void mng_frame_hash(adv_mng_hash* hash, unsigned width, unsigned height, unsigned pixel, const unsigned char* img_ptr, unsigned img_scanline, const unsigned char* pal_ptr, unsigned pal_size)
+{
+	unsigned long long size;
+	unsigned i;
+
+	hash->h1 = width | (unsigned long long)height << 32;
+	hash->h2 = pixel | (unsigned long long)pal_size << 32;
+
+	if (img_scanline == width * pixel) {
+		hash_update(hash, img_ptr, height * img_scanline);
+	} else {
+		for(i=0;i<height;++i)
+			hash_update(hash, img_ptr + i * img_scanline, width * pixel);
+	}
+
+	if (pal_ptr && pal_size)
+		hash_update(hash, pal_ptr, pal_size);
+
+	size = (unsigned long long)height * width * pixel + pal_size;
+
+	hash->h1 ^= size;
+	hash->h2 ^= size;
+	hash->h1 += hash->h2;
+	hash->h2 += hash->h1;
+	hash->h1 = hash_fmix(hash->h1);
+	hash->h2 = hash_fmix(hash->h2);
+	hash->h1 += hash->h2;
+	hash->h2 += hash->h1;
+}
+
+adv_bool mng_frame_hash_equal(const adv_mng_hash* A, const adv_mng_hash* B)
+{
+	return A->h1 == B->h1 && A->h2 == B->h2;
+}
+
 static bool mng_write_reduce(adv_mng_write* mng, data_ptr& out_ptr, unsigned& out_scanline, unsigned char* ovr_ptr, unsigned char* img_ptr, unsigned img_scanline)
 {
 	unsigned char col_ptr[256*3];
@@ -117,6 +214,53 @@ static bool mng_write_reduce(adv_mng_write* mng, data_ptr& out_ptr, unsigned& ou
 	return true;
 }
 
+static inline unsigned global_hash(unsigned key)
+{
+	return (key * 2654435761U) >> 22; /* top 10 bits */
+}
+
+/**
+ * Reduce the image to 256 colors with the global palette.
+ */
+static bool mng_write_reduce_global(adv_mng_write* mng, data_ptr& out_ptr, unsigned& out_scanline, unsigned char* img_ptr, unsigned img_scanline)
+{
+	unsigned i, j;
+	unsigned char* new_ptr;
+	unsigned new_scanline;
+
+	new_scanline = mng->width;
+	new_ptr = data_alloc(mng->height * new_scanline);
+	for(i=0;i<mng->height;++i) {
+		unsigned char* p0 = new_ptr + i*new_scanline;
+		unsigned char* p1 = img_ptr + i*img_scanline;
+		unsigned last = 0;
+		unsigned char index = 0;
+		for(j=0;j<mng->width;++j) {
+			unsigned key = (p1[0] << 16 | p1[1] << 8 | p1[2]) + 1;
+			if (key != last) {
+				unsigned k = global_hash(key);
+				while (mng->global_key[k] != key) {
+					if (mng->global_key[k] == 0) {
+						data_free(new_ptr);
+						return false; /* color not in the palette */
+					}
+					k = (k + 1) % 1024;
+				}
+				last = key;
+				index = mng->global_index[k];
+			}
+			*p0 = index;
+			++p0;
+			p1 += 3;
+		}
+	}
+
+	out_ptr = new_ptr;
+	out_scanline = new_scanline;
+
+	return true;
+}
+
 static void mng_write_expand(adv_mng_write* mng, data_ptr& out_ptr, unsigned& out_scanline, const unsigned char* img_ptr, unsigned img_scanline, unsigned char* pal_ptr)
 {
 	unsigned char* new_ptr;
@@ -209,97 +353,146 @@ void mng_write_header(adv_mng_write* mng, adv_fz* f, unsigned* fc, unsigned widt
 
 	mng->tick = 1;
 
+	mng->frequency = frequency;
+	mng->key_count = 0;
+	mng->key_tick = 0;
+	mng->key_size = 0;
+
 	mng->header_written = 1;
 	mng->header_simplicity = simplicity;
 }
 
-static bool row_equal(adv_mng_write* mng, unsigned y, unsigned char* img_ptr, unsigned img_scanline)
+/**
+ * Position of the first different byte of two rows.
+ * \return The byte position, or size if the rows are equal.
+ */
+static unsigned diff_first(const unsigned char* p0, const unsigned char* p1, unsigned size)
 {
-	unsigned char* p0;
-	unsigned char* p1;
+	unsigned i = 0;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+	for(;i+16<=size;i+=16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(p0 + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(p1 + i));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xFFFF;
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#else
+	for(;i+8<=size;i+=8) {
+		unsigned long long a, b;
+		memcpy(&a, p0 + i, 8);
+		memcpy(&b, p1 + i, 8);
+		if (a != b)
+			break;
+	}
+#endif
 
-	p0 = mng->current_ptr + y * mng->line;
-	p1 = img_ptr + y * img_scanline;
+	for(;i<size;++i)
+		if (p0[i] != p1[i])
+			return i;
 
-	return memcmp(p0, p1, mng->width * mng->pixel) == 0;
+	return size;
 }
 
-static bool col_equal(adv_mng_write* mng, unsigned x, unsigned char* img_ptr, unsigned img_scanline)
+/**
+ * Position after the last different byte of two rows.
+ * \return The byte position + 1, or 0 if the rows are equal.
+ */
+static unsigned diff_last(const unsigned char* p0, const unsigned char* p1, unsigned size)
 {
-	unsigned char* p0;
-	unsigned char* p1;
-	unsigned i;
-
-	p0 = mng->current_ptr + x * mng->pixel;
-	p1 = img_ptr + x * mng->pixel;
-
-	if (mng->pixel == 1) {
-		for(i=0;i<mng->height;++i) {
-			if (p0[0] != p1[0])
-				return false;
-			p0 += mng->line;
-			p1 += img_scanline;
-		}
-	} else if (mng->pixel == 3) {
-		for(i=0;i<mng->height;++i) {
-			if (p0[0] != p1[0] || p0[1] != p1[1] || p0[2] != p1[2])
-				return false;
-			p0 += mng->line;
-			p1 += img_scanline;
-		}
-	} else if (mng->pixel == 4) {
-		for(i=0;i<mng->height;++i) {
-			if (p0[0] != p1[0] || p0[1] != p1[1] || p0[2] != p1[2] || p0[3] != p1[3])
-				return false;
-			p0 += mng->line;
-			p1 += img_scanline;
-		}
-	} else {
-		throw error() << "Unsupported bit depth";
+	unsigned i = size;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+	for(;i>=16;i-=16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(p0 + i - 16));
+		__m128i b = _mm_loadu_si128((const __m128i*)(p1 + i - 16));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xFFFF;
+		if (mask)
+			return i - 16 + 32 - __builtin_clz(mask);
 	}
+#else
+	for(;i>=8;i-=8) {
+		unsigned long long a, b;
+		memcpy(&a, p0 + i - 8, 8);
+		memcpy(&b, p1 + i - 8, 8);
+		if (a != b)
+			break;
+	}
+#endif
 
-	return true;
+	for(;i>0;--i)
+		if (p0[i - 1] != p1[i - 1])
+			return i;
+
+	return 0;
 }
 
+/**
+ * Compute the bounding box of the changed pixels.
+ * The rows are scanned only once, in memory order.
+ */
 static void compute_image_range(adv_mng_write* mng, unsigned* out_x, unsigned* out_y, unsigned* out_dx, unsigned* out_dy, unsigned char* img_ptr, unsigned img_scanline)
 {
-	unsigned x;
-	unsigned dx;
-	unsigned y;
-	unsigned dy;
-
-	x = 0;
-	while (x < mng->width && col_equal(mng, x, img_ptr, img_scanline))
-		++x;
-
-	dx = mng->width - x;
-	while (dx > 0 && col_equal(mng, x + dx - 1, img_ptr, img_scanline))
-		--dx;
-
-	y = 0;
-	while (y < mng->height && row_equal(mng, y, img_ptr, img_scanline))
-		++y;
-
-	dy = mng->height - y;
-	while (dy > 0 && row_equal(mng, y + dy - 1, img_ptr, img_scanline))
-		--dy;
-
-	*out_x = x;
-	*out_y = y;
-	*out_dx = dx;
-	*out_dy = dy;
+	unsigned x0 = mng->width; /* first changed column */
+	unsigned x1 = 0; /* last changed column + 1 */
+	unsigned y0 = mng->height; /* first changed row */
+	unsigned y1 = 0; /* last changed row + 1 */
+	unsigned size = mng->width * mng->pixel;
+	unsigned i;
+
+	for(i=0;i<mng->height;++i) {
+		const unsigned char* p0 = mng->current_ptr + i * mng->line;
+		const unsigned char* p1 = img_ptr + i * img_scanline;
+		unsigned first;
+		unsigned last;
+
+		first = diff_first(p0, p1, size);
+		if (first == size)
+			continue;
+
+		if (y0 == mng->height)
+			y0 = i;
+		y1 = i + 1;
+
+		if (first / mng->pixel < x0)
+			x0 = first / mng->pixel;
+
+		/* search the last change only after the already known range */
+		last = diff_last(p0 + x1 * mng->pixel, p1 + x1 * mng->pixel, size - x1 * mng->pixel);
+		if (last)
+			x1 += (last - 1) / mng->pixel + 1;
+	}
+
+	if (y0 == mng->height) {
+		/* no change */
+		*out_x = mng->width;
+		*out_y = mng->height;
+		*out_dx = 0;
+		*out_dy = 0;
+	} else {
+		*out_x = x0;
+		*out_y = y0;
+		*out_dx = x1 - x0;
+		*out_dy = y1 - y0;
+	}
 }
 
-static void mng_write_store(adv_mng_write* mng, unsigned char* img_ptr, unsigned img_scanline, unsigned char* pal_ptr, unsigned pal_size)
+static void mng_write_store_palette(adv_mng_write* mng, unsigned char* pal_ptr, unsigned pal_size)
 {
-	unsigned i;
-
 	if (pal_size) {
 		memcpy(mng->pal_ptr, pal_ptr, pal_size);
 		memset(mng->pal_ptr + pal_size, 0, 256*3 - pal_size);
 		if (pal_size > mng->pal_size)
 			mng->pal_size = pal_size;
 	}
+}
+
+static void mng_write_store(adv_mng_write* mng, unsigned char* img_ptr, unsigned img_scanline, unsigned char* pal_ptr, unsigned pal_size)
+{
+	unsigned i;
+
+	mng_write_store_palette(mng, pal_ptr, pal_size);
 
 	for(i=0;i<mng->height;++i) {
 		memcpy(&mng->current_ptr[i * mng->line], &img_ptr[i * img_scanline], mng->width * mng->pixel);
@@ -361,6 +554,8 @@ static void mng_write_first(adv_mng_write* mng, adv_fz* f, unsigned* fc)
 	if (adv_png_write_chunk(f, ADV_PNG_CN_IEND, 0, 0, fc) != 0) {
 		throw_png_error();
 	}
+
+	mng->key_size = z_size;
 }
 
 static void mng_write_move(adv_mng_write* mng, adv_fz* f, unsigned* fc, int shift_x, int shift_y)
@@ -381,6 +576,74 @@ static void mng_write_move(adv_mng_write* mng, adv_fz* f, unsigned* fc, int shif
 	}
 }
 
+/**
+ * Write a keyframe.
+ * It's a delta replacing the whole image, that doesn't depend on the previous frames.
+ * The keyframes are not supported with a scroll buffer, because the following
+ * deltas may depend on the pixels out of the frame.
+ */
+static void mng_write_key_image(adv_mng_write* mng, adv_fz* f, unsigned* fc, unsigned char* img_ptr, unsigned img_scanline, unsigned char* pal_ptr, unsigned pal_size)
+{
+	data_ptr z_ptr;
+	unsigned z_size;
+	unsigned char dhdr[12];
+
+	if (mng->scroll_width != 0 || mng->scroll_height != 0) {
+		throw error() << "Keyframes not supported with scrolling";
+	}
+
+	mng_write_store(mng, img_ptr, img_scanline, pal_ptr, pal_size);
+
+	png_compress(mng->level, z_ptr, z_size, img_ptr, img_scanline, mng->pixel, 0, 0, mng->width, mng->height);
+
+	be_uint16_write(dhdr + 0, 1); /* object id */
+	dhdr[2] = 1; /* png image */
+	dhdr[3] = 0; /* entire image replacement */
+	be_uint32_write(dhdr + 4, mng->width);
+	be_uint32_write(dhdr + 8, mng->height);
+
+	if (adv_png_write_chunk(f, ADV_MNG_CN_DHDR, dhdr, 12, fc) != 0) {
+		throw_png_error();
+	}
+
+	/* always the full palette to not depend on the previous frames */
+	if (pal_ptr && pal_size) {
+		if (adv_png_write_chunk(f, ADV_PNG_CN_PLTE, pal_ptr, pal_size, fc) != 0) {
+			throw_png_error();
+		}
+	} else if (mng->pixel == 1 && mng->pal_size) {
+		if (adv_png_write_chunk(f, ADV_PNG_CN_PLTE, mng->pal_ptr, mng->pal_size, fc) != 0) {
+			throw_png_error();
+		}
+	}
+
+	if (adv_png_write_chunk(f, ADV_PNG_CN_IDAT, z_ptr, z_size, fc) != 0) {
+		throw_png_error();
+	}
+
+	if (adv_png_write_chunk(f, ADV_PNG_CN_IEND, 0, 0, fc) != 0) {
+		throw_png_error();
+	}
+
+	mng->key_count = 0;
+	mng->key_tick = 0;
+	mng->key_size = z_size;
+}
+
+/**
+ * Check if the keyframe interval is elapsed.
+ */
+static adv_bool mng_write_key_due(adv_mng_write* mng)
+{
+	if (mng->key_frames && mng->key_count >= mng->key_frames)
+		return 1;
+
+	if (mng->key_seconds && mng->key_tick >= (unsigned long long)mng->key_seconds * mng->frequency)
+		return 1;
+
+	return 0;
+}
+
 static void mng_write_delta_image(adv_mng_write* mng, adv_fz* f, unsigned* fc, unsigned char* img_ptr, unsigned img_scanline, unsigned char* pal_ptr, unsigned pal_size)
 {
 	unsigned x, y, dx, dy;
@@ -418,6 +681,14 @@ static void mng_write_delta_image(adv_mng_write* mng, adv_fz* f, unsigned* fc, u
 
 	if (dx && dy) {
 		png_compress_delta(mng->level, z_d_ptr, z_d_size, img_ptr, img_scanline, mng->pixel, mng->current_ptr, mng->line, x, y, dx, dy);
+
+		/* a delta too big compared with a keyframe is replaced by a new keyframe, */
+		/* without compressing also the replacement of the changed region */
+		if (mng->key_percent && (unsigned long long)z_d_size * 100 > (unsigned long long)mng->key_size * mng->key_percent) {
+			mng_write_key_image(mng, f, fc, img_ptr, img_scanline, pal_ptr, pal_size);
+			return;
+		}
+
 		png_compress(mng->level, z_r_ptr, z_r_size, img_ptr, img_scanline, mng->pixel, x, y, dx, dy);
 	} else {
 		z_d_ptr = 0;
@@ -481,7 +752,11 @@ static void mng_write_delta_image(adv_mng_write* mng, adv_fz* f, unsigned* fc, u
 		throw_png_error();
 	}
 
-	mng_write_store(mng, img_ptr, img_scanline, pal_ptr, pal_size);
+	/* a repeat of the current frame changes only the palette */
+	if (dx && dy)
+		mng_write_store(mng, img_ptr, img_scanline, pal_ptr, pal_size);
+	else
+		mng_write_store_palette(mng, pal_ptr, pal_size);
 }
 
 static void mng_write_base_image(adv_mng_write* mng, adv_fz* f, unsigned* fc, unsigned char* img_ptr, unsigned img_scanline, unsigned char* pal_ptr, unsigned pal_size)
@@ -604,11 +879,17 @@ static void mng_write_image_raw(adv_mng_write* mng, adv_fz* f, unsigned* fc, uns
 
 		if (mng->type == mng_std) {
 			mng_write_move(mng, f, fc, shift_x, shift_y);
-			mng_write_delta_image(mng, f, fc, img_ptr, img_scanline, pal_ptr, pal_size);
+			if (mng_write_key_due(mng))
+				mng_write_key_image(mng, f, fc, img_ptr, img_scanline, pal_ptr, pal_size);
+			else
+				mng_write_delta_image(mng, f, fc, img_ptr, img_scanline, pal_ptr, pal_size);
 		} else {
 			mng_write_base_image(mng, f, fc, img_ptr, img_scanline, pal_ptr, pal_size);
 		}
 	}
+
+	mng->key_count += 1;
+	mng->key_tick += mng->tick;
 }
 
 void mng_write_image(adv_mng_write* mng, adv_fz* f, unsigned* fc, unsigned width, unsigned height, unsigned pixel, unsigned char* img_ptr, unsigned img_scanline, unsigned char* pal_ptr, unsigned pal_size, int shift_x, int shift_y)
@@ -633,7 +914,17 @@ void mng_write_image(adv_mng_write* mng, adv_fz* f, unsigned* fc, unsigned width
 			data_ptr new_ptr;
 			unsigned new_scanline;
 
-			if (!mng_write_reduce(mng, new_ptr, new_scanline, ovr_ptr, img_ptr, img_scanline)) {
+			if (mng->global_size) {
+				if (!mng_write_reduce_global(mng, new_ptr, new_scanline, img_ptr, img_scanline)) {
+					throw error_unsupported() << "Color reduction failed";
+				}
+
+				// the global palette is written only once, in the first image and in keyframes
+				if (mng->type == mng_std && !mng->first)
+					mng_write_image_raw(mng, f, fc, width, height, 1, new_ptr, new_scanline, 0, 0, shift_x, shift_y);
+				else
+					mng_write_image_raw(mng, f, fc, width, height, 1, new_ptr, new_scanline, mng->global_ptr, mng->global_size, shift_x, shift_y);
+			} else if (!mng_write_reduce(mng, new_ptr, new_scanline, ovr_ptr, img_ptr, img_scanline)) {
 				throw error_unsupported() << "Color reduction failed";
 			} else {
 				mng_write_image_raw(mng, f, fc, width, height, 1, new_ptr, new_scanline, ovr_ptr, 256*3, shift_x, shift_y);
@@ -680,6 +971,47 @@ void mng_write_frame(adv_mng_write* mng, adv_fz* f, unsigned* fc, unsigned tick)
 	}
 }
 
+/**
+ * Set the keyframe insertion.
+ * A keyframe replaces the whole image, allowing to start the decoding from it.
+ * It's used only in MNG streams with delta images, all the frames of MNG LC
+ * and VLC streams are already keyframes.
+ * \param frames Insert a keyframe after the specified number of frames, or 0.
+ * \param seconds Insert a keyframe after the specified number of seconds, or 0.
+ * \param percent Insert a keyframe when a delta is bigger than this percentage of the last keyframe, or 0.
+ */
+void mng_write_keyframe(adv_mng_write* mng, unsigned frames, unsigned seconds, unsigned percent)
+{
+	mng->key_frames = frames;
+	mng->key_seconds = seconds;
+	mng->key_percent = percent;
+}
+
+/**
+ * Set the global palette used to reduce the images to 256 colors.
+ * All the colors of the images must be present in the palette.
+ * The palette is written only in the first image and in the keyframes,
+ * without any palette change in the other frames.
+ * \param pal_ptr Palette.
+ * \param pal_size Palette size in bytes.
+ */
+void mng_write_palette(adv_mng_write* mng, const unsigned char* pal_ptr, unsigned pal_size)
+{
+	unsigned i;
+
+	memcpy(mng->global_ptr, pal_ptr, pal_size);
+	mng->global_size = pal_size;
+
+	memset(mng->global_key, 0, sizeof(mng->global_key));
+	for(i=0;i<pal_size/3;++i) {
+		unsigned key = (pal_ptr[i*3] << 16 | pal_ptr[i*3+1] << 8 | pal_ptr[i*3+2]) + 1;
+		unsigned k = global_hash(key);
+		while (mng->global_key[k] != 0 && mng->global_key[k] != key)
+			k = (k + 1) % 1024;
+		mng->global_key[k] = key;
+		mng->global_index[k] = i;
+	}
+}
 
 void mng_write_footer(adv_mng_write* mng, adv_fz* f, unsigned* fc)
 {
@@ -701,6 +1033,10 @@ adv_mng_write* mng_write_init(adv_mng_type type, shrink_t level, adv_bool reduce
 	mng->header_written = 0;
 	mng->header_simplicity = 0;
 	mng->scroll_ptr = 0;
+	mng->key_frames = 0;
+	mng->key_seconds = 0;
+	mng->key_percent = 0;
+	mng->global_size = 0;
 
 	return mng;
 }
@@ -29,6 +29,15 @@ typedef enum adv_mng_type_enum {
 	mng_std
 } adv_mng_type;
 
+/**
+ * Frame hash.
+ * It's used to skip most of the pixel comparisons searching repeated frames.
+ */
+typedef struct adv_mng_hash_struct {
+	unsigned long long h1;
+	unsigned long long h2;
+} adv_mng_hash;
+
 typedef struct adv_mng_write_struct {
 	adv_bool first; /**< First image flag. */
 
@@ -53,20 +62,38 @@ typedef struct adv_mng_write_struct {
 
 	unsigned tick; /**< Last tick used. */
 
+	unsigned frequency; /**< Ticks per second. */
+
+	unsigned key_frames; /**< Keyframe interval in frames, or 0. */
+	unsigned key_seconds; /**< Keyframe interval in seconds, or 0. */
+	unsigned key_percent; /**< Delta size in percentage of the last keyframe size that forces a keyframe, or 0. */
+	unsigned key_count; /**< Frames from the last keyframe. */
+	unsigned key_tick; /**< Ticks from the last keyframe. */
+	unsigned key_size; /**< Compressed size of the last keyframe. */
+
 	adv_mng_type type; /**< Type of the MNG stream. */
 	shrink_t level; /**< Compression level of the MNG stream. */
 
 	adv_bool reduce; /**< Try to reduce the images to 256 color. */
+	unsigned global_size; /**< Size in bytes of the global palette used for the reduction, or 0. */
+	unsigned char global_ptr[256*3]; /**< Global palette. */
+	unsigned global_key[1024]; /**< Hash table of the global palette. RGB color + 1, or 0 if empty. */
+	unsigned char global_index[1024]; /**< Palette index of the colors in the hash table. */
 	adv_bool expand; /**< Expand the images to 24 bit color. */
 
 	adv_bool header_written; /**< If the header was written. */
 	unsigned header_simplicity; /**< Simplicity written in the header. */
 } adv_mng_write;
 
+void mng_frame_hash(adv_mng_hash* hash, unsigned width, unsigned height, unsigned pixel, const unsigned char* img_ptr, unsigned img_scanline, const unsigned char* pal_ptr, unsigned pal_size);
+adv_bool mng_frame_hash_equal(const adv_mng_hash* A, const adv_mng_hash* B);
+
 adv_bool mng_write_has_header(adv_mng_write* mng);
 void mng_write_header(adv_mng_write* mng, adv_fz* f, unsigned* fc, unsigned width, unsigned height, unsigned frequency, int scroll_x, int scroll_y, unsigned scroll_width, unsigned scroll_height, adv_bool alpha);
 void mng_write_image(adv_mng_write* mng, adv_fz* f, unsigned* fc, unsigned width, unsigned height, unsigned pixel, unsigned char* img_ptr, unsigned img_scanline, unsigned char* pal_ptr, unsigned pal_size, int shift_x, int shift_y);
 void mng_write_frame(adv_mng_write* mng, adv_fz* f, unsigned* fc, unsigned tick);
+void mng_write_keyframe(adv_mng_write* mng, unsigned frames, unsigned seconds, unsigned percent);
+void mng_write_palette(adv_mng_write* mng, const unsigned char* pal_ptr, unsigned pal_size);
 void mng_write_footer(adv_mng_write* mng, adv_fz* f, unsigned* fc);
 adv_mng_write* mng_write_init(adv_mng_type type, shrink_t level, adv_bool reduce, adv_bool expand);
 void mng_write_done(adv_mng_write* mng);
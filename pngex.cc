@@ -24,12 +24,44 @@
 #include "lib/mng.h"
 
 #include "pngex.h"
+#include "block.h"
 
 #include <iostream>
 #include <iomanip>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 using namespace std;
 
+/**
+ * Subtract two rows of bytes.
+ * It computes dst[i] = p1[i] - p2[i] for i from 0 to size - 1.
+ */
+static void png_delta_row(unsigned char* dst, const unsigned char* p1, const unsigned char* p2, unsigned size)
+{
+	unsigned i = 0;
+
+#if defined(__SSE2__)
+	for(;i+16<=size;i+=16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(p1 + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(p2 + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_sub_epi8(a, b));
+	}
+#elif defined(__ARM_NEON)
+	for(;i+16<=size;i+=16) {
+		vst1q_u8(dst + i, vsubq_u8(vld1q_u8(p1 + i), vld1q_u8(p2 + i)));
+	}
+#endif
+
+	for(;i<size;++i)
+		dst[i] = p1[i] - p2[i];
+}
+
 void png_compress(shrink_t level, data_ptr& out_ptr, unsigned& out_size, const unsigned char* img_ptr, unsigned img_scanline, unsigned img_pixel, unsigned x, unsigned y, unsigned dx, unsigned dy)
 {
 	data_ptr fil_ptr;
@@ -86,13 +118,12 @@ void png_compress_delta(shrink_t level, data_ptr& out_ptr, unsigned& out_size, c
 	p0 = fil_ptr;
 
 	for(i=0;i<dy;++i) {
-		unsigned j;
 		const unsigned char* p1 = &img_ptr[x * img_pixel + (i+y) * img_scanline];
 		const unsigned char* p2 = &prev_ptr[x * img_pixel + (i+y) * prev_scanline];
 
 		*p0++ = 0;
-		for(j=0;j<dx*img_pixel;++j)
-			*p0++ = *p1++ - *p2++;
+		png_delta_row(p0, p1, p2, dx * img_pixel);
+		p0 += dx * img_pixel;
 	}
 
 	assert(p0 == fil_ptr + fil_size);
@@ -334,6 +365,45 @@ void png_print_chunk(unsigned type, unsigned char* data, unsigned size)
 	cout << endl;
 }
 
+/**
+ * Print the deflate blocks of the IDAT chunks, up to the end chunk.
+ * The consecutive IDAT chunks are joined in a single zlib stream, and
+ * each stream gets its own index, like for the images of a MNG.
+ * \param f File positioned after the signature.
+ * \param end Last chunk to read, ADV_PNG_CN_IEND or ADV_MNG_CN_MEND.
+ */
+void png_print_blocks(ostream& os, adv_fz* f, const string& name, unsigned end)
+{
+	vector<unsigned char> stream;
+	unsigned index = 0;
+	unsigned type;
+	unsigned size;
+
+	do {
+		unsigned char* data;
+
+		if (adv_png_read_chunk(f, &data, &size, &type) != 0) {
+			throw_png_error();
+		}
+
+		if (type == ADV_PNG_CN_IDAT) {
+			stream.insert(stream.end(), data, data + size);
+		} else if (stream.size()) {
+			try {
+				zlib_block_print(os, &stream[0], stream.size(), index, name);
+			} catch (...) {
+				free(data);
+				throw;
+			}
+			stream.clear();
+			++index;
+		}
+
+		free(data);
+
+	} while (type != end);
+}
+
 void png_write(adv_fz* f, unsigned pix_width, unsigned pix_height, unsigned pix_pixel, unsigned char* pix_ptr, unsigned pix_scanline, unsigned char* pal_ptr, unsigned pal_size, unsigned char* rns_ptr, unsigned rns_size, shrink_t level)
 {
 	unsigned char ihdr[13];
@@ -38,6 +38,7 @@ inline void throw_png_error()
 }
 
 void png_print_chunk(unsigned type, unsigned char* data, unsigned size);
+void png_print_blocks(std::ostream& os, adv_fz* f, const std::string& name, unsigned end);
 
 void png_compress(
 	shrink_t level,
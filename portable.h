@@ -125,9 +125,11 @@ extern int optind, opterr, optopt;
 #if defined(__WIN32__)
 #define HAVE_SIGHUP 0
 #define HAVE_SIGQUIT 0
+#define HAVE_SIGPIPE 0
 #else
 #define HAVE_SIGHUP 1
 #define HAVE_SIGQUIT 1
+#define HAVE_SIGPIPE 1
 #endif
 
 #if !HAVE_SNPRINTF
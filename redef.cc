@@ -22,21 +22,28 @@
 
 #include "pngex.h"
 #include "file.h"
+#include "cache.h"
 #include "compress.h"
 #include "siglock.h"
+#include "block.h"
 
 #include "lib/mng.h"
 #include "lib/endianrw.h"
 
 #include <iostream>
 #include <iomanip>
+#include <vector>
 
 using namespace std;
 
 shrink_t opt_level;
+bool opt_stats;
+string opt_cache_dir;
+unsigned opt_cache_size;
 bool opt_quiet;
 bool opt_force;
 bool opt_keep_timestamp;
+bool opt_reentropy;
 
 enum ftype_t {
 	ftype_png,
@@ -51,13 +58,17 @@ struct block_t {
 	block_t* next;
 };
 
+/**
+ * Copy data from one file to another.
+ * \param f_out Where to write, or 0 to only skip the data.
+ */
 void copy_data(adv_fz* f_in, adv_fz* f_out, unsigned char* data, unsigned size)
 {
 	if (fzread(data, size, 1, f_in) != 1) {
 		throw error() << "Error reading";
 	}
 
-	if (fzwrite(data, size, 1, f_out) != 1) {
+	if (f_out && fzwrite(data, size, 1, f_out) != 1) {
 		throw error() << "Error writing";
 	}
 }
@@ -71,7 +82,7 @@ void copy_data(adv_fz* f_in, adv_fz* f_out, unsigned size)
 			throw error() << "Error reading";
 		}
 
-		if (fzwrite(&c, 1, 1, f_out) != 1) {
+		if (f_out && fzwrite(&c, 1, 1, f_out) != 1) {
 			throw error() << "Error writing";
 		}
 
@@ -88,7 +99,7 @@ void copy_zero(adv_fz* f_in, adv_fz* f_out)
 			throw error() << "Error reading";
 		}
 
-		if (fzwrite(&c, 1, 1, f_out) != 1) {
+		if (f_out && fzwrite(&c, 1, 1, f_out) != 1) {
 			throw error() << "Error writing";
 		}
 
@@ -97,7 +108,11 @@ void copy_zero(adv_fz* f_in, adv_fz* f_out)
 	}
 }
 
-void read_deflate(adv_fz* f_in, unsigned size, unsigned char*& res_data, unsigned& res_size)
+/**
+ * Read and decompress a deflate stream.
+ * \param stream If not 0, where the compressed stream is also stored.
+ */
+void read_deflate(adv_fz* f_in, unsigned size, unsigned char*& res_data, unsigned& res_size, vector<unsigned char>* stream)
 {
 	z_stream z;
 	block_t* base;
@@ -138,6 +153,8 @@ void read_deflate(adv_fz* f_in, unsigned size, unsigned char*& res_data, unsigne
 			size -= run;
 			if (fzread(block, run, 1, f_in) != 1)
 				throw error() << "Error reading";
+			if (stream)
+				stream->insert(stream->end(), block, block + run);
 			z.next_in = block;
 			z.avail_in = run;
 		}
@@ -210,7 +227,11 @@ void read_deflate(adv_fz* f_in, unsigned size, unsigned char*& res_data, unsigne
 	}
 }
 
-void read_idat(adv_fz* f, unsigned char*& data, unsigned& size, unsigned& type, unsigned char*& res_data, unsigned& res_size)
+/**
+ * Read and decompress the zlib stream of the consecutive IDAT chunks.
+ * \param stream If not 0, where the compressed stream is also stored.
+ */
+void read_idat(adv_fz* f, unsigned char*& data, unsigned& size, unsigned& type, unsigned char*& res_data, unsigned& res_size, vector<unsigned char>* stream)
 {
 	z_stream z;
 	block_t* base;
@@ -234,6 +255,9 @@ void read_idat(adv_fz* f, unsigned char*& data, unsigned& size, unsigned& type,
 	z.next_in = data;
 	z.avail_in = size;
 
+	if (stream)
+		stream->insert(stream->end(), data, data + size);
+
 	if (adv_png_read_chunk(f, &next_data, &next_size, &next_type) != 0) {
 		throw_png_error();
 	}
@@ -249,6 +273,9 @@ void read_idat(adv_fz* f, unsigned char*& data, unsigned& size, unsigned& type,
 			z.next_in = data;
 			z.avail_in = size;
 
+			if (stream)
+				stream->insert(stream->end(), data, data + size);
+
 			if (adv_png_read_chunk(f, &next_data, &next_size, &next_type) != 0) {
 				inflateEnd(&z);
 				throw_png_error();
@@ -326,14 +353,18 @@ void convert_dat(adv_fz* f_in, adv_fz* f_out, unsigned end)
 		if (type == ADV_PNG_CN_IDAT) {
 			unsigned char* res_data;
 			unsigned res_size;
+			vector<unsigned char> stream;
 
-			read_idat(f_in, data, size, type, res_data, res_size);
+			read_idat(f_in, data, size, type, res_data, res_size, opt_reentropy ? &stream : 0);
 
 			unsigned cmp_size = oversize_zlib(res_size);
 			unsigned char* cmp_data = data_alloc(cmp_size);
 
-			if (!compress_zlib(opt_level, cmp_data, cmp_size, res_data, res_size)) {
-				throw error() << "Error compressing";
+			if (!opt_reentropy || stream.empty() || !compress_zlib_reentropy(cmp_data, cmp_size, res_data, res_size, &stream[0], stream.size())) {
+				cmp_size = oversize_zlib(res_size);
+				if (!compress_zlib(opt_level, cmp_data, cmp_size, res_data, res_size)) {
+					throw error() << "Error compressing";
+				}
 			}
 
 			data_free(res_data);
@@ -383,7 +414,11 @@ void convert_mng(adv_fz* f_in, adv_fz* f_out)
 	convert_dat(f_in, f_out, ADV_MNG_CN_MEND);
 }
 
-void convert_gz(adv_fz* f_in, adv_fz* f_out)
+/**
+ * Copy the gz header, and return the size of the compressed data.
+ * \param f_out Where to write, or 0 to only skip the header.
+ */
+unsigned copy_gz_header(adv_fz* f_in, adv_fz* f_out)
 {
 	unsigned char header[10];
 
@@ -435,9 +470,17 @@ void convert_gz(adv_fz* f_in, adv_fz* f_out)
 	}
 	size -= 8;
 
+	return size;
+}
+
+void convert_gz(adv_fz* f_in, adv_fz* f_out)
+{
+	unsigned size = copy_gz_header(f_in, f_out);
+
 	unsigned char* res_data;
 	unsigned res_size;
-	read_deflate(f_in, size, res_data, res_size);
+	vector<unsigned char> stream;
+	read_deflate(f_in, size, res_data, res_size, opt_reentropy ? &stream : 0);
 
 	unsigned cmp_size = oversize_deflate(res_size);
 	if (cmp_size < res_size)
@@ -445,10 +488,13 @@ void convert_gz(adv_fz* f_in, adv_fz* f_out)
 
 	unsigned char* cmp_data = data_alloc(cmp_size);
 
-	unsigned crc = crc32(0, res_data, res_size);
+	unsigned crc = libdeflate_crc32(0, res_data, res_size);
 
-	if (!compress_deflate(opt_level, cmp_data, cmp_size, res_data, res_size))
-		throw error() << "Error compressing";
+	if (!opt_reentropy || stream.empty() || !compress_deflate_reentropy(cmp_data, cmp_size, res_data, res_size, &stream[0], stream.size())) {
+		cmp_size = oversize_deflate(res_size);
+		if (!compress_deflate(opt_level, cmp_data, cmp_size, res_data, res_size))
+			throw error() << "Error compressing";
+	}
 
 	data_free(res_data);
 
@@ -468,6 +514,36 @@ void convert_gz(adv_fz* f_in, adv_fz* f_out)
 		throw error() << "Invalid size";
 }
 
+/**
+ * Detect the file type from the header, and restore the file position.
+ */
+ftype_t detect_type(adv_fz* f_in, const string& path)
+{
+	// read the header
+	unsigned char header[8];
+	if (fzread(header, 8, 1, f_in) != 1)
+		throw error() << "Error reading " << path;
+
+	// detect the file type
+	ftype_t ftype;
+	if (header[0] == 0x1f && header[1] == 0x8b) {
+		ftype = ftype_gz;
+	} else if (header[0] == 0x89 && header[1] == 0x50 && header[2] == 0x4E && header[3] == 0x47) {
+		ftype = ftype_png;
+	} else if (header[0] == 0x8A && header[1] == 0x4D && header[2] == 0x4E && header[3] == 0x47) {
+		ftype = ftype_mng;
+	} else {
+		throw error() << "File type not supported";
+	}
+
+	// restore the file position
+	if (fzseek(f_in, 0, SEEK_SET) != 0) {
+		throw error() << "Error seeking " << path;
+	}
+
+	return ftype;
+}
+
 void convert_inplace(const string& path, bool keep_timestamp)
 {
 	adv_fz* f_in;
@@ -489,27 +565,7 @@ void convert_inplace(const string& path, bool keep_timestamp)
 	}
 
 	try {
-		// read the header
-		unsigned char header[8];
-		if (fzread(header, 8, 1, f_in) != 1)
-			throw error() << "Error reading " << path;
-
-		// detect the file type
-		ftype_t ftype;
-		if (header[0] == 0x1f && header[1] == 0x8b) {
-			ftype = ftype_gz;
-		} else if (header[0] == 0x89 && header[1] == 0x50 && header[2] == 0x4E && header[3] == 0x47) {
-			ftype = ftype_png;
-		} else if (header[0] == 0x8A && header[1] == 0x4D && header[2] == 0x4E && header[3] == 0x47) {
-			ftype = ftype_mng;
-		} else {
-			throw error() << "File type not supported";
-		}
-
-		// restore the file position
-		if (fzseek(f_in, 0, SEEK_SET) != 0) {
-			throw error() << "Error seeking " << path;
-		}
+		ftype_t ftype = detect_type(f_in, path);
 
 		f_out = fzopen(path_dst.c_str(), "wb");
 		if (!f_out) {
@@ -575,6 +631,64 @@ void convert_inplace(const string& path, bool keep_timestamp)
 	}
 }
 
+void blocks_gz(adv_fz* f_in, const string& path)
+{
+	unsigned size = copy_gz_header(f_in, 0);
+
+	data_ptr data(data_alloc(size));
+
+	if (size > 0 && fzread(data, size, 1, f_in) != 1)
+		throw error() << "Error reading";
+
+	deflate_block_print(cout, data, size, 0, path);
+}
+
+void blocks_single(const string& path)
+{
+	adv_fz* f_in;
+
+	f_in = fzopen(path.c_str(), "rb");
+	if (!f_in) {
+		throw error() << "Failed open for reading " << path;
+	}
+
+	try {
+		switch (detect_type(f_in, path)) {
+		case ftype_png :
+			if (adv_png_read_signature(f_in) != 0) {
+				throw_png_error();
+			}
+			png_print_blocks(cout, f_in, path, ADV_PNG_CN_IEND);
+			break;
+		case ftype_mng :
+			if (adv_mng_read_signature(f_in) != 0) {
+				throw_png_error();
+			}
+			png_print_blocks(cout, f_in, path, ADV_MNG_CN_MEND);
+			break;
+		case ftype_gz :
+			blocks_gz(f_in, path);
+			break;
+		}
+	} catch (...) {
+		fzclose(f_in);
+		throw;
+	}
+
+	fzclose(f_in);
+}
+
+void blocks_all(int argc, char* argv[])
+{
+	for(int i=0;i<argc;++i) {
+		try {
+			blocks_single(argv[i]);
+		} catch (error& e) {
+			throw e << " on " << argv[i];
+		}
+	}
+}
+
 void rezip_single(const string& file, unsigned long long& total_0, unsigned long long& total_1)
 {
 	unsigned size_0;
@@ -641,6 +755,7 @@ void rezip_all(int argc, char* argv[])
 struct option long_options[] = {
 	{"recompress", 0, 0, 'z'},
 	{"list", 0, 0, 'l'},
+	{"blocks", 0, 0, 'b'},
 
 	{"shrink-store", 0, 0, '0'},
 	{"shrink-fast", 0, 0, '1'},
@@ -648,6 +763,14 @@ struct option long_options[] = {
 	{"shrink-extra", 0, 0, '3'},
 	{"shrink-insane", 0, 0, '4'},
 	{"iter", 1, 0, 'i'},
+	{"iter-stop", 1, 0, 'I'},
+	{"seed", 0, 0, 'E'},
+	{"tree", 0, 0, 'B'},
+	{"reentropy", 0, 0, 'R'},
+	{"stats", 0, 0, 'T'},
+	{"matches", 1, 0, 'G'},
+	{"cache", 1, 0, 'D'},
+	{"cache-size", 1, 0, 'M'},
 	{"keep-timestamp", 0, 0, 'k'},
 	{"quiet", 0, 0, 'q'},
 	{"help", 0, 0, 'h'},
@@ -656,7 +779,7 @@ struct option long_options[] = {
 };
 #endif
 
-#define OPTIONS "zl01234i:kfqhV"
+#define OPTIONS "zlb01234i:I:EBRTG:D:M:kfqhV"
 
 void version()
 {
@@ -671,6 +794,7 @@ void usage()
 	cout << endl;
 	cout << "Modes:" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-z, --recompress    ", "-z") "  Recompress the specified files" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-b, --blocks        ", "-b") "  List the deflate blocks of the files" << endl;
 	cout << "Options:" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-0, --shrink-store  ", "-0") "  Don't compress" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-1, --shrink-fast   ", "-1") "  Compress fast (zlib)" << endl;
@@ -680,6 +804,15 @@ void usage()
 	cout << "  " SWITCH_GETOPT_LONG("-k, --keep-timestamp", "-k") "  Keep the original timestamp" << endl;
 
 	cout << "  " SWITCH_GETOPT_LONG("-i N, --iter=N      ", "-i") "  Compress iterations" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-I N, --iter-stop=N ", "-I") "  Stop after N iterations without gain" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("                    ", "  ") "  With N,E the gains up to E bytes don't count" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-E, --seed          ", "-E") "  Start from the libdeflate compression" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-B, --tree          ", "-B") "  Find the matches of -4 with a binary tree" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-R, --reentropy     ", "-R") "  Keep the matches, recompute only the blocks" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-T, --stats         ", "-T") "  Print statistics of the iterations" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-G N, --matches=N   ", "-G") "  Match distances cached for each byte by -4" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-D DIR, --cache=DIR ", "-D") "  Reuse the compressed data cached in DIR" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-M N, --cache-size=N", "-M") "  Limit the cache to N MB" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-f, --force         ", "-f") "  Force the new file also if it's bigger" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-q, --quiet         ", "-q") "  Don't print on the console" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-h, --help          ", "-h") "  Help of the program" << endl;
@@ -689,14 +822,23 @@ void usage()
 void process(int argc, char* argv[])
 {
 	enum cmd_t {
-		cmd_unset, cmd_recompress
+		cmd_unset, cmd_recompress, cmd_blocks
 	} cmd = cmd_unset;
 
 	opt_quiet = false;
 	opt_level.level = shrink_normal;
 	opt_level.iter = 0;
+	opt_level.stop = 0;
+	opt_level.epsilon = 0;
+	opt_level.seed = false;
+	opt_level.tree = false;
+	opt_level.cache = SHRINK_CACHE_DEFAULT;
+	opt_stats = false;
+	opt_cache_dir = "";
+	opt_cache_size = CACHE_SIZE_DEFAULT;
 	opt_force = false;
 	opt_keep_timestamp = false;
+	opt_reentropy = false;
 
 	if (argc <= 1) {
 		usage();
@@ -720,6 +862,11 @@ void process(int argc, char* argv[])
 				throw error() << "Too many commands";
 			cmd = cmd_recompress;
 			break;
+		case 'b' :
+			if (cmd != cmd_unset)
+				throw error() << "Too many commands";
+			cmd = cmd_blocks;
+			break;
 		case '0' :
 			opt_level.level = shrink_none;
 			opt_force = true;
@@ -739,6 +886,30 @@ void process(int argc, char* argv[])
 		case 'i' :
 			opt_level.iter = atoi(optarg);
 			break;
+		case 'I' :
+			shrink_stop_option(opt_level, optarg);
+			break;
+		case 'E' :
+			opt_level.seed = true;
+			break;
+		case 'B' :
+			opt_level.tree = true;
+			break;
+		case 'R' :
+			opt_reentropy = true;
+			break;
+		case 'T' :
+			opt_stats = true;
+			break;
+		case 'G' :
+			opt_level.cache = option_unsigned(optarg, 'G', 0, 255);
+			break;
+		case 'D' :
+			opt_cache_dir = optarg;
+			break;
+		case 'M' :
+			opt_cache_size = option_unsigned(optarg, 'M', 1, UINT_MAX);
+			break;
 		case 'f' :
 			opt_force = true;
 			break;
@@ -763,13 +934,25 @@ void process(int argc, char* argv[])
 		}
 	}
 
+	if (opt_cache_dir.length())
+		cache_init(opt_cache_dir, opt_cache_size * 1024ULL * 1024ULL);
+
 	switch (cmd) {
 	case cmd_recompress :
 		rezip_all(argc - optind, argv + optind);
 		break;
+	case cmd_blocks :
+		blocks_all(argc - optind, argv + optind);
+		break;
 	case cmd_unset :
 		throw error() << "No command specified";
 	}
+
+	if (cache_enabled() && !opt_quiet)
+		cache_print(cout);
+
+	if (opt_stats)
+		compress_zopfli_print(cout);
 }
 
 int main(int argc, char* argv[])
@@ -24,9 +24,11 @@
 #include "mngex.h"
 #include "except.h"
 #include "file.h"
+#include "cache.h"
 #include "compress.h"
 #include "siglock.h"
 #include "scroll.h"
+#include "thread.h"
 
 #include "lib/endianrw.h"
 #include "lib/mng.h"
@@ -35,6 +37,8 @@
 
 #include <iostream>
 #include <iomanip>
+#include <vector>
+#include <algorithm>
 
 using namespace std;
 
@@ -45,12 +49,23 @@ bool opt_reduce;
 bool opt_expand;
 bool opt_noalpha;
 shrink_t opt_level;
+bool opt_stats;
+string opt_cache_dir;
+unsigned opt_cache_size;
 bool opt_quiet;
 bool opt_verbose;
 bool opt_scroll;
 adv_mng_type opt_type;
 bool opt_force;
 bool opt_crc;
+bool opt_merge;
+unsigned opt_jobs;
+unsigned opt_key_frames;
+unsigned opt_key_seconds;
+unsigned opt_key_percent;
+bool opt_frames;
+unsigned opt_frames_begin;
+unsigned opt_frames_end;
 
 void clear_line()
 {
@@ -241,40 +256,111 @@ adv_scroll_info* analyze_png(int argc, char* argv[])
 	return info;
 }
 
-bool is_reducible_image(unsigned img_width, unsigned img_height, unsigned img_pixel, unsigned char* img_ptr, unsigned img_scanline)
+#define COLOR_HASH 1024 /**< Size of the color hash table, four times the maximum number of colors. */
+
+/**
+ * Set of colors with the number of pixels of each one.
+ * It stores at most 256 colors.
+ */
+struct color_count {
+	unsigned key[COLOR_HASH]; /**< RGB color + 1, or 0 if empty. */
+	unsigned count[COLOR_HASH]; /**< Number of pixels. */
+	unsigned size; /**< Number of colors. */
+	bool overflow; /**< If more than 256 colors were inserted. */
+
+	color_count() : size(0), overflow(false)
+	{
+		memset(key, 0, sizeof(key));
+	}
+
+	bool insert(unsigned rgb, unsigned n)
+	{
+		unsigned k = rgb + 1;
+		unsigned i = (k * 2654435761U) >> 22; /* top 10 bits */
+
+		while (key[i] != 0 && key[i] != k)
+			i = (i + 1) % COLOR_HASH;
+
+		if (key[i] == 0) {
+			if (size == 256) {
+				overflow = true;
+				return false;
+			}
+			key[i] = k;
+			count[i] = 0;
+			++size;
+		}
+
+		count[i] += n;
+
+		return true;
+	}
+};
+
+bool is_reducible_image(unsigned img_width, unsigned img_height, unsigned img_pixel, unsigned char* img_ptr, unsigned img_scanline, color_count& global)
 {
-	unsigned char col_ptr[256*3];
-	unsigned col_count;
-	unsigned i, j, k;
+	color_count frame;
+	unsigned i, j;
 
 	// if an alpha channel is present th eimage cannot be palettized
 	if (img_pixel != 3 && !opt_noalpha)
 		return false;
 
-	col_count = 0;
 	for(i=0;i<img_height;++i) {
 		unsigned char* p0 = img_ptr + i * img_scanline;
+		unsigned last = 0;
+		unsigned run = 0;
 		for(j=0;j<img_width;++j) {
-			for(k=0;k<col_count;++k) {
-				if (col_ptr[k*3] == p0[0] && col_ptr[k*3+1] == p0[1] && col_ptr[k*3+2] == p0[2])
-					break;
-			}
-			if (k == col_count) {
-				if (col_count == 256)
+			unsigned rgb = p0[0] << 16 | p0[1] << 8 | p0[2];
+			// count runs of the same color with a single insert
+			if (run && rgb != last) {
+				if (!frame.insert(last, run))
 					return false; /* too many colors */
-				col_ptr[col_count*3] = p0[0];
-				col_ptr[col_count*3+1] = p0[1];
-				col_ptr[col_count*3+2] = p0[2];
-				++col_count;
+				run = 0;
 			}
+			last = rgb;
+			++run;
 			p0 += img_pixel;
 		}
+		if (run && !frame.insert(last, run))
+			return false; /* too many colors */
 	}
 
+	// the union of the colors of all the frames
+	for(i=0;i<COLOR_HASH && !global.overflow;++i)
+		if (frame.key[i])
+			global.insert(frame.key[i] - 1, frame.count[i]);
+
 	return true;
 }
 
-bool is_reducible_mng(const string& path)
+/**
+ * Build the global palette of all the frames.
+ * The colors are ordered by decreasing usage. The most used color gets
+ * the index 0, like the empty areas of the scroll buffer.
+ */
+unsigned global_palette(const color_count& global, unsigned char* pal_ptr)
+{
+	vector<pair<unsigned, unsigned> > order;
+	unsigned i;
+
+	for(i=0;i<COLOR_HASH;++i)
+		if (global.key[i])
+			order.push_back(pair<unsigned, unsigned>(~global.count[i], global.key[i] - 1));
+
+	// sort by decreasing count, and by color for equal counts
+	sort(order.begin(), order.end());
+
+	for(i=0;i<order.size();++i) {
+		pal_ptr[i*3] = order[i].second >> 16;
+		pal_ptr[i*3+1] = order[i].second >> 8;
+		pal_ptr[i*3+2] = order[i].second;
+	}
+
+	return order.size() * 3;
+}
+
+bool is_reducible_mng(const string& path, color_count& global)
 {
 	bool reducible;
 	adv_fz* f;
@@ -322,7 +408,7 @@ bool is_reducible_mng(const string& path)
 				data_ptr dat_ptr(dat_ptr_ext);
 				data_ptr pal_ptr(pal_ptr_ext);
 
-				if (!is_reducible_image(pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline))
+				if (!is_reducible_image(pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, global))
 					reducible = false;
 			}
 		} catch (...) {
@@ -348,7 +434,7 @@ bool is_reducible_mng(const string& path)
 	return reducible;
 }
 
-bool is_reducible_png(int argc, char* argv[])
+bool is_reducible_png(int argc, char* argv[], color_count& global)
 {
 	bool reducible;
 
@@ -387,7 +473,7 @@ bool is_reducible_png(int argc, char* argv[])
 			data_ptr dat_ptr(dat_ptr_ext);
 			data_ptr pal_ptr(pal_ptr_ext);
 
-			if (!is_reducible_image(pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline))
+			if (!is_reducible_image(pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, global))
 				reducible = false;
 
 			fzclose(f_in);
@@ -442,12 +528,116 @@ void convert_image(adv_mng_write* mng, adv_fz* f_out, unsigned* fc, unsigned pix
 	}
 }
 
-void convert_f_mng(adv_fz* f_in, adv_fz* f_out, unsigned* filec, unsigned* framec, adv_scroll_info* info, bool reduce, bool expand)
+/**
+ * Frame waiting to be written.
+ * With the --merge option the repeats of a frame are merged in it,
+ * increasing its tick.
+ */
+struct frame_pending {
+	bool valid;
+	unsigned width;
+	unsigned height;
+	unsigned pixel;
+	unsigned scanline;
+	data_ptr pix_ptr;
+	data_ptr pal_ptr;
+	unsigned pal_size;
+	unsigned tick;
+	adv_scroll_coord* scc;
+	adv_mng_hash hash;
+
+	frame_pending() : valid(false) { }
+};
+
+void frame_write(adv_mng_write* mng, adv_fz* f_out, unsigned* fc, unsigned pix_width, unsigned pix_height, unsigned pix_pixel, unsigned char* pix_ptr, unsigned pix_scanline, unsigned char* pal_ptr, unsigned pal_size, unsigned tick, adv_scroll_coord* scc)
+{
+	if (opt_type != mng_vlc)
+		mng_write_frame(mng, f_out, fc, tick);
+
+	convert_image(mng, f_out, fc, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, scc);
+}
+
+void frame_flush(frame_pending& pending, adv_mng_write* mng, adv_fz* f_out, unsigned* fc)
+{
+	if (pending.valid) {
+		pending.valid = false;
+		frame_write(mng, f_out, fc, pending.width, pending.height, pending.pixel, pending.pix_ptr, pending.scanline, pending.pal_ptr, pending.pal_size, pending.tick, pending.scc);
+	}
+}
+
+/**
+ * Compare a frame with the pending one.
+ * It's called only when the hashes are equal, to exclude the collisions.
+ */
+bool frame_equal(frame_pending& pending, unsigned pix_width, unsigned pix_height, unsigned pix_pixel, const unsigned char* pix_ptr, unsigned pix_scanline, const unsigned char* pal_ptr, unsigned pal_size)
+{
+	unsigned i;
+
+	if (pix_width != pending.width || pix_height != pending.height || pix_pixel != pending.pixel)
+		return false;
+
+	for(i=0;i<pix_height;++i)
+		if (memcmp(pending.pix_ptr + i * pending.scanline, pix_ptr + i * pix_scanline, pending.scanline) != 0)
+			return false;
+
+	if (pal_size != pending.pal_size || (pal_ptr && pal_size) != (pending.pal_ptr != 0))
+		return false;
+	if (pending.pal_ptr && memcmp(pending.pal_ptr, pal_ptr, pal_size) != 0)
+		return false;
+
+	return true;
+}
+
+void frame_push(frame_pending& pending, adv_mng_write* mng, adv_fz* f_out, unsigned* fc, unsigned pix_width, unsigned pix_height, unsigned pix_pixel, unsigned char* pix_ptr, unsigned pix_scanline, unsigned char* pal_ptr, unsigned pal_size, unsigned tick, adv_scroll_coord* scc)
+{
+	adv_mng_hash hash;
+	unsigned i;
+
+	if (!opt_merge) {
+		frame_write(mng, f_out, fc, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, tick, scc);
+		return;
+	}
+
+	mng_frame_hash(&hash, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size);
+
+	// a repeat without scrolling is merged in the pending frame
+	if (pending.valid
+		&& (!scc || (scc->x == 0 && scc->y == 0))
+		&& mng_frame_hash_equal(&hash, &pending.hash)
+		&& frame_equal(pending, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size)
+	) {
+		pending.tick += tick;
+		return;
+	}
+
+	frame_flush(pending, mng, f_out, fc);
+
+	// the frame data of the reader is overwritten by the next frame, so it's copied
+	pending.valid = true;
+	pending.width = pix_width;
+	pending.height = pix_height;
+	pending.pixel = pix_pixel;
+	pending.scanline = pix_width * pix_pixel;
+	pending.pix_ptr = data_alloc(pix_height * pending.scanline);
+	for(i=0;i<pix_height;++i)
+		memcpy(pending.pix_ptr + i * pending.scanline, pix_ptr + i * pix_scanline, pending.scanline);
+	if (pal_ptr && pal_size)
+		pending.pal_ptr = data_dup(pal_ptr, pal_size);
+	else
+		pending.pal_ptr = 0;
+	pending.pal_size = pal_size;
+	pending.tick = tick;
+	pending.scc = scc;
+	pending.hash = hash;
+}
+
+void convert_f_mng(adv_fz* f_in, adv_fz* f_out, unsigned* filec, unsigned* framec, adv_scroll_info* info, bool reduce, const color_count& global, bool expand)
 {
 	unsigned counter;
 	adv_mng* mng;
 	adv_mng_write* mng_write;
 	bool first = true;
+	frame_pending pending;
 
 	mng = adv_mng_init(f_in);
 	if (!mng) {
@@ -459,6 +649,14 @@ void convert_f_mng(adv_fz* f_in, adv_fz* f_out, unsigned* filec, unsigned* frame
 		throw error() << "Error in the mng stream";
 	}
 
+	mng_write_keyframe(mng_write, opt_key_frames, opt_key_seconds, opt_key_percent);
+
+	if (reduce && !global.overflow) {
+		unsigned char pal_ptr[256*3];
+		unsigned pal_size = global_palette(global, pal_ptr);
+		mng_write_palette(mng_write, pal_ptr, pal_size);
+	}
+
 	*filec = 0;
 	counter = 0;
 
@@ -498,16 +696,13 @@ void convert_f_mng(adv_fz* f_in, adv_fz* f_out, unsigned* filec, unsigned* frame
 				first = false;
 			}
 
-			if (opt_type != mng_vlc)
-				mng_write_frame(mng_write, f_out, filec, tick);
-
 			if (info) {
 				if (counter >= info->mac) {
 					throw error() << "Internal error";
 				}
-				convert_image(mng_write, f_out, filec, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, &info->map[counter]);
+				frame_push(pending, mng_write, f_out, filec, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, tick, &info->map[counter]);
 			} else {
-				convert_image(mng_write, f_out, filec, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, 0);
+				frame_push(pending, mng_write, f_out, filec, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, tick, 0);
 			}
 
 			++counter;
@@ -528,6 +723,14 @@ void convert_f_mng(adv_fz* f_in, adv_fz* f_out, unsigned* filec, unsigned* frame
 		throw;
 	}
 
+	try {
+		frame_flush(pending, mng_write, f_out, filec);
+	} catch (...) {
+		adv_mng_done(mng);
+		mng_write_done(mng_write);
+		throw;
+	}
+
 	mng_write_footer(mng_write, f_out, filec);
 
 	adv_mng_done(mng);
@@ -544,6 +747,7 @@ void convert_mng(const string& path_src, const string& path_dst)
 {
 	adv_scroll_info* info;
 	bool reduce;
+	color_count global;
 	bool expand;
 
 	if (opt_scroll && opt_type == mng_vlc) {
@@ -554,6 +758,20 @@ void convert_mng(const string& path_src, const string& path_dst)
 		throw error() << "The --scroll and --lc options are incompatible";
 	}
 
+	if (opt_merge && opt_type == mng_vlc) {
+		throw error() << "The --merge and --vlc options are incompatible";
+	}
+
+	// the deltas after a keyframe may depend on the pixels out of the frame
+	if (opt_scroll && (opt_key_frames || opt_key_seconds || opt_key_percent)) {
+		throw error() << "The --scroll and --keyframe/--keyframe-delta options are incompatible";
+	}
+
+	// all the images of LC and VLC are already keyframes
+	if (opt_type != mng_std && (opt_key_frames || opt_key_seconds || opt_key_percent)) {
+		throw error() << "The --lc/--vlc and --keyframe/--keyframe-delta options are incompatible";
+	}
+
 	if (opt_scroll) {
 		info = analyze_mng(path_src);
 	} else {
@@ -561,7 +779,7 @@ void convert_mng(const string& path_src, const string& path_dst)
 	}
 
 	if (opt_reduce) {
-		reduce = is_reducible_mng(path_src);
+		reduce = is_reducible_mng(path_src, global);
 	} else {
 		reduce = false;
 	}
@@ -590,7 +808,7 @@ void convert_mng(const string& path_src, const string& path_dst)
 	}
 
 	try {
-		convert_f_mng(f_in, f_out, &filec, &framec, info, reduce, expand);
+		convert_f_mng(f_in, f_out, &filec, &framec, info, reduce, global, expand);
 	} catch (...) {
 		fzclose(f_in);
 		fzclose(f_out);
@@ -683,17 +901,210 @@ void mng_print(const string& path)
 	fzclose(f_in);
 }
 
-void extract(const string& path_src)
+/**
+ * Keyframe of a MNG stream.
+ * The decoding can restart from any keyframe.
+ */
+struct extract_key {
+	unsigned counter; /**< Number of the keyframe. */
+	off_t offset; /**< File position of the chunks of the keyframe. */
+	adv_mng state; /**< Decoder state before the keyframe, without the image data. */
+};
+
+/**
+ * Range of frames to extract, decoded from a keyframe.
+ */
+struct extract_range {
+	const extract_key* key; /**< Keyframe where to start the decoding. */
+	unsigned begin; /**< First frame to extract. */
+	unsigned end; /**< Last frame to extract + 1. */
+};
+
+struct extract_context {
+	string path_src;
+	string base;
+	vector<extract_range> range;
+	unsigned first_tick; /**< Tick of the first frame. */
+	thread_mutex mutex; /**< Mutex for the console output. */
+	vector<vector<string> > print; /**< Files written by each range, and not yet printed. */
+	vector<bool> done; /**< If each range is completed. */
+	unsigned printed; /**< Range printing its files as soon as they are written. */
+};
+
+/**
+ * Print the name of a written file, keeping the frame order.
+ * Only the first range not completed prints directly, the others wait for it.
+ */
+static void extract_print(extract_context* context, unsigned index, const string& path)
 {
+	thread_auto_lock lock(context->mutex);
+
+	if (index == context->printed)
+		cout << path << endl;
+	else
+		context->print[index].push_back(path);
+}
+
+static void extract_print_done(extract_context* context, unsigned index)
+{
+	thread_auto_lock lock(context->mutex);
+
+	context->done[index] = true;
+
+	while (context->printed < context->done.size() && context->done[context->printed]) {
+		++context->printed;
+
+		if (context->printed < context->done.size()) {
+			vector<string>& list = context->print[context->printed];
+			for(unsigned i=0;i<list.size();++i)
+				cout << list[i] << endl;
+			list.clear();
+		}
+	}
+}
+
+static void extract_range_run(void* arg, unsigned index)
+{
+	extract_context* context = (extract_context*)arg;
+	const extract_range& range = context->range[index];
 	adv_fz* f_in;
 	adv_mng* mng;
 	adv_fz* f_out;
 	unsigned counter;
-	string base;
+
+	f_in = fzopen(context->path_src.c_str(), "rb");
+	if (!f_in) {
+		throw error() << "Failed open for reading " << context->path_src;
+	}
+
+	mng = adv_mng_dup(&range.key->state);
+	if (!mng) {
+		fzclose(f_in);
+		throw error() << "Low memory";
+	}
+
+	try {
+		if (fzseek(f_in, range.key->offset, SEEK_SET) != 0) {
+			throw error() << "Failed seek on " << context->path_src;
+		}
+
+		counter = range.key->counter;
+
+		while (counter < range.end) {
+			unsigned pix_width;
+			unsigned pix_height;
+			unsigned char* pix_ptr;
+			unsigned pix_pixel;
+			unsigned pix_scanline;
+			unsigned char* dat_ptr_ext;
+			unsigned dat_size;
+			unsigned char* pal_ptr_ext;
+			unsigned pal_size;
+			unsigned tick;
+			unsigned char* dst_ptr;
+			unsigned dst_pixel;
+			unsigned dst_scanline;
+			int r;
+
+			r = adv_mng_read(mng, &pix_width, &pix_height, &pix_pixel, &dat_ptr_ext, &dat_size, &pix_ptr, &pix_scanline, &pal_ptr_ext, &pal_size, &tick, f_in);
+			if (r < 0) {
+				throw_png_error();
+			}
+			if (r > 0)
+				break;
+
+			data_ptr dat_ptr(dat_ptr_ext);
+			data_ptr pal_ptr(pal_ptr_ext);
+
+			// only the range starting from the first keyframe decodes the first frame
+			if (counter == 0)
+				context->first_tick = tick;
+
+			// frames before the range are only decoded
+			if (counter < range.begin) {
+				++counter;
+				continue;
+			}
+
+			ostringstream path_dst;
+			path_dst << context->base << "-";
+
+			// not optimal code for g++ 2.95.3
+			path_dst.setf(ios::right, ios::adjustfield);
+
+			path_dst << setw(8) << setfill('0') << counter;
+			path_dst << ".png";
+
+			string path = path_dst.str();
+
+			// a file interrupted by a signal or an error is removed
+			sig_auto_remove sar(path.c_str());
+
+			f_out = fzopen(path.c_str(), "wb");
+			if (!f_out) {
+				throw error() << "Failed open for writing " << path;
+			}
+
+			++counter;
+
+			try {
+				if (!opt_noalpha) {
+					// convert to 4 byte RGBA format.
+					// mencoder 0.90 has problems with 3 byte RGB format.
+					png_convert_4(pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, &dst_ptr, &dst_pixel, &dst_scanline);
+
+					data_ptr dst(dst_ptr);
+
+					png_write(f_out, pix_width, pix_height, dst_pixel, dst, dst_scanline, 0, 0, 0, 0, opt_level);
+				} else {
+					png_write(f_out, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, 0, 0, opt_level);
+				}
+			} catch (...) {
+				fzclose(f_out);
+				remove(path.c_str());
+				throw;
+			}
+
+			fzclose(f_out);
+
+			if (!opt_quiet)
+				extract_print(context, index, path);
+		}
+	} catch (...) {
+		adv_mng_done(mng);
+		fzclose(f_in);
+		throw;
+	}
+
+	adv_mng_done(mng);
+	fzclose(f_in);
+
+	if (!opt_quiet)
+		extract_print_done(context, index);
+}
+
+void extract(const string& path_src)
+{
+	adv_fz* f_in;
+	adv_mng* mng;
+	unsigned counter;
 	unsigned first_tick;
+	unsigned begin;
+	unsigned end;
+	vector<extract_key> key;
+	extract_context context;
+
+	context.path_src = path_src;
+	context.base = file_basename(path_src);
+
+	if (opt_frames) {
+		begin = opt_frames_begin;
+		end = opt_frames_end;
+	} else {
+		begin = 0;
+		end = UINT_MAX;
+	}
 
-	base = file_basename(path_src);
-	
 	f_in = fzopen(path_src.c_str(), "rb");
 	if (!f_in) {
 		throw error() << "Failed open for reading " << path_src;
@@ -701,86 +1112,107 @@ void extract(const string& path_src)
 
 	mng = adv_mng_init(f_in);
 	if (!mng) {
+		fzclose(f_in);
 		throw error() << "Error in the mng stream";
 	}
 
+	// the start of the stream is always a valid restart point
+	key.resize(1);
+	key[0].counter = 0;
+	key[0].offset = fztell(f_in);
+	key[0].state = *mng;
+
 	counter = 0;
 	first_tick = 1;
 
-	while (1) {
-		unsigned pix_width;
-		unsigned pix_height;
-		unsigned char* pix_ptr;
-		unsigned pix_pixel;
-		unsigned pix_scanline;
-		unsigned char* dat_ptr_ext;
-		unsigned dat_size;
-		unsigned char* pal_ptr_ext;
-		unsigned pal_size;
-		unsigned tick;
-		unsigned char* dst_ptr;
-		unsigned dst_pixel;
-		unsigned dst_scanline;
-		int r;
-
-		r = adv_mng_read(mng, &pix_width, &pix_height, &pix_pixel, &dat_ptr_ext, &dat_size, &pix_ptr, &pix_scanline, &pal_ptr_ext, &pal_size, &tick, f_in);
-		if (r < 0) {
-			throw_png_error();
-		}
-		if (r > 0)
-			break;
+	try {
+		// scan the stream for keyframes only if they are useful
+		while (opt_jobs > 1 || opt_frames) {
+			adv_mng state;
+			off_t offset;
+			unsigned tick;
+			int r;
 
-		data_ptr dat_ptr(dat_ptr_ext);
-		data_ptr pal_ptr(pal_ptr_ext);
+			offset = fztell(f_in);
+			state = *mng;
 
-		if (counter == 0) {
-			first_tick = tick;
-			if (!first_tick)
-				first_tick = 1;
-		}
+			r = adv_mng_skip(mng, &tick, f_in);
+			if (r < 0) {
+				throw_png_error();
+			}
+			if (r > 0)
+				break;
 
-		ostringstream path_dst;
-		path_dst << base << "-";
+			if (counter == 0) {
+				first_tick = tick;
+			}
 
-		// not optimal code for g++ 2.95.3
-		path_dst.setf(ios::right, ios::adjustfield);
+			if (counter != 0 && adv_mng_key_get(mng)) {
+				// the image data is not needed to restart from a keyframe
+				state.dat_ptr = 0;
+				state.dlt_ptr = 0;
 
-		path_dst << setw(8) << setfill('0') << counter;
-		path_dst << ".png";
+				key.resize(key.size() + 1);
+				key.back().counter = counter;
+				key.back().offset = offset;
+				key.back().state = state;
+			}
 
-		if (!opt_quiet) {
-			cout << path_dst.str() << endl;
-		}
+			++counter;
 
-		f_out = fzopen(path_dst.str().c_str(), "wb");
-		if (!f_out) {
-			fzclose(f_in);
-			throw error() << "Failed open for writing " << path_dst.str();
+			if (counter >= end)
+				break;
 		}
 
-		++counter;
+		// split the frames to extract in one range for each keyframe
+		for(unsigned i=0;i<key.size();++i) {
+			extract_range range;
 
-		if (!opt_noalpha) {
-			// convert to 4 byte RGBA format.
-			// mencoder 0.90 has problems with 3 byte RGB format.
-			png_convert_4(pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, &dst_ptr, &dst_pixel, &dst_scanline);
+			range.key = &key[i];
+			range.begin = key[i].counter;
+			if (i + 1 < key.size())
+				range.end = key[i + 1].counter;
+			else
+				range.end = UINT_MAX;
 
-			png_write(f_out, pix_width, pix_height, dst_pixel, dst_ptr, dst_scanline, 0, 0, 0, 0, opt_level);
+			if (range.begin < begin)
+				range.begin = begin;
+			if (range.end > end)
+				range.end = end;
 
-			free(dst_ptr);
-		} else {
-			png_write(f_out, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, 0, 0, opt_level);
+			if (range.begin < range.end)
+				context.range.push_back(range);
 		}
 
-		fzclose(f_out);
+		context.first_tick = first_tick;
+		context.print.resize(context.range.size());
+		context.done.resize(context.range.size());
+		context.printed = 0;
+
+		unsigned jobs = opt_jobs;
+#if !HAVE_THREAD_LOCAL
+		// the error of the png library is global and not safe to share between threads
+		jobs = 1;
+#endif
+
+		thread_for(jobs, context.range.size(), extract_range_run, &context);
+
+		first_tick = context.first_tick;
+	} catch (...) {
+		adv_mng_done(mng);
+		fzclose(f_in);
+		throw;
 	}
 
+	if (!first_tick)
+		first_tick = 1;
+
 	cout << adv_mng_frequency_get(mng) / (double)first_tick << endl;
 
 	if (opt_verbose) {
 		cout << endl;
 		cout << "Example mencoder call:" << endl;
-		cout << "mencoder " << base << "-\\*.png -mf on:w=" << adv_mng_width_get(mng) << ":h=" << adv_mng_height_get(mng) << ":fps=" << adv_mng_frequency_get(mng) / first_tick << ":type=png -ovc lavc -lavcopts vcodec=mpeg4:vbitrate=1000:vhq -o " << base << ".avi" << endl;
+		cout << "mencoder " << context.base << "-\\*.png -mf on:w=" << adv_mng_width_get(mng) << ":h=" << adv_mng_height_get(mng) << ":fps=" << adv_mng_frequency_get(mng) / first_tick << ":type=png -ovc lavc -lavcopts vcodec=mpeg4:vbitrate=1000:vhq -o " << context.base << ".avi" << endl;
 	}
 
 	adv_mng_done(mng);
@@ -797,7 +1229,9 @@ void add_all(int argc, char* argv[], unsigned frequency)
 	adv_scroll_info* info;
 	adv_mng_write* mng_write;
 	bool reduce;
+	color_count global;
 	bool expand;
+	frame_pending pending;
 
 	if (argc < 2) {
 		throw error() << "Missing arguments";
@@ -811,6 +1245,20 @@ void add_all(int argc, char* argv[], unsigned frequency)
 		throw error() << "The --scroll and --lc options are incompatible";
 	}
 
+	if (opt_merge && opt_type == mng_vlc) {
+		throw error() << "The --merge and --vlc options are incompatible";
+	}
+
+	// the deltas after a keyframe may depend on the pixels out of the frame
+	if (opt_scroll && (opt_key_frames || opt_key_seconds || opt_key_percent)) {
+		throw error() << "The --scroll and --keyframe/--keyframe-delta options are incompatible";
+	}
+
+	// all the images of LC and VLC are already keyframes
+	if (opt_type != mng_std && (opt_key_frames || opt_key_seconds || opt_key_percent)) {
+		throw error() << "The --lc/--vlc and --keyframe/--keyframe-delta options are incompatible";
+	}
+
 	if (opt_scroll) {
 		info = analyze_png(argc - 1, argv + 1);
 	} else {
@@ -818,7 +1266,7 @@ void add_all(int argc, char* argv[], unsigned frequency)
 	}
 
 	if (opt_reduce) {
-		reduce = is_reducible_png(argc - 1, argv + 1);
+		reduce = is_reducible_png(argc - 1, argv + 1, global);
 	} else {
 		reduce = false;
 	}
@@ -840,6 +1288,14 @@ void add_all(int argc, char* argv[], unsigned frequency)
 		throw error() << "Error in the mng stream";
 	}
 
+	mng_write_keyframe(mng_write, opt_key_frames, opt_key_seconds, opt_key_percent);
+
+	if (reduce && !global.overflow) {
+		unsigned char pal_ptr[256*3];
+		unsigned pal_size = global_palette(global, pal_ptr);
+		mng_write_palette(mng_write, pal_ptr, pal_size);
+	}
+
 	filec = 0;
 	counter = 0;
 
@@ -880,16 +1336,13 @@ void add_all(int argc, char* argv[], unsigned frequency)
 					convert_header(mng_write, f_out, &filec, pix_width, pix_height, frequency, info, pix_pixel == 4 && !opt_noalpha);
 				}
 
-				if (opt_type != mng_vlc)
-					mng_write_frame(mng_write, f_out, &filec, 1);
-
 				if (info) {
 					if (counter >= info->mac) {
 						throw error() << "Internal error";
 					}
-					convert_image(mng_write, f_out, &filec, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, &info->map[counter]);
+					frame_push(pending, mng_write, f_out, &filec, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, 1, &info->map[counter]);
 				} else {
-					convert_image(mng_write, f_out, &filec, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, 0);
+					frame_push(pending, mng_write, f_out, &filec, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, 1, 0);
 				}
 
 				fzclose(f_in);
@@ -908,6 +1361,8 @@ void add_all(int argc, char* argv[], unsigned frequency)
 				throw;
 			}
 		}
+
+		frame_flush(pending, mng_write, f_out, &filec);
 	} catch (...) {
 		if (opt_verbose) {
 			cout << endl;
@@ -1026,6 +1481,13 @@ struct option long_options[] = {
 	{"shrink-extra", 0, 0, '3'},
 	{"shrink-insane", 0, 0, '4'},
 	{"iter", 1, 0, 'i'},
+	{"iter-stop", 1, 0, 'I'},
+	{"seed", 0, 0, 'E'},
+	{"tree", 0, 0, 'B'},
+	{"stats", 0, 0, 'T'},
+	{"matches", 1, 0, 'G'},
+	{"cache", 1, 0, 'D'},
+	{"cache-size", 1, 0, 'M'},
 
 	{"scroll-square", 1, 0, 'S'},
 	{"scroll", 1, 0, 's'},
@@ -1033,6 +1495,11 @@ struct option long_options[] = {
 	{"expand", 0, 0, 'e'},
 	{"lc", 0, 0, 'c'},
 	{"vlc", 0, 0, 'C'},
+	{"merge", 0, 0, 'm'},
+	{"keyframe", 1, 0, 'k'},
+	{"keyframe-delta", 1, 0, 'K'},
+	{"frames", 1, 0, 'F'},
+	{"jobs", 1, 0, 'j'},
 	{"force", 0, 0, 'f'},
 
 	{"quiet", 0, 0, 'q'},
@@ -1043,7 +1510,7 @@ struct option long_options[] = {
 };
 #endif
 
-#define OPTIONS "zlLxa:01234i:s:S:rencCfqvhV"
+#define OPTIONS "zlLxa:01234i:I:EBTG:D:M:s:S:rencCmk:K:F:j:fqvhV"
 
 void version()
 {
@@ -1068,6 +1535,14 @@ void usage()
 	cout << "  " SWITCH_GETOPT_LONG("-3, --shrink-extra    ", "-3    ") "  Compress extra (7z)" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-4, --shrink-insane   ", "-4    ") "  Compress extreme (zopfli)" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-i N, --iter=N        ", "-i    ") "  Compress iterations" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-I N, --iter-stop=N   ", "-I    ") "  Stop after N iterations without gain" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("                      ", "      ") "  With N,E the gains up to E bytes don't count" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-E, --seed            ", "-E    ") "  Start from the libdeflate compression" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-B, --tree            ", "-B    ") "  Find the matches of -4 with a binary tree" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-T, --stats           ", "-T    ") "  Print statistics of the iterations" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-G N, --matches=N     ", "-G N  ") "  Match distances cached for each byte by -4" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-D DIR, --cache=DIR   ", "-D DIR") "  Reuse the compressed data cached in DIR" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-M N, --cache-size=N  ", "-M N  ") "  Limit the cache to N MB" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-s, --scroll NxM      ", "-s NxM") "  Enable the scroll optimization with a NxM pattern" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("                      ", "      ") "  search. from -Nx-M to NxM. Example: -s 4x6" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-S, --scroll-square N ", "-S N  ") "  Enable the square scroll optimization with a NxN pattern" << endl;
@@ -1076,6 +1551,11 @@ void usage()
 	cout << "  " SWITCH_GETOPT_LONG("-n, --noalpha         ", "-n    ") "  Remove the alpha channel" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-c, --lc              ", "-c    ") "  Use the MNG LC (Low Complexity) format" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-C, --vlc             ", "-C    ") "  Use the MNG VLC (Very Low Complexity) format" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-m, --merge           ", "-m    ") "  Merge repeated frames in a single longer frame" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-k, --keyframe N[s]   ", "-k N  ") "  Insert a keyframe every N frames or seconds" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-K, --keyframe-delta P", "-K P  ") "  Insert a keyframe if a delta is over P%" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-F, --frames A-B      ", "-F A-B") "  Extract only the frames from A to B" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-j N, --jobs=N        ", "-j N  ") "  Extract with N threads" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-f, --force           ", "-f    ") "  Force the new file also if it's bigger" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-q, --quiet           ", "-q    ") "  Don't print on the console" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-v, --verbose         ", "-v    ") "  Print on the console more information" << endl;
@@ -1094,6 +1574,14 @@ void process(int argc, char* argv[])
 	opt_verbose = false;
 	opt_level.level = shrink_normal;
 	opt_level.iter = 0;
+	opt_level.stop = 0;
+	opt_level.epsilon = 0;
+	opt_level.seed = false;
+	opt_level.tree = false;
+	opt_level.cache = SHRINK_CACHE_DEFAULT;
+	opt_stats = false;
+	opt_cache_dir = "";
+	opt_cache_size = CACHE_SIZE_DEFAULT;
 	opt_reduce = false;
 	opt_expand = false;
 	opt_noalpha = false;
@@ -1104,6 +1592,14 @@ void process(int argc, char* argv[])
 	opt_type = mng_std;
 	opt_force = false;
 	opt_crc = false;
+	opt_merge = false;
+	opt_jobs = 1;
+	opt_key_frames = 0;
+	opt_key_seconds = 0;
+	opt_key_percent = 0;
+	opt_frames = false;
+	opt_frames_begin = 0;
+	opt_frames_end = UINT_MAX;
 
 	if (argc <= 1) {
 		usage();
@@ -1144,15 +1640,17 @@ void process(int argc, char* argv[])
 			cmd = cmd_extract;
 			break;
 		case 'a' : {
-			int n, s;
+			unsigned v;
+			const char* e;
 			if (cmd != cmd_unset)
 				throw error() << "Too many commands";
 			cmd = cmd_add;
-			n = sscanf(optarg, "%d%n", &add_frequency, &s);
-			if (n < 1 || strlen(optarg) != s)
+			e = option_scan(optarg, v);
+			if (!e || *e != 0)
 				throw error() << "Invalid option -a";
-			if (add_frequency < 1 || add_frequency > 250)
+			if (v < 1 || v > 250)
 				throw error() << "Invalid frequency";
+			add_frequency = v;
 			} break;
 		case '0' :
 			opt_level.level = shrink_none;
@@ -1173,32 +1671,50 @@ void process(int argc, char* argv[])
 		case 'i' :
 			opt_level.iter = atoi(optarg);
 			break;
+		case 'I' :
+			shrink_stop_option(opt_level, optarg);
+			break;
+		case 'E' :
+			opt_level.seed = true;
+			break;
+		case 'B' :
+			opt_level.tree = true;
+			break;
+		case 'T' :
+			opt_stats = true;
+			break;
+		case 'G' :
+			opt_level.cache = option_unsigned(optarg, 'G', 0, 255);
+			break;
+		case 'D' :
+			opt_cache_dir = optarg;
+			break;
+		case 'M' :
+			opt_cache_size = option_unsigned(optarg, 'M', 1, UINT_MAX);
+			break;
 		case 's' : {
-			int n, s;
-			opt_dx = 0;
-			opt_dy = 0;
-			n = sscanf(optarg, "%dx%d%n", &opt_dx, &opt_dy, &s);
-			if (n < 2 || strlen(optarg) != s)
+			unsigned dx, dy;
+			const char* e;
+			e = option_scan(optarg, dx);
+			if (e && *e == 'x')
+				e = option_scan(e + 1, dy);
+			else
+				e = 0;
+			if (!e || *e != 0)
 				throw error() << "Invalid option -s";
-			if (opt_dx < 0 || opt_dy < 0
-				|| (opt_dx == 0 && opt_dy == 0)
-				|| opt_dx > 128 || opt_dy > 128)
+			if ((dx == 0 && dy == 0) || dx > 128 || dy > 128)
 				throw error() << "Invalid argument for option -s";
 			opt_scroll = true;
+			opt_dx = dx;
+			opt_dy = dy;
 			opt_limit = opt_dx + opt_dy;
 			} break;
-		case 'S' : {
-			int n, s;
-			opt_limit = 0;
-			n = sscanf(optarg, "%d%n", &opt_limit, &s);
-			if (n < 1 || strlen(optarg) != s)
-				throw error() << "Invalid option -S";
-			if (opt_limit < 1 || opt_limit > 128)
-				throw error() << "Invalid argument for option -S";
+		case 'S' :
+			opt_limit = option_unsigned(optarg, 'S', 1, 128);
 			opt_scroll = true;
 			opt_dx = opt_limit;
 			opt_dy = opt_limit;
-			} break;
+			break;
 		case 'r' :
 			opt_reduce = true;
 			opt_expand = false;
@@ -1218,6 +1734,55 @@ void process(int argc, char* argv[])
 			opt_type = mng_vlc;
 			opt_force = true;
 			break;
+		case 'm' :
+			opt_merge = true;
+			break;
+		case 'k' : {
+			unsigned v;
+			const char* e;
+			opt_key_frames = 0;
+			opt_key_seconds = 0;
+			e = option_scan(optarg, v);
+			if (!e || (*e != 0 && strcmp(e, "s") != 0))
+				throw error() << "Invalid option -k";
+			if (v < 1)
+				throw error() << "Invalid argument for option -k";
+			if (*e == 's')
+				opt_key_seconds = v;
+			else
+				opt_key_frames = v;
+			} break;
+		case 'K' :
+			opt_key_percent = option_unsigned(optarg, 'K', 1, 100);
+			break;
+		case 'F' : {
+			unsigned a, b;
+			const char* e;
+			e = option_scan(optarg, a);
+			if (e && *e == '-') {
+				if (e[1] == 0) {
+					// A-
+					b = UINT_MAX - 1;
+					++e;
+				} else {
+					// A-B
+					e = option_scan(e + 1, b);
+				}
+			} else {
+				// A
+				b = a;
+			}
+			if (!e || *e != 0)
+				throw error() << "Invalid option -F";
+			if (a > b || b == UINT_MAX)
+				throw error() << "Invalid argument for option -F";
+			opt_frames = true;
+			opt_frames_begin = a;
+			opt_frames_end = b + 1;
+			} break;
+		case 'j' :
+			opt_jobs = option_unsigned(optarg, 'j', 1, 256);
+			break;
 		case 'f' :
 			opt_force = true;
 			break;
@@ -1244,6 +1809,9 @@ void process(int argc, char* argv[])
 		} 
 	}
 
+	if (opt_cache_dir.length())
+		cache_init(opt_cache_dir, opt_cache_size * 1024ULL * 1024ULL);
+
 	switch (cmd) {
 	case cmd_recompress :
 		remng_all(argc - optind, argv + optind);
@@ -1260,6 +1828,12 @@ void process(int argc, char* argv[])
 	case cmd_unset :
 		throw error() << "No command specified";
 	}
+
+	if (cache_enabled() && !opt_quiet)
+		cache_print(cout);
+
+	if (opt_stats)
+		compress_zopfli_print(cout);
 }
 
 int main(int argc, char* argv[])
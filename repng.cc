@@ -22,6 +22,7 @@
 
 #include "pngex.h"
 #include "file.h"
+#include "cache.h"
 #include "compress.h"
 #include "siglock.h"
 
@@ -33,6 +34,9 @@
 using namespace std;
 
 shrink_t opt_level;
+bool opt_stats;
+string opt_cache_dir;
+unsigned opt_cache_size;
 bool opt_quiet;
 bool opt_force;
 bool opt_crc;
@@ -266,6 +270,29 @@ void png_print(const string& path)
 	fzclose(f_in);
 }
 
+void blocks_print(const string& path)
+{
+	adv_fz* f_in;
+
+	f_in = fzopen(path.c_str(), "rb");
+	if (!f_in) {
+		throw error() << "Failed open for reading " << path;
+	}
+
+	try {
+		if (adv_png_read_signature(f_in) != 0) {
+			throw_png_error();
+		}
+
+		png_print_blocks(cout, f_in, path, ADV_PNG_CN_IEND);
+	} catch (...) {
+		fzclose(f_in);
+		throw;
+	}
+
+	fzclose(f_in);
+}
+
 void rezip_single(const string& file, unsigned long long& total_0, unsigned long long& total_1)
 {
 	unsigned size_0;
@@ -337,11 +364,18 @@ void list_all(int argc, char* argv[])
 	}
 }
 
+void blocks_all(int argc, char* argv[])
+{
+	for(int i=0;i<argc;++i)
+		blocks_print(argv[i]);
+}
+
 #if HAVE_GETOPT_LONG
 struct option long_options[] = {
 	{"recompress", 0, 0, 'z'},
 	{"list", 0, 0, 'l'},
 	{"list-crc", 0, 0, 'L'},
+	{"blocks", 0, 0, 'b'},
 
 	{"shrink-store", 0, 0, '0'},
 	{"shrink-fast", 0, 0, '1'},
@@ -349,6 +383,13 @@ struct option long_options[] = {
 	{"shrink-extra", 0, 0, '3'},
 	{"shrink-insane", 0, 0, '4'},
 	{"iter", 1, 0, 'i'},
+	{"iter-stop", 1, 0, 'I'},
+	{"seed", 0, 0, 'E'},
+	{"tree", 0, 0, 'B'},
+	{"stats", 0, 0, 'T'},
+	{"matches", 1, 0, 'G'},
+	{"cache", 1, 0, 'D'},
+	{"cache-size", 1, 0, 'M'},
 
 	{"quiet", 0, 0, 'q'},
 	{"help", 0, 0, 'h'},
@@ -357,7 +398,7 @@ struct option long_options[] = {
 };
 #endif
 
-#define OPTIONS "zlL01234i:fqhV"
+#define OPTIONS "zlLb01234i:I:EBTG:D:M:fqhV"
 
 void version()
 {
@@ -372,6 +413,7 @@ void usage()
 	cout << endl;
 	cout << "Modes:" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-l, --list          ", "-l") "  List the content of the files" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-b, --blocks        ", "-b") "  List the deflate blocks of the files" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-z, --recompress    ", "-z") "  Recompress the specified files" << endl;
 	cout << "Options:" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-0, --shrink-store  ", "-0") "  Don't compress" << endl;
@@ -380,6 +422,14 @@ void usage()
 	cout << "  " SWITCH_GETOPT_LONG("-3, --shrink-extra  ", "-3") "  Compress extra (7z)" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-4, --shrink-insane ", "-4") "  Compress extreme (zopfli)" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-i N, --iter=N      ", "-i") "  Compress iterations" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-I N, --iter-stop=N ", "-I") "  Stop after N iterations without gain" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("                    ", "  ") "  With N,E the gains up to E bytes don't count" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-E, --seed          ", "-E") "  Start from the libdeflate compression" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-B, --tree          ", "-B") "  Find the matches of -4 with a binary tree" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-T, --stats         ", "-T") "  Print statistics of the iterations" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-G N, --matches=N   ", "-G") "  Match distances cached for each byte by -4" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-D DIR, --cache=DIR ", "-D") "  Reuse the compressed data cached in DIR" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-M N, --cache-size=N", "-M") "  Limit the cache to N MB" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-f, --force         ", "-f") "  Force the new file also if it's bigger" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-q, --quiet         ", "-q") "  Don't print on the console" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-h, --help          ", "-h") "  Help of the program" << endl;
@@ -389,12 +439,20 @@ void usage()
 void process(int argc, char* argv[])
 {
 	enum cmd_t {
-		cmd_unset, cmd_recompress, cmd_list
+		cmd_unset, cmd_recompress, cmd_list, cmd_blocks
 	} cmd = cmd_unset;
 
 	opt_quiet = false;
 	opt_level.level = shrink_normal;
 	opt_level.iter = 0;
+	opt_level.stop = 0;
+	opt_level.epsilon = 0;
+	opt_level.seed = false;
+	opt_level.tree = false;
+	opt_level.cache = SHRINK_CACHE_DEFAULT;
+	opt_stats = false;
+	opt_cache_dir = "";
+	opt_cache_size = CACHE_SIZE_DEFAULT;
 	opt_force = false;
 	opt_crc = false;
 
@@ -431,6 +489,11 @@ void process(int argc, char* argv[])
 			cmd = cmd_list;
 			opt_crc = true;
 			break;
+		case 'b' :
+			if (cmd != cmd_unset)
+				throw error() << "Too many commands";
+			cmd = cmd_blocks;
+			break;
 		case '0' :
 			opt_level.level = shrink_none;
 			opt_force = true;
@@ -450,6 +513,27 @@ void process(int argc, char* argv[])
 		case 'i' :
 			opt_level.iter = atoi(optarg);
 			break;
+		case 'I' :
+			shrink_stop_option(opt_level, optarg);
+			break;
+		case 'E' :
+			opt_level.seed = true;
+			break;
+		case 'B' :
+			opt_level.tree = true;
+			break;
+		case 'T' :
+			opt_stats = true;
+			break;
+		case 'G' :
+			opt_level.cache = option_unsigned(optarg, 'G', 0, 255);
+			break;
+		case 'D' :
+			opt_cache_dir = optarg;
+			break;
+		case 'M' :
+			opt_cache_size = option_unsigned(optarg, 'M', 1, UINT_MAX);
+			break;
 		case 'f' :
 			opt_force = true;
 			break;
@@ -471,6 +555,9 @@ void process(int argc, char* argv[])
 		} 
 	}
 
+	if (opt_cache_dir.length())
+		cache_init(opt_cache_dir, opt_cache_size * 1024ULL * 1024ULL);
+
 	switch (cmd) {
 	case cmd_recompress :
 		rezip_all(argc - optind, argv + optind);
@@ -478,9 +565,18 @@ void process(int argc, char* argv[])
 	case cmd_list :
 		list_all(argc - optind, argv + optind);
 		break;
+	case cmd_blocks :
+		blocks_all(argc - optind, argv + optind);
+		break;
 	case cmd_unset :
 		throw error() << "No command specified";
 	}
+
+	if (cache_enabled() && !opt_quiet)
+		cache_print(cout);
+
+	if (opt_stats)
+		compress_zopfli_print(cout);
 }
 
 int main(int argc, char* argv[])
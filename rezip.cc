@@ -22,19 +22,27 @@
 
 #include "zip.h"
 #include "file.h"
+#include "cache.h"
+#include "thread.h"
+#include "data.h"
+#include "block.h"
+#include "siglock.h"
 
 #include <iostream>
 #include <iomanip>
 #include <string>
+#include <vector>
+#include <list>
+#include <map>
 
 using namespace std;
 
-void rezip_single(const string& file, unsigned long long& total_0, unsigned long long& total_1, bool quiet, bool standard, shrink_t level, bool keep_file_time)
+void rezip_single(zip& z, unsigned long long& total_0, unsigned long long& total_1, bool quiet, bool standard, shrink_t level, bool keep_file_time)
 {
-	zip z(file);
+	string file = z.file_get();
 
-	unsigned size_0;
-	unsigned size_1;
+	unsigned long long size_0;
+	unsigned long long size_1;
 	time_t mtime;
 
 	if (!file_exists(file)) {
@@ -45,12 +53,10 @@ void rezip_single(const string& file, unsigned long long& total_0, unsigned long
 		mtime = file_time(file);
 		size_0 = file_size(file);
 
-		z.open();
-		z.load();
+		if (!z.is_open())
+			z.open();
 
-		z.shrink(standard, level);
-
-		z.save();
+		z.shrink_stream(standard, level);
 
 		z.close();
 
@@ -80,9 +86,33 @@ void rezip_all(int argc, char* argv[], bool quiet, bool standard, shrink_t level
 {
 	unsigned long long total_0 = 0;
 	unsigned long long total_1 = 0;
+	list<zip> archive;
 
-	for(int i=0;i<argc;++i)
-		rezip_single(argv[i], total_0, total_1, quiet, standard, level, keep_file_time);
+	try {
+		// open all the archives, counting their payloads to compress the duplicates only once
+		for(int i=0;i<argc;++i) {
+			archive.push_back(zip(argv[i]));
+
+			if (!file_exists(argv[i]))
+				continue;
+
+			try {
+				archive.back().open();
+				archive.back().dedup_scan();
+			} catch (error& e) {
+				throw e << " on " << argv[i];
+			}
+		}
+
+		for(list<zip>::iterator i=archive.begin();i!=archive.end();++i)
+			rezip_single(*i, total_0, total_1, quiet, standard, level, keep_file_time);
+	} catch (...) {
+		// the results kept for the duplicates are not used anymore
+		zip::dedup_clear();
+		throw;
+	}
+
+	zip::dedup_clear();
 
 	if (!quiet) {
 		cout << setw(12) << total_0 << setw(12) << total_1 << " ";
@@ -262,7 +292,44 @@ void list_all(int argc, char* argv[], bool crc)
 	}
 }
 
-void test_single(const string& file, bool quiet)
+void blocks_single(const string& file)
+{
+	if (!file_exists(file)) {
+		throw error() << "File " << file << " doesn't exist";
+	}
+
+	zip z(file);
+
+	try {
+		z.open();
+
+		for(zip::iterator i=z.begin();i!=z.end();++i) {
+			if (i->method_get() < zip_entry::deflate0 || i->method_get() > zip_entry::deflate9)
+				continue;
+			if (i->is_large())
+				continue;
+
+			data_ptr data(data_alloc(i->compressed_size_get()));
+
+			i->compressed_read(data);
+
+			deflate_block_print(cout, data, i->compressed_size_get(), 0, file + "/" + i->name_get());
+		}
+
+		z.close();
+	} catch (error& e) {
+		throw e << " on " << file;
+	}
+}
+
+void blocks_all(int argc, char* argv[])
+{
+	for(int i=0;i<argc;++i) {
+		blocks_single(argv[i]);
+	}
+}
+
+void test_single(const string& file, bool quiet, unsigned jobs)
 {
 	zip z(file);
 
@@ -276,20 +343,86 @@ void test_single(const string& file, bool quiet)
 	try {
 		z.open();
 		z.load();
-		z.test();
+		z.test(jobs);
 		z.close();
 	} catch (error& e) {
 		throw e << " on " << file;
 	}
 }
 
-void test_all(int argc, char* argv[], bool quiet)
+void test_all(int argc, char* argv[], bool quiet, unsigned jobs)
 {
 	for(int i=0;i<argc;++i)
-		test_single(argv[i], quiet);
+		test_single(argv[i], quiet, jobs);
 }
 
-void extract_all(int argc, char* argv[], bool quiet)
+struct extract_context {
+	vector<zip::const_iterator> entry;
+	vector<string> file;
+	vector<unsigned char> done;
+	bool quiet;
+	unsigned printed; /**< Number of files already printed. */
+	thread_mutex mutex; /**< Mutex for the console output. */
+};
+
+/**
+ * Print the extracted files in the archive order.
+ * A file is printed only when all the files before it are completed.
+ */
+static void extract_print(extract_context* context, unsigned index)
+{
+	thread_auto_lock lock(context->mutex);
+
+	context->done[index] = 1;
+
+	while (context->printed < context->done.size() && context->done[context->printed]) {
+		if (!context->quiet)
+			cout << context->file[context->printed] << endl;
+		++context->printed;
+	}
+}
+
+static void extract_run(void* arg, unsigned index)
+{
+	extract_context* context = static_cast<extract_context*>(arg);
+	zip::const_iterator i = context->entry[index];
+	const string& file = context->file[index];
+
+	// the file gets its name only when complete
+	string temp = file_temp(file);
+
+	// remove the incomplete file if interrupted
+	sig_auto_remove sar(temp.c_str());
+
+	unsigned char* data = (unsigned char*)operator new(i->uncompressed_size_get());
+
+	try {
+		i->uncompressed_read(data);
+
+		file_allocate(temp, i->uncompressed_size_get());
+
+		file_write_at(temp, data, i->uncompressed_size_get(), 0);
+
+		file_utime(temp, i->time_get());
+
+#ifdef __WIN32__
+		// rename() doesn't overwrite on Windows
+		remove(file.c_str());
+#endif
+		if (rename(temp.c_str(), file.c_str()) != 0)
+			throw error() << "Failed rename of " << temp.c_str() << " to " << file;
+	} catch (...) {
+		operator delete(data);
+		remove(temp.c_str());
+		throw;
+	}
+
+	operator delete(data);
+
+	extract_print(context, index);
+}
+
+void extract_all(int argc, char* argv[], bool quiet, unsigned jobs)
 {
 	if (argc > 1)
 		throw error() << "Too many archives specified";
@@ -301,50 +434,57 @@ void extract_all(int argc, char* argv[], bool quiet)
 	z.open();
 	z.load();
 
-	for(zip::iterator i=z.begin();i!=z.end();++i) {
-		unsigned char* data = (unsigned char*)operator new(i->uncompressed_size_get());
-
-		try {
-			i->uncompressed_read(data);
+	extract_context context;
 
-			string file = i->name_get();
+	context.quiet = quiet;
+	context.printed = 0;
 
-			// if end with / it's a directory
-			if (file.length() && file[file.length()-1]!='/') {
+	// create the directories, and select the files to extract
+	map<string, unsigned> created;
+	for(zip::const_iterator i=z.begin();i!=z.end();++i) {
+		string file = i->name_get();
 
-				if (!quiet)
-					cout << file << endl;
+		// if end with / it's a directory
+		if (!file.length() || file[file.length()-1]=='/')
+			continue;
 
-				file_mktree(file);
+		file_mktree(file);
 
-				FILE* f = fopen(file.c_str(), "wb");
-				if (!f)
-					throw error() << "Failed open for writing file " << file;
-
-				try {
-					if (fwrite(data, i->uncompressed_size_get(), 1, f)!=1)
-						throw error() << "Failed write file " << file;
-				} catch (...) {
-					fclose(f);
-					throw;
-				}
-
-				fclose(f);
-
-				file_utime(file, i->time_get());
-			}
-		} catch (...) {
-			operator delete(data);
-			throw;
+		// if the same file is present more times, the last one wins
+		map<string, unsigned>::iterator j = created.find(file);
+		if (j != created.end()) {
+			context.entry[j->second] = i;
+			continue;
 		}
 
-		operator delete(data);
+		created[file] = context.entry.size();
+		context.entry.push_back(i);
+		context.file.push_back(file);
+		context.done.push_back(0);
 	}
 
+	// then decompress and write them concurrently, each one with a temporary name
+	if (context.entry.size())
+		thread_for(jobs, context.entry.size(), extract_run, &context);
+
 	z.close();
 }
 
-void add_single(zip& z, const string& local, const string& common, bool quiet, bool standard, shrink_t level)
+struct add_context {
+	bool standard;
+	shrink_t level;
+	vector<zip::iterator> entry;
+	vector<string> file;
+	map<string, zip::iterator> existing; // entries already present, only for update
+};
+
+/**
+ * Walk the files to add, inserting an empty entry for each one.
+ * The entries are inserted in the walk order, and filled later.
+ * The existing entries with the same size and time of the file are kept,
+ * the others with the same name are replaced.
+ */
+void add_single(zip& z, add_context& context, const string& local, const string& common, bool quiet)
 {
 	struct stat st;
 	string file = local + common;
@@ -364,7 +504,7 @@ void add_single(zip& z, const string& local, const string& common, bool quiet, b
 		try {
 			struct dirent* dd;
 			while ((dd = readdir(d)) != 0) {
-				add_single(z, local, common + "/" + dd->d_name, quiet, standard, level);
+				add_single(z, context, local, common + "/" + dd->d_name, quiet);
 			}
 		} catch (...) {
 			closedir(d);
@@ -372,36 +512,78 @@ void add_single(zip& z, const string& local, const string& common, bool quiet, b
 		}
 		closedir(d);
 	} else {
-		unsigned char* data = (unsigned char*)operator new(st.st_size);
+		map<string, zip::iterator>::iterator j = context.existing.find(common);
+		if (j != context.existing.end()) {
+			zip::iterator e = j->second;
+			unsigned date;
+			unsigned time;
 
-		try {
-			if (!quiet)
-				cout << file << endl;
+			time2zip(st.st_mtime, date, time);
 
-			FILE* f = fopen(file.c_str(), "rb");
-			if (!f)
-				throw error() << "Failed open for reading file " << file;
+			context.existing.erase(j);
 
-			if (st.st_size != 0)
-				if (fread(data, st.st_size, 1, f)!=1)
-					throw error() << "Failed read file " << file;
+			// skip the unchanged file
+			if (e->uncompressed_size_get() == (unsigned long long)st.st_size && e->zipdate_get() == date && e->ziptime_get() == time)
+				return;
 
-			fclose(f);
+			z.erase(e);
+		}
 
-			zip::iterator i = z.insert_uncompressed(common, data, st.st_size, crc32(0, (unsigned char*)data, st.st_size), st.st_mtime, false);
+		if (!quiet)
+			cout << file << endl;
 
-			if (level.level != shrink_none)
-				i->shrink(standard, level);
-		} catch (...) {
-			operator delete(data);
-			throw;
-		}
+		zip::iterator i = z.insert_uncompressed(common, 0, 0, zip_crc32(0, 0, 0), st.st_mtime, false);
+
+		context.entry.push_back(i);
+		context.file.push_back(file);
+	}
+}
+
+/**
+ * Read and compress the data of one entry.
+ * Each call works on a different entry, and it can run concurrently with the others.
+ */
+static void add_run(void* arg, unsigned index)
+{
+	add_context* context = static_cast<add_context*>(arg);
+	zip::iterator i = context->entry[index];
+	const string& file = context->file[index];
+
+	FILE* f = fopen(file.c_str(), "rb");
+	if (!f)
+		throw error() << "Failed open for reading file " << file;
+
+	struct stat st;
+	if (fstat(fileno(f), &st) != 0) {
+		fclose(f);
+		throw error() << "Failed stat file " << file;
+	}
 
+	unsigned char* data = (unsigned char*)operator new(st.st_size);
+
+	try {
+		if (st.st_size != 0)
+			if (fread(data, st.st_size, 1, f)!=1)
+				throw error() << "Failed read file " << file;
+
+		fclose(f);
+		f = 0;
+
+		i->set(zip_entry::store, i->name_get(), data, st.st_size, st.st_size, zip_crc32(0, data, st.st_size), i->zipdate_get(), i->ziptime_get(), false);
+
+		if (context->level.level != shrink_none)
+			i->shrink(context->standard, context->level);
+	} catch (...) {
+		if (f)
+			fclose(f);
 		operator delete(data);
+		throw;
 	}
+
+	operator delete(data);
 }
 
-void add_all(int argc, char* argv[], bool quiet, bool standard, shrink_t level)
+void add_all(int argc, char* argv[], bool quiet, bool standard, shrink_t level, unsigned jobs)
 {
 	if (argc < 1)
 		throw error() << "No archive specified";
@@ -412,30 +594,80 @@ void add_all(int argc, char* argv[], bool quiet, bool standard, shrink_t level)
 
 	z.create();
 
+	add_context context;
+	context.standard = standard;
+	context.level = level;
+
 	for(int i=1;i<argc;++i) {
 		string file = argv[i];
 
 		string local = file_dir(file);
 		string common = file_name(file);
 
-		add_single(z, local, common, quiet, standard, level);
+		add_single(z, context, local, common, quiet);
 	}
 
+	// the order of the entries is already fixed, only the data is filled concurrently
+	if (context.entry.size())
+		thread_for(jobs, context.entry.size(), add_run, &context);
+
 	z.save();
 	z.close();
 }
 
+void update_all(int argc, char* argv[], bool quiet, bool standard, shrink_t level, unsigned jobs, unsigned compact)
+{
+	if (argc < 1)
+		throw error() << "No archive specified";
+	if (argc < 2)
+		throw error() << "No files specified";
+
+	zip z(argv[0]);
+
+	z.open();
+	if (!z.is_load())
+		z.load();
+
+	add_context context;
+	context.standard = standard;
+	context.level = level;
+
+	for(zip::iterator i=z.begin();i!=z.end();++i)
+		context.existing[i->name_get()] = i;
+
+	for(int i=1;i<argc;++i) {
+		string file = argv[i];
+
+		string local = file_dir(file);
+		string common = file_name(file);
+
+		add_single(z, context, local, common, quiet);
+	}
+
+	if (context.entry.size())
+		thread_for(jobs, context.entry.size(), add_run, &context);
+
+	// write only the new entries, keeping the others in place
+	if (z.is_modify())
+		z.save_append(compact);
+
+	z.close();
+}
+
 #if HAVE_GETOPT_LONG
 struct option long_options[] = {
 	{"add", 0, 0, 'a'},
 	{"extract", 0, 0, 'x'},
+	{"update", 0, 0, 'u'},
 	{"recompress", 0, 0, 'z'},
 	{"test", 0, 0, 't'},
 	{"list", 0, 0, 'l'},
 	{"list-crc", 0, 0, 'L'},
+	{"blocks", 0, 0, 'b'},
 
 	{"not-zip", 0, 0, 'N'},
 	{"pedantic", 0, 0, 'p'},
+	{"verify", 0, 0, 'y'},
 	{"keep-file-time", 0, 0, 'k'},
 
 	{"shrink-store", 0, 0, '0'},
@@ -444,6 +676,15 @@ struct option long_options[] = {
 	{"shrink-extra", 0, 0, '3'},
 	{"shrink-insane", 0, 0, '4'},
 	{"iter", 1, 0, 'i'},
+	{"iter-stop", 1, 0, 'I'},
+	{"seed", 0, 0, 'E'},
+	{"tree", 0, 0, 'B'},
+	{"stats", 0, 0, 'T'},
+	{"matches", 1, 0, 'G'},
+	{"cache", 1, 0, 'D'},
+	{"cache-size", 1, 0, 'M'},
+	{"jobs", 1, 0, 'j'},
+	{"compact", 1, 0, 'c'},
 
 	{"verbose", 0, 0, 'v'},
 	{"quiet", 0, 0, 'q'},
@@ -453,7 +694,7 @@ struct option long_options[] = {
 };
 #endif
 
-#define OPTIONS "axztlLNpk01234i:qhV"
+#define OPTIONS "axuztlLbNpyk01234i:I:EBTG:D:M:j:c:qhV"
 
 void version()
 {
@@ -469,17 +710,30 @@ void usage()
 	cout << "Modes:" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-a, --add           ", "-a") "  Create a new archive with the specified files" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-x, --extract       ", "-x") "  Extract the content of an archive" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-u, --update        ", "-u") "  Add or replace the changed files in an archive" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-l, --list          ", "-l") "  List the content of the archives" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-b, --blocks        ", "-b") "  List the deflate blocks of the archives" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-t, --test          ", "-t") "  Test the specified archives" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-z, --recompress    ", "-z") "  Recompress the specified archives" << endl;
 	cout << "Options:" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-p, --pedantic      ", "-p") "  Be pedantic on the zip tests" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-y, --verify        ", "-y") "  Verify the new compressed data" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-0, --shrink-store  ", "-0") "  Don't compress" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-1, --shrink-fast   ", "-1") "  Compress fast (zlib)" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-2, --shrink-normal ", "-2") "  Compress normal (libdeflate)" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-3, --shrink-extra  ", "-3") "  Compress extra (7z)" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-4, --shrink-insane ", "-4") "  Compress extreme (zopfli)" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-i N, --iter=N      ", "-i") "  Compress iterations" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-I N, --iter-stop=N ", "-I") "  Stop after N iterations without gain" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("                    ", "  ") "  With N,E the gains up to E bytes don't count" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-E, --seed          ", "-E") "  Start from the libdeflate compression" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-B, --tree          ", "-B") "  Find the matches of -4 with a binary tree" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-T, --stats         ", "-T") "  Print statistics of the iterations" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-G N, --matches=N   ", "-G") "  Match distances cached for each byte by -4" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-D DIR, --cache=DIR ", "-D") "  Reuse the compressed data cached in DIR" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-M N, --cache-size=N", "-M") "  Limit the cache to N MB" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-j N, --jobs=N      ", "-j") "  Use N threads" << endl;
+	cout << "  " SWITCH_GETOPT_LONG("-c N, --compact=N   ", "-c") "  UPDATE! Rewrite if unused space is over N%" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-k, --keep-file-time", "-k") "  REZIP! Don't alter zip time" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-q, --quiet         ", "-q") "  Don't print on the console" << endl;
 	cout << "  " SWITCH_GETOPT_LONG("-h, --help          ", "-h") "  Help of the program" << endl;
@@ -489,17 +743,28 @@ void usage()
 void process(int argc, char* argv[])
 {
 	enum cmd_t {
-		cmd_unset, cmd_add, cmd_extract, cmd_recompress, cmd_test, cmd_list
+		cmd_unset, cmd_add, cmd_extract, cmd_update, cmd_recompress, cmd_test, cmd_list, cmd_blocks
 	} cmd = cmd_unset;
 	bool quiet = false;
 	bool notzip = false;
 	bool pedantic = false;
+	bool verify = false;
 	bool crc = false;
 	bool keep_file_time = false;
 	shrink_t level;
 
 	level.level = shrink_normal;
 	level.iter = 0;
+	level.stop = 0;
+	level.epsilon = 0;
+	level.seed = false;
+	level.tree = false;
+	level.cache = SHRINK_CACHE_DEFAULT;
+	bool stats = false;
+	string cache_dir;
+	unsigned cache_size = CACHE_SIZE_DEFAULT;
+	unsigned jobs = 1;
+	unsigned compact = 100;
 
 	if (argc <= 1) {
 		usage();
@@ -527,6 +792,11 @@ void process(int argc, char* argv[])
 				throw error() << "Too many commands";
 			cmd = cmd_extract;
 			break;
+		case 'u' :
+			if (cmd != cmd_unset)
+				throw error() << "Too many commands";
+			cmd = cmd_update;
+			break;
 		case 'z' :
 			if (cmd != cmd_unset)
 				throw error() << "Too many commands";
@@ -548,12 +818,20 @@ void process(int argc, char* argv[])
 				throw error() << "Too many commands";
 				cmd = cmd_list;
 			break;
+		case 'b' :
+			if (cmd != cmd_unset)
+				throw error() << "Too many commands";
+			cmd = cmd_blocks;
+			break;
 		case 'N' :
 			notzip = true;
 			break;
 		case 'p' :
 			pedantic = true;
 			break;
+		case 'y' :
+			verify = true;
+			break;
 		case 'k' :
 			keep_file_time = true;
 			break;
@@ -575,6 +853,33 @@ void process(int argc, char* argv[])
 		case 'i':
 			level.iter = atoi(optarg);
 			break;
+		case 'I' :
+			shrink_stop_option(level, optarg);
+			break;
+		case 'E' :
+			level.seed = true;
+			break;
+		case 'B' :
+			level.tree = true;
+			break;
+		case 'T' :
+			stats = true;
+			break;
+		case 'G' :
+			level.cache = option_unsigned(optarg, 'G', 0, 255);
+			break;
+		case 'D' :
+			cache_dir = optarg;
+			break;
+		case 'M' :
+			cache_size = option_unsigned(optarg, 'M', 1, UINT_MAX);
+			break;
+		case 'j' :
+			jobs = option_unsigned(optarg, 'j', 1, 256);
+			break;
+		case 'c' :
+			compact = option_unsigned(optarg, 'c', 0, 100);
+			break;
 		case 'q' :
 			quiet = true;
 			break;
@@ -595,26 +900,43 @@ void process(int argc, char* argv[])
 
 	if (pedantic)
 		zip::pedantic_set(pedantic);
+	if (verify)
+		zip::verify_set(verify);
+
+	if (cache_dir.length())
+		cache_init(cache_dir, cache_size * 1024ULL * 1024ULL);
 
 	switch (cmd) {
 	case cmd_recompress :
 		rezip_all(argc - optind, argv + optind, quiet, !notzip, level, keep_file_time);
 		break;
 	case cmd_extract :
-		extract_all(argc - optind, argv + optind, quiet);
+		extract_all(argc - optind, argv + optind, quiet, jobs);
 		break;
 	case cmd_add :
-		add_all(argc - optind, argv + optind, quiet, !notzip, level);
+		add_all(argc - optind, argv + optind, quiet, !notzip, level, jobs);
+		break;
+	case cmd_update :
+		update_all(argc - optind, argv + optind, quiet, !notzip, level, jobs, compact);
 		break;
 	case cmd_test :
-		test_all(argc - optind, argv + optind, quiet);
+		test_all(argc - optind, argv + optind, quiet, jobs);
 		break;
 	case cmd_list :
 		list_all(argc - optind, argv + optind, crc);
 		break;
+	case cmd_blocks :
+		blocks_all(argc - optind, argv + optind);
+		break;
 	case cmd_unset :
 		throw error() << "No command specified";
 	}
+
+	if (cache_enabled() && !quiet)
+		cache_print(cout);
+
+	if (stats)
+		compress_zopfli_print(cout);
 }
 
 int main(int argc, char* argv[])
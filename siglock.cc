@@ -21,6 +21,7 @@
 #include "portable.h"
 
 #include "siglock.h"
+#include "thread.h"
 
 using namespace std;
 
@@ -69,3 +70,111 @@ void sig_unlock()
 		raise(sig_ignore_sig);
 }
 
+
+#if HAVE_SIGHUP
+static void (*sig_remove_hup)(int);
+#endif
+#if HAVE_SIGQUIT
+static void (*sig_remove_quit)(int);
+#endif
+#if HAVE_SIGPIPE
+static void (*sig_remove_pipe)(int);
+#endif
+static void (*sig_remove_int)(int);
+static void (*sig_remove_term)(int);
+
+/**
+ * Files to remove, one slot for each thread writing a temporary file.
+ * The signal handler reads the slots without locking.
+ */
+#define SIG_REMOVE_MAX 256
+static const char* volatile sig_remove_path[SIG_REMOVE_MAX];
+static unsigned sig_remove_count;
+static thread_mutex sig_remove_mutex;
+
+static void sig_remove_restore()
+{
+#if HAVE_SIGHUP
+	signal(SIGHUP, sig_remove_hup);
+#endif
+#if HAVE_SIGQUIT
+	signal(SIGQUIT, sig_remove_quit);
+#endif
+#if HAVE_SIGPIPE
+	signal(SIGPIPE, sig_remove_pipe);
+#endif
+	signal(SIGINT, sig_remove_int);
+	signal(SIGTERM, sig_remove_term);
+}
+
+static void sig_remove(int sig)
+{
+	unsigned i;
+
+	for(i=0;i<SIG_REMOVE_MAX;++i) {
+		const char* path = sig_remove_path[i];
+		if (path)
+			remove(path);
+	}
+
+	// raise the signal again with the original handler
+	sig_remove_restore();
+	raise(sig);
+}
+
+/**
+ * Set the remove handler, unless the signal is ignored.
+ */
+static void (*sig_remove_set(int sig))(int)
+{
+	void (*handler)(int) = signal(sig, sig_remove);
+	if (handler == SIG_IGN)
+		signal(sig, SIG_IGN);
+	return handler;
+}
+
+unsigned sig_remove_begin(const char* path)
+{
+	thread_auto_lock lock(sig_remove_mutex);
+	unsigned i;
+
+	for(i=0;i<SIG_REMOVE_MAX;++i)
+		if (!sig_remove_path[i])
+			break;
+
+	// without a free slot the file is not removed
+	if (i == SIG_REMOVE_MAX)
+		return i;
+
+	sig_remove_path[i] = path;
+
+	if (sig_remove_count++ == 0) {
+#if HAVE_SIGHUP
+		sig_remove_hup = sig_remove_set(SIGHUP);
+#endif
+#if HAVE_SIGQUIT
+		sig_remove_quit = sig_remove_set(SIGQUIT);
+#endif
+#if HAVE_SIGPIPE
+		// a closed output pipe, like with "advzip -x | head"
+		sig_remove_pipe = sig_remove_set(SIGPIPE);
+#endif
+		sig_remove_int = sig_remove_set(SIGINT);
+		sig_remove_term = sig_remove_set(SIGTERM);
+	}
+
+	return i;
+}
+
+void sig_remove_end(unsigned slot)
+{
+	thread_auto_lock lock(sig_remove_mutex);
+
+	if (slot == SIG_REMOVE_MAX)
+		return;
+
+	sig_remove_path[slot] = 0;
+
+	if (--sig_remove_count == 0)
+		sig_remove_restore();
+}
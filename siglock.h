@@ -30,5 +30,20 @@ public:
 	~sig_auto_lock() { sig_unlock(); }
 };
 
+unsigned sig_remove_begin(const char* path);
+void sig_remove_end(unsigned slot);
+
+/**
+ * Remove a temporary file if the program is stopped by an external signal.
+ * Different threads can register different files at the same time.
+ * The path must remain valid until the object is destroyed.
+ */
+class sig_auto_remove {
+	unsigned slot;
+public:
+	sig_auto_remove(const char* path) { slot = sig_remove_begin(path); }
+	~sig_auto_remove() { sig_remove_end(slot); }
+};
+
 #endif
 
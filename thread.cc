@@ -0,0 +1,235 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2024 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. 
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "portable.h"
+
+#include "thread.h"
+
+#include <new>
+
+using namespace std;
+
+#if HAVE_PTHREAD_H
+
+thread_mutex::thread_mutex()
+{
+	pthread_mutex_init(&mutex, 0);
+}
+
+thread_mutex::~thread_mutex()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+void thread_mutex::lock()
+{
+	pthread_mutex_lock(&mutex);
+}
+
+void thread_mutex::unlock()
+{
+	pthread_mutex_unlock(&mutex);
+}
+
+thread_cond::thread_cond()
+{
+	pthread_cond_init(&cond, 0);
+}
+
+thread_cond::~thread_cond()
+{
+	pthread_cond_destroy(&cond);
+}
+
+void thread_cond::wait(thread_mutex& mutex)
+{
+	pthread_cond_wait(&cond, &mutex.mutex);
+}
+
+void thread_cond::signal()
+{
+	pthread_cond_signal(&cond);
+}
+
+void thread_cond::broadcast()
+{
+	pthread_cond_broadcast(&cond);
+}
+
+#else
+
+thread_mutex::thread_mutex()
+{
+}
+
+thread_mutex::~thread_mutex()
+{
+}
+
+void thread_mutex::lock()
+{
+}
+
+void thread_mutex::unlock()
+{
+}
+
+thread_cond::thread_cond()
+{
+}
+
+thread_cond::~thread_cond()
+{
+}
+
+void thread_cond::wait(thread_mutex&)
+{
+}
+
+void thread_cond::signal()
+{
+}
+
+void thread_cond::broadcast()
+{
+}
+
+#endif
+
+unsigned thread_cpu()
+{
+#if HAVE_PTHREAD_H && defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 1)
+		return n;
+#endif
+	return 1;
+}
+
+struct thread_for_context {
+	void (*func)(void* arg, unsigned index);
+	void* arg;
+	unsigned count;
+
+	thread_mutex mutex;
+	unsigned next; /**< Next index to process. */
+
+	enum fail_t {
+		fail_none, fail_generic, fail_unsupported, fail_invalid
+	} fail; /**< Kind of the first error. */
+	error fail_error; /**< First error. */
+};
+
+static void thread_for_fail(thread_for_context* context, const error& e, int kind)
+{
+	thread_auto_lock lock(context->mutex);
+
+	// keep only the first error
+	if (context->fail == thread_for_context::fail_none) {
+		context->fail = (thread_for_context::fail_t)kind;
+		context->fail_error = e;
+	}
+
+	// skip the remaining indexes
+	context->next = context->count;
+}
+
+static void* thread_for_worker(void* arg)
+{
+	thread_for_context* context = (thread_for_context*)arg;
+
+	while (1) {
+		unsigned index;
+
+		{
+			thread_auto_lock lock(context->mutex);
+			if (context->next >= context->count)
+				break;
+			index = context->next++;
+		}
+
+		try {
+			context->func(context->arg, index);
+		} catch (error_unsupported& e) {
+			thread_for_fail(context, e, thread_for_context::fail_unsupported);
+		} catch (error_invalid& e) {
+			thread_for_fail(context, e, thread_for_context::fail_invalid);
+		} catch (error& e) {
+			thread_for_fail(context, e, thread_for_context::fail_generic);
+		} catch (std::bad_alloc&) {
+			thread_for_fail(context, error() << "Low memory", thread_for_context::fail_generic);
+		} catch (...) {
+			thread_for_fail(context, error() << "Unexpected exception", thread_for_context::fail_generic);
+		}
+	}
+
+	return 0;
+}
+
+void thread_for(unsigned jobs, unsigned count, void (*func)(void* arg, unsigned index), void* arg)
+{
+	thread_for_context context;
+
+	context.func = func;
+	context.arg = arg;
+	context.count = count;
+	context.next = 0;
+	context.fail = thread_for_context::fail_none;
+
+	if (jobs > count)
+		jobs = count;
+
+#if HAVE_PTHREAD_H
+	if (jobs > 1) {
+		pthread_t* thread = new pthread_t[jobs];
+		unsigned started = 0;
+
+		// the calling thread is the first worker
+		for(unsigned i=1;i<jobs;++i) {
+			if (pthread_create(&thread[started], 0, thread_for_worker, &context) != 0)
+				break; // continue with the threads already started
+			++started;
+		}
+
+		thread_for_worker(&context);
+
+		for(unsigned i=0;i<started;++i)
+			pthread_join(thread[i], 0);
+
+		delete [] thread;
+	} else {
+		thread_for_worker(&context);
+	}
+#else
+	thread_for_worker(&context);
+#endif
+
+	switch (context.fail) {
+	case thread_for_context::fail_none :
+		break;
+	case thread_for_context::fail_unsupported :
+		throw error_unsupported() << context.fail_error.desc_get();
+	case thread_for_context::fail_invalid :
+		throw error_invalid() << context.fail_error.desc_get();
+	default :
+		throw context.fail_error;
+	}
+}
+
@@ -0,0 +1,94 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2024 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. 
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __THREAD_H
+#define __THREAD_H
+
+#include "except.h"
+
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/**
+ * Mutex.
+ * Without thread support it does nothing.
+ */
+class thread_mutex {
+#if HAVE_PTHREAD_H
+	pthread_mutex_t mutex;
+#endif
+
+	thread_mutex(const thread_mutex&);
+	thread_mutex& operator=(const thread_mutex&);
+
+	friend class thread_cond;
+public:
+	thread_mutex();
+	~thread_mutex();
+
+	void lock();
+	void unlock();
+};
+
+class thread_auto_lock {
+	thread_mutex& mutex;
+public:
+	thread_auto_lock(thread_mutex& Amutex) : mutex(Amutex) { mutex.lock(); }
+	~thread_auto_lock() { mutex.unlock(); }
+};
+
+/**
+ * Condition variable, used with a locked mutex.
+ * Without thread support it does nothing.
+ */
+class thread_cond {
+#if HAVE_PTHREAD_H
+	pthread_cond_t cond;
+#endif
+
+	thread_cond(const thread_cond&);
+	thread_cond& operator=(const thread_cond&);
+public:
+	thread_cond();
+	~thread_cond();
+
+	void wait(thread_mutex& mutex);
+	void signal();
+	void broadcast();
+};
+
+/**
+ * Number of processors online.
+ * Without thread support it's always 1.
+ */
+unsigned thread_cpu();
+
+/**
+ * Call func(arg, i) for each i from 0 to count - 1, using up to jobs threads.
+ * The indexes are assigned in increasing order to the first free thread.
+ * If a call throws an error, the indexes not yet started are skipped,
+ * and the error is thrown again in the calling thread.
+ * Without thread support the calls are done in sequence.
+ */
+void thread_for(unsigned jobs, unsigned count, void (*func)(void* arg, unsigned index), void* arg);
+
+#endif
+
@@ -26,6 +26,10 @@
 #include "data.h"
 #include "lib/endianrw.h"
 
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 #include <zlib.h>
 
 #include <iostream>
@@ -33,6 +37,8 @@
 #include <string>
 #include <sstream>
 #include <set>
+#include <vector>
+#include <algorithm>
 
 using namespace std;
 
@@ -40,6 +46,7 @@ using namespace std;
  * Enable pendantic checks on the zip integrity.
  */
 bool zip::pedantic = false;
+bool zip::verify = false;
 
 bool ecd_compare_sig(const unsigned char *buffer)
 {
@@ -65,12 +72,61 @@ bool ecd_find_sig (const unsigned char *buffer, unsigned buflen, unsigned& offse
 
 #define ECD_READ_BUFFER_SIZE 4096
 
+/**
+ * Read a block of data at the specified position.
+ */
+static bool block_read(FILE* f, unsigned long long pos, unsigned char* buf, unsigned size)
+{
+	if (fseeko(f, pos, SEEK_SET) != 0)
+		return false;
+
+	if (fread(buf, size, 1, f) != 1)
+		return false;
+
+	return true;
+}
+
+/**
+ * Read the start of the cent dir from the zip64 end of cent dir.
+ * \param ecd_pos Position of the end of central dir.
+ * \param start_of_cent_dir Start of the cent dir. Unchanged if there is no zip64 end of central dir.
+ */
+static bool cent_read_zip64(FILE* f, unsigned long long length, unsigned long long ecd_pos, unsigned long long& start_of_cent_dir)
+{
+	unsigned char loc[ZIP_E64LO_FIXED];
+	unsigned char rec[ZIP_E64O_FIXED];
+
+	// the locator is just before the end of central dir
+	if (ecd_pos < ZIP_E64LO_FIXED)
+		return true;
+
+	if (!block_read(f, ecd_pos - ZIP_E64LO_FIXED, loc, ZIP_E64LO_FIXED))
+		return false;
+
+	if (le_uint32_read(loc + ZIP_E64LO_locator_signature) != ZIP_E64L_signature)
+		return true;
+
+	unsigned long long rec_pos = le_uint64_read(loc + ZIP_E64LO_offset_to_end_of_cent_dir);
+	if (rec_pos + ZIP_E64O_FIXED > length)
+		return false;
+
+	if (!block_read(f, rec_pos, rec, ZIP_E64O_FIXED))
+		return false;
+
+	if (le_uint32_read(rec + ZIP_E64O_end_of_central_dir_signature) != ZIP_E64_signature)
+		return false;
+
+	start_of_cent_dir = le_uint64_read(rec + ZIP_E64O_offset_to_start_of_cent_dir);
+
+	return true;
+}
+
 /**
  * Read cent dir and end cent dir data
  * \param f File to read.
  * \param length Length of the file.
  */
-bool cent_read(FILE* f, unsigned length, unsigned char*& data, unsigned& size)
+bool cent_read(FILE* f, unsigned long long length, unsigned char*& data, unsigned& size)
 {
 	unsigned buf_length;
 
@@ -85,7 +141,7 @@ bool cent_read(FILE* f, unsigned length, unsigned char*& data, unsigned& size)
 		if (buf_length > length)
 			buf_length = length;
 
-		if (fseek(f, length - buf_length, SEEK_SET) != 0) {
+		if (fseeko(f, length - buf_length, SEEK_SET) != 0) {
 			return false;
 		}
 
@@ -100,10 +156,15 @@ bool cent_read(FILE* f, unsigned length, unsigned char*& data, unsigned& size)
 
 		unsigned offset = 0;
 		if (ecd_find_sig(buf, buf_length, offset)) {
-			unsigned start_of_cent_dir = le_uint32_read(buf + offset + ZIP_EO_offset_to_start_of_cent_dir);
-			unsigned buf_pos = length - buf_length;
+			unsigned long long start_of_cent_dir = le_uint32_read(buf + offset + ZIP_EO_offset_to_start_of_cent_dir);
+			unsigned long long buf_pos = length - buf_length;
+
+			if (!cent_read_zip64(f, length, buf_pos + offset, start_of_cent_dir)) {
+				data_free(buf);
+				return false;
+			}
 
-			if (start_of_cent_dir >= length) {
+			if (start_of_cent_dir >= length || length - start_of_cent_dir > UINT_MAX) {
 				data_free(buf);
 				return false;
 			}
@@ -119,7 +180,7 @@ bool cent_read(FILE* f, unsigned length, unsigned char*& data, unsigned& size)
 			} else {
 				data_free(buf);
 
-				if (fseek(f, start_of_cent_dir, SEEK_SET) != 0) {
+				if (fseeko(f, start_of_cent_dir, SEEK_SET) != 0) {
 					data_free(data);
 					data = 0;
 					return false;
@@ -146,6 +207,47 @@ bool cent_read(FILE* f, unsigned length, unsigned char*& data, unsigned& size)
 	}
 }
 
+/**
+ * Locate cent dir and end cent dir data in a memory mapped zip.
+ * \param map_ptr Mapped file.
+ * \param length Length of the file.
+ * \param start_of_cent_dir Resulting start of the cent dir.
+ */
+static bool cent_map(const unsigned char* map_ptr, unsigned long long length, unsigned long long& start_of_cent_dir)
+{
+	unsigned buf_length = length < 8 * ECD_READ_BUFFER_SIZE ? length : 8 * ECD_READ_BUFFER_SIZE;
+	unsigned long long buf_pos = length - buf_length;
+
+	unsigned offset = 0;
+	if (!ecd_find_sig(map_ptr + buf_pos, buf_length, offset))
+		return false;
+
+	start_of_cent_dir = le_uint32_read(map_ptr + buf_pos + offset + ZIP_EO_offset_to_start_of_cent_dir);
+
+	// the zip64 locator is just before the end of central dir
+	unsigned long long ecd_pos = buf_pos + offset;
+	if (ecd_pos >= ZIP_E64LO_FIXED) {
+		const unsigned char* loc = map_ptr + ecd_pos - ZIP_E64LO_FIXED;
+
+		if (le_uint32_read(loc + ZIP_E64LO_locator_signature) == ZIP_E64L_signature) {
+			unsigned long long rec_pos = le_uint64_read(loc + ZIP_E64LO_offset_to_end_of_cent_dir);
+			if (rec_pos + ZIP_E64O_FIXED > length)
+				return false;
+
+			const unsigned char* rec = map_ptr + rec_pos;
+			if (le_uint32_read(rec + ZIP_E64O_end_of_central_dir_signature) != ZIP_E64_signature)
+				return false;
+
+			start_of_cent_dir = le_uint64_read(rec + ZIP_E64O_offset_to_start_of_cent_dir);
+		}
+	}
+
+	if (start_of_cent_dir >= length || length - start_of_cent_dir > UINT_MAX)
+		return false;
+
+	return true;
+}
+
 /** Code used for disk entry. */
 #define ZIP_UNIQUE_DISK 0
 
@@ -180,6 +282,42 @@ time_t zip2time(unsigned date, unsigned time)
 	return mktime(&tm);
 }
 
+/** Compute the crc of a buffer of any size. */
+unsigned zip_crc32(unsigned crc, const unsigned char* data, unsigned long long size)
+{
+	while (size > 0) {
+		unsigned run = size > 0x40000000 ? 0x40000000 : size;
+
+		crc = libdeflate_crc32(crc, data, run);
+
+		data += run;
+		size -= run;
+	}
+
+	return crc;
+}
+
+/**
+ * Search a field in an extra field data.
+ * \param id Field to search.
+ * \param pos Position of the field header, if found.
+ * \param len Size of the field data, if found.
+ */
+static bool extra_find(const unsigned char* extra, unsigned size, unsigned id, unsigned& pos, unsigned& len)
+{
+	pos = 0;
+	while (pos + ZIP_XO_FIXED <= size) {
+		len = le_uint16_read(extra + pos + ZIP_XO_data_size);
+		if (pos + ZIP_XO_FIXED + len > size)
+			return false;
+		if (le_uint16_read(extra + pos + ZIP_XO_header_id) == id)
+			return true;
+		pos += ZIP_XO_FIXED + len;
+	}
+
+	return false;
+}
+
 zip_entry::zip_entry(const zip& Aparent)
 {
 	memset(&info, 0xFF, sizeof(info));
@@ -200,6 +338,9 @@ zip_entry::zip_entry(const zip& Aparent)
 
 	info.compressed_size = 0;
 	data = 0;
+	data_owned = true;
+	data_offset = -1;
+	local_end = -1;
 }
 
 zip_entry::zip_entry(const zip_entry& A)
@@ -211,6 +352,9 @@ zip_entry::zip_entry(const zip_entry& A)
 	central_extra_field = data_dup(A.central_extra_field, info.central_extra_field_length);
 	file_comment = data_dup(A.file_comment, info.file_comment_length);
 	data = data_dup(A.data, A.info.compressed_size);
+	data_owned = true;
+	data_offset = A.data_offset;
+	local_end = A.local_end;
 }
 
 zip_entry::~zip_entry()
@@ -219,7 +363,7 @@ zip_entry::~zip_entry()
 	data_free(local_extra_field);
 	data_free(central_extra_field);
 	data_free(file_comment);
-	data_free(data);
+	unload();
 }
 
 zip_entry::method_t zip_entry::method_get() const
@@ -278,7 +422,7 @@ bool zip_entry::is_text() const
 void zip_entry::compressed_seek(FILE* f) const
 {
 	// seek to local header
-	if (fseek(f, offset_get(), SEEK_SET) != 0) {
+	if (fseeko(f, offset_get(), SEEK_SET) != 0) {
 		throw error_invalid() << "Failed seek " << parentname_get();
 	}
 
@@ -336,9 +480,10 @@ time_t zip_entry::time_get() const
 void zip_entry::time_set(time_t tod)
 {
 	time2zip(tod, info.last_mod_file_date, info.last_mod_file_time);
+	local_end = -1;
 }
 
-void zip_entry::set(method_t method, const string& Aname, const unsigned char* compdata, unsigned compsize, unsigned size, unsigned crc, unsigned date, unsigned time, bool is_text)
+void zip_entry::set(method_t method, const string& Aname, const unsigned char* compdata, unsigned long long compsize, unsigned long long size, unsigned crc, unsigned date, unsigned time, bool is_text)
 {
 	info.version_needed_to_extract = 20; // version 2.0
 	info.os_needed_to_extract = 0;
@@ -423,9 +568,11 @@ void zip_entry::set(method_t method, const string& Aname, const unsigned char* c
 			throw error_invalid() << "Compression method not supported";
 	}
 
-	data_free(data);
+	unload();
 	info.compressed_size = compsize;
 	data = data_dup(compdata, info.compressed_size);
+	data_owned = true;
+	data_offset = -1;
 
 	name_set(Aname);
 
@@ -448,6 +595,7 @@ void zip_entry::name_set(const string& Aname)
 	info.filename_length = Aname.length();
 	file_name = data_alloc(info.filename_length);
 	memcpy(file_name, Aname.c_str(), info.filename_length);
+	local_end = -1;
 }
 
 string zip_entry::name_get() const
@@ -471,6 +619,15 @@ void zip_entry::check_cent(const unsigned char* buf, unsigned buf_size) const
 	}
 }
 
+/**
+ * Check a size of the local header.
+ * The zip64 marker means that the real value is in the zip64 extra field.
+ */
+static bool local_size_match(unsigned long long size, unsigned value)
+{
+	return value == size || value == ZIP_ZIP64_MARKER;
+}
+
 /** Check local file header comparing with internal information. */
 void zip_entry::check_local(const unsigned char* buf) const
 {
@@ -499,10 +656,10 @@ void zip_entry::check_local(const unsigned char* buf) const
 			if (le_uint32_read(buf+ZIP_LO_crc32) != 0 && info.crc32 != le_uint32_read(buf+ZIP_LO_crc32)) {
 				throw error_invalid() << "Not zero crc on local header " << le_uint32_read(buf+ZIP_LO_crc32);
 			}
-			if (le_uint32_read(buf+ZIP_LO_compressed_size) != 0 && info.compressed_size != le_uint32_read(buf+ZIP_LO_compressed_size)) {
+			if (le_uint32_read(buf+ZIP_LO_compressed_size) != 0 && !local_size_match(info.compressed_size, le_uint32_read(buf+ZIP_LO_compressed_size))) {
 				throw error_invalid() << "Not zero compressed size in local header " << le_uint32_read(buf+ZIP_LO_compressed_size);
 			}
-			if (le_uint32_read(buf+ZIP_LO_uncompressed_size) != 0 && info.uncompressed_size != le_uint32_read(buf+ZIP_LO_uncompressed_size)) {
+			if (le_uint32_read(buf+ZIP_LO_uncompressed_size) != 0 && !local_size_match(info.uncompressed_size, le_uint32_read(buf+ZIP_LO_uncompressed_size))) {
 				throw error_invalid() << "Not zero uncompressed size in local header " << le_uint32_read(buf+ZIP_LO_uncompressed_size);
 			}
 		}
@@ -510,10 +667,10 @@ void zip_entry::check_local(const unsigned char* buf) const
 		if (info.crc32 != le_uint32_read(buf+ZIP_LO_crc32)) {
 			throw error_invalid() << "Invalid crc on local header " << info.crc32 << "/" << le_uint32_read(buf+ZIP_LO_crc32);
 		}
-		if (info.compressed_size != le_uint32_read(buf+ZIP_LO_compressed_size)) {
+		if (!local_size_match(info.compressed_size, le_uint32_read(buf+ZIP_LO_compressed_size))) {
 			throw error_invalid() << "Invalid compressed size in local header " << info.compressed_size << "/" << le_uint32_read(buf+ZIP_LO_compressed_size);
 		}
-		if (info.uncompressed_size != le_uint32_read(buf+ZIP_LO_uncompressed_size)) {
+		if (!local_size_match(info.uncompressed_size, le_uint32_read(buf+ZIP_LO_uncompressed_size))) {
 			throw error_invalid() << "Invalid uncompressed size in local header " << info.uncompressed_size << "/" << le_uint32_read(buf+ZIP_LO_uncompressed_size);
 		}
 	}
@@ -547,11 +704,151 @@ void zip_entry::check_descriptor(const unsigned char* buf) const
 	}
 }
 
+void zip_entry::check_descriptor64(const unsigned char* buf) const
+{
+	if (0x08074b50 != le_uint32_read(buf+ZIP_DO64_header_signature)) {
+		throw error_invalid() << "Invalid header signature on data descriptor " << le_uint32_read(buf+ZIP_DO64_crc32);
+	}
+	if (info.crc32 != le_uint32_read(buf+ZIP_DO64_crc32)) {
+		throw error_invalid() << "Invalid crc on data descriptor " << info.crc32 << "/" << le_uint32_read(buf+ZIP_DO64_crc32);
+	}
+	if (info.compressed_size != le_uint64_read(buf+ZIP_DO64_compressed_size)
+		// allow a 0 size, GNU unzip also allow it
+		&& 0 != le_uint64_read(buf+ZIP_DO64_compressed_size)) {
+		throw error_invalid() << "Invalid compressed size in data descriptor " << info.compressed_size << "/" << le_uint64_read(buf+ZIP_DO64_compressed_size);
+	}
+	if (info.uncompressed_size != le_uint64_read(buf+ZIP_DO64_uncompressed_size)
+		// allow a 0 size, GNU unzip also allow it
+		&& 0 != le_uint64_read(buf+ZIP_DO64_uncompressed_size)) {
+		throw error_invalid() << "Invalid uncompressed size in data descriptor " << info.uncompressed_size << "/" << le_uint64_read(buf+ZIP_DO64_uncompressed_size);
+	}
+}
+
+/**
+ * Read the zip64 extended information from the central extra field.
+ * The field is removed because it's recreated when saving, if required.
+ */
+void zip_entry::load_zip64()
+{
+	unsigned pos;
+	unsigned len;
+
+	while (extra_find(central_extra_field, info.central_extra_field_length, ZIP_X_zip64, pos, len)) {
+		const unsigned char* field = central_extra_field + pos + ZIP_XO_FIXED;
+		unsigned field_pos = 0;
+
+		// only the fields with the marker are present, in this order
+		if (info.uncompressed_size == ZIP_ZIP64_MARKER && field_pos + 8 <= len) {
+			info.uncompressed_size = le_uint64_read(field + field_pos);
+			field_pos += 8;
+		}
+		if (info.compressed_size == ZIP_ZIP64_MARKER && field_pos + 8 <= len) {
+			info.compressed_size = le_uint64_read(field + field_pos);
+			field_pos += 8;
+		}
+		if (info.relative_offset_of_local_header == ZIP_ZIP64_MARKER && field_pos + 8 <= len) {
+			info.relative_offset_of_local_header = le_uint64_read(field + field_pos);
+			field_pos += 8;
+		}
+
+		unsigned end = pos + ZIP_XO_FIXED + len;
+		memmove(central_extra_field + pos, central_extra_field + end, info.central_extra_field_length - end);
+		info.central_extra_field_length -= ZIP_XO_FIXED + len;
+	}
+}
+
+/** If the entry sizes require the zip64 format. */
+bool zip_entry::is_zip64_size() const
+{
+	return info.compressed_size >= ZIP_ZIP64_MARKER || info.uncompressed_size >= ZIP_ZIP64_MARKER;
+}
+
+/** If the entry requires the zip64 format. */
+bool zip_entry::is_zip64() const
+{
+	return is_zip64_size() || info.relative_offset_of_local_header >= ZIP_ZIP64_MARKER;
+}
+
+unsigned zip_entry::version_needed_get() const
+{
+	if (is_zip64() && info.version_needed_to_extract < ZIP_ZIP64_VERSION)
+		return ZIP_ZIP64_VERSION;
+
+	return info.version_needed_to_extract;
+}
+
 /** Unload compressed/uncomressed data. */
 void zip_entry::unload()
 {
-	data_free(data);
+	if (data_owned)
+		data_free(data);
 	data = 0;
+	data_owned = true;
+}
+
+/**
+ * Free a compressed data buffer, unless it's the not owned data of the entry.
+ */
+void zip_entry::data_discard(unsigned char* ptr)
+{
+	if (ptr != data || data_owned)
+		data_free(ptr);
+}
+
+/**
+ * Check the extra field of the local header.
+ * \param buf Fixed size local header.
+ * \param extra Local extra field.
+ * \param extra_length Size of the local extra field.
+ * \return If the zip64 extended information is present.
+ */
+bool zip_entry::check_local_extra(const unsigned char* buf, const unsigned char* extra, unsigned extra_length) const
+{
+	unsigned pos;
+	unsigned len;
+
+	if (!extra_find(extra, extra_length, ZIP_X_zip64, pos, len))
+		return false;
+
+	// in the local header both the sizes are present
+	if (le_uint32_read(buf+ZIP_LO_uncompressed_size) == ZIP_ZIP64_MARKER && len >= 16) {
+		if (info.uncompressed_size != le_uint64_read(extra + pos + ZIP_XO_FIXED)
+			|| info.compressed_size != le_uint64_read(extra + pos + ZIP_XO_FIXED + 8)) {
+			throw error_invalid() << "Invalid zip64 sizes in local header";
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Get the size of the data descriptor.
+ * \param zip64 If the zip64 extended information is present in the local header.
+ * \param size Space available for the data descriptor.
+ * \param offset Resulting position in the descriptor where the read data starts. It's not 0 if the signature is missing.
+ */
+static unsigned descriptor_size(bool zip64, unsigned long long size, unsigned& offset)
+{
+	unsigned data_desc_size;
+
+	// with the zip64 extended information the sizes are 64 bits
+	if (zip64)
+		data_desc_size = ZIP_DO64_FIXED;
+	else
+		data_desc_size = ZIP_DO_FIXED;
+
+	// handle the case of the ZIP_DO_header_signature missing
+	if (size == data_desc_size - 4) {
+		offset = ZIP_DO_crc32;
+	} else {
+		offset = 0;
+	}
+
+	if (size < data_desc_size - offset) {
+		throw error_invalid() << "Overflow of data descriptor";
+	}
+
+	return data_desc_size;
 }
 
 /**
@@ -559,7 +856,7 @@ void zip_entry::unload()
  * \param buf Fixed size local header.
  * \param f File seeked after the fixed size local header.
  */
-void zip_entry::load_local(const unsigned char* buf, FILE* f, unsigned size)
+void zip_entry::load_local(const unsigned char* buf, FILE* f, unsigned long long size)
 {
 	check_local(buf);
 
@@ -572,12 +869,24 @@ void zip_entry::load_local(const unsigned char* buf, FILE* f, unsigned size)
 	}
 	size -= info.filename_length + local_extra_field_length;
 
-	// skip filename and extra field
-	if (fseek(f, info.filename_length + local_extra_field_length, SEEK_CUR) != 0) {
+	// skip filename
+	if (fseek(f, info.filename_length, SEEK_CUR) != 0) {
 		throw error_invalid() << "Failed seek";
 	}
 
-	data_free(data);
+	// read the extra field, only to check the zip64 extended information
+	bool local_zip64 = false;
+	if (local_extra_field_length) {
+		unsigned char extra[0xFFFF];
+
+		if (fread(extra, local_extra_field_length, 1, f) != 1) {
+			throw error() << "Failed read";
+		}
+
+		local_zip64 = check_local_extra(buf, extra, local_extra_field_length);
+	}
+
+	unload();
 	data = data_alloc(info.compressed_size);
 
 	if (size < info.compressed_size) {
@@ -585,6 +894,8 @@ void zip_entry::load_local(const unsigned char* buf, FILE* f, unsigned size)
 	}
 	size -= info.compressed_size;
 
+	data_offset = ftello(f);
+
 	try {
 		if (info.compressed_size > 0) {
 			if (fread(data, info.compressed_size, 1, f) != 1) {
@@ -592,54 +903,136 @@ void zip_entry::load_local(const unsigned char* buf, FILE* f, unsigned size)
 			}
 		}
 	} catch (...) {
-		data_free(data);
-		data = 0;
+		unload();
 		throw;
 	}
 
 	// load the data descriptor
 	if ((le_uint16_read(buf+ZIP_LO_general_purpose_bit_flag) & ZIP_GEN_FLAGS_DEFLATE_ZERO) != 0) {
-		unsigned char data_desc[ZIP_DO_FIXED];
+		unsigned char data_desc[ZIP_DO64_FIXED];
 		unsigned offset;
+		unsigned data_desc_size = descriptor_size(local_zip64, size, offset);
 
-		// handle the case of the ZIP_DO_header_signature missing
-		if (size == ZIP_DO_FIXED - 4) {
-			le_uint32_write(data_desc+ZIP_DO_header_signature, 0x08074b50);
-			offset = ZIP_DO_crc32;
-		} else {
-			offset = 0;
-		}
-
-		if (size < ZIP_DO_FIXED - offset) {
-			throw error_invalid() << "Overflow of data descriptor";
-		}
+		le_uint32_write(data_desc+ZIP_DO_header_signature, 0x08074b50);
 
-		if (fread(data_desc + offset, ZIP_DO_FIXED - offset, 1, f) != 1) {
+		if (fread(data_desc + offset, data_desc_size - offset, 1, f) != 1) {
 			throw error() << "Failed read";
 		}
-		size -= ZIP_DO_FIXED - offset;
+		size -= data_desc_size - offset;
 
-		check_descriptor(data_desc);
+		if (local_zip64)
+			check_descriptor64(data_desc);
+		else
+			check_descriptor(data_desc);
 	}
+
+	local_end = ftello(f);
+}
+
+/**
+ * Load local file header from a memory mapped zip.
+ * The compressed data isn't copied, but it points into the mapped memory.
+ * \param buf Local header.
+ * \param size Space available for the local header, the data and the data descriptor.
+ * \param offset Position of the local header in the file.
+ * \return Size of the local header, the data and the data descriptor.
+ */
+unsigned long long zip_entry::load_local(const unsigned char* buf, unsigned long long size, off_t offset)
+{
+	const unsigned char* ptr = buf + ZIP_LO_FIXED;
+
+	size -= ZIP_LO_FIXED;
+
+	check_local(buf);
+
+	// use the local extra_field_length. It may be different than the
+	// central directory version in some zips.
+	unsigned local_extra_field_length = le_uint16_read(buf+ZIP_LO_extra_field_length);
+
+	if (size < info.filename_length + local_extra_field_length) {
+		throw error_invalid() << "Overflow of filename";
+	}
+	size -= info.filename_length + local_extra_field_length;
+
+	// skip filename
+	ptr += info.filename_length;
+
+	// check the extra field
+	bool local_zip64 = check_local_extra(buf, ptr, local_extra_field_length);
+	ptr += local_extra_field_length;
+
+	if (size < info.compressed_size) {
+		throw error_invalid() << "Overflow of compressed data";
+	}
+	size -= info.compressed_size;
+
+	unload();
+	data = const_cast<unsigned char*>(ptr);
+	data_owned = false;
+	data_offset = offset + (ptr - buf);
+	ptr += info.compressed_size;
+
+	// check the data descriptor
+	if ((le_uint16_read(buf+ZIP_LO_general_purpose_bit_flag) & ZIP_GEN_FLAGS_DEFLATE_ZERO) != 0) {
+		unsigned char data_desc[ZIP_DO64_FIXED];
+		unsigned desc_offset;
+		unsigned data_desc_size = descriptor_size(local_zip64, size, desc_offset);
+
+		le_uint32_write(data_desc+ZIP_DO_header_signature, 0x08074b50);
+		memcpy(data_desc + desc_offset, ptr, data_desc_size - desc_offset);
+		ptr += data_desc_size - desc_offset;
+
+		if (local_zip64)
+			check_descriptor64(data_desc);
+		else
+			check_descriptor(data_desc);
+	}
+
+	local_end = offset + (ptr - buf);
+
+	return ptr - buf;
+}
+
+/**
+ * Check if the local header, the data and the data descriptor in the parent zip can be kept as they are.
+ */
+bool zip_entry::local_unchanged() const
+{
+	// the central directory is written without the data descriptor bit,
+	// so the local headers with it cannot be kept
+	return local_end >= 0 && (info.general_purpose_bit_flag & ZIP_GEN_FLAGS_DEFLATE_ZERO) == 0;
 }
 
 /**
  * Save local file header.
  * \param f File seeked at correct position.
+ * \param parent Parent zip opened for reading. If specified, the unchanged data is copied from it.
  */
-void zip_entry::save_local(FILE* f)
+void zip_entry::save_local(FILE* f, FILE* parent)
 {
-	long offset = ftell(f);
+	off_t offset = ftello(f);
 
 	if (offset<0)
 		throw error() << "Failed tell";
 
 	info.relative_offset_of_local_header = offset;
 
+	// zip64 extended information, in the local header it contains always both the sizes
+	unsigned char zip64[ZIP_XO_FIXED + 16];
+	unsigned zip64_length = 0;
+	bool zip64_size = is_zip64_size();
+	if (zip64_size) {
+		le_uint16_write(zip64+ZIP_XO_header_id, ZIP_X_zip64);
+		le_uint16_write(zip64+ZIP_XO_data_size, 16);
+		le_uint64_write(zip64+ZIP_XO_FIXED, info.uncompressed_size);
+		le_uint64_write(zip64+ZIP_XO_FIXED+8, info.compressed_size);
+		zip64_length = ZIP_XO_FIXED + 16;
+	}
+
 	// write header
 	unsigned char buf[ZIP_LO_FIXED];
 	le_uint32_write(buf+ZIP_LO_local_file_header_signature, ZIP_L_signature);
-	le_uint8_write(buf+ZIP_LO_version_needed_to_extract, info.version_needed_to_extract);
+	le_uint8_write(buf+ZIP_LO_version_needed_to_extract, version_needed_get());
 	le_uint8_write(buf+ZIP_LO_os_needed_to_extract, info.os_needed_to_extract);
 	// clear the "data descriptor" bit
 	le_uint16_write(buf+ZIP_LO_general_purpose_bit_flag, info.general_purpose_bit_flag & ~ZIP_GEN_FLAGS_DEFLATE_ZERO);
@@ -647,10 +1040,10 @@ void zip_entry::save_local(FILE* f)
 	le_uint16_write(buf+ZIP_LO_last_mod_file_time, info.last_mod_file_time);
 	le_uint16_write(buf+ZIP_LO_last_mod_file_date, info.last_mod_file_date);
 	le_uint32_write(buf+ZIP_LO_crc32, info.crc32);
-	le_uint32_write(buf+ZIP_LO_compressed_size, info.compressed_size);
-	le_uint32_write(buf+ZIP_LO_uncompressed_size, info.uncompressed_size);
+	le_uint32_write(buf+ZIP_LO_compressed_size, zip64_size ? ZIP_ZIP64_MARKER : info.compressed_size);
+	le_uint32_write(buf+ZIP_LO_uncompressed_size, zip64_size ? ZIP_ZIP64_MARKER : info.uncompressed_size);
 	le_uint16_write(buf+ZIP_LO_filename_length, info.filename_length);
-	le_uint16_write(buf+ZIP_LO_extra_field_length, info.local_extra_field_length);
+	le_uint16_write(buf+ZIP_LO_extra_field_length, zip64_length + info.local_extra_field_length);
 
 	if (fwrite(buf, ZIP_LO_FIXED, 1, f) != 1) {
 		throw error() << "Failed write";
@@ -662,18 +1055,34 @@ void zip_entry::save_local(FILE* f)
 	}
 
 	// write the extra field
+	if (zip64_length && fwrite(zip64, zip64_length, 1, f) != 1) {
+		throw error() << "Failed write";
+	}
 	if (info.local_extra_field_length && fwrite(local_extra_field, info.local_extra_field_length, 1, f) != 1) {
 		throw error() << "Failed write";
 	}
 
+	off_t save_offset = ftello(f);
+	if (save_offset<0)
+		throw error() << "Failed tell";
+
 	// write data, directories don't have data
 	if (info.compressed_size) {
-		assert(data);
+		if (parent && data_offset >= 0) {
+			// copy the unchanged data directly from the parent zip
+			file_copy_range(f, parent, data_offset, info.compressed_size);
+		} else {
+			assert(data);
 
-		if (fwrite(data, info.compressed_size, 1, f) != 1) {
-			throw error() << "Failed write";
+			if (fwrite(data, info.compressed_size, 1, f) != 1) {
+				throw error() << "Failed write";
+			}
 		}
 	}
+
+	// the saved file becomes the new parent
+	data_offset = save_offset;
+	local_end = save_offset + info.compressed_size;
 }
 
 /**
@@ -726,6 +1135,8 @@ void zip_entry::load_cent(const unsigned char* buf, unsigned buf_size, unsigned&
 	central_extra_field = data_dup(buf, info.central_extra_field_length);
 	buf += info.central_extra_field_length;
 
+	load_zip64();
+
 	// read comment
 	data_free(file_comment);
 	file_comment = data_dup(buf, info.file_comment_length);
@@ -742,10 +1153,32 @@ void zip_entry::save_cent(FILE* f)
 {
 	unsigned char buf[ZIP_CO_FIXED];
 
+	// zip64 extended information, only with the fields that don't fit
+	unsigned char zip64[ZIP_XO_FIXED + ZIP_X_zip64_size_max];
+	unsigned zip64_length = 0;
+	if (is_zip64()) {
+		unsigned zip64_pos = ZIP_XO_FIXED;
+		if (info.uncompressed_size >= ZIP_ZIP64_MARKER) {
+			le_uint64_write(zip64+zip64_pos, info.uncompressed_size);
+			zip64_pos += 8;
+		}
+		if (info.compressed_size >= ZIP_ZIP64_MARKER) {
+			le_uint64_write(zip64+zip64_pos, info.compressed_size);
+			zip64_pos += 8;
+		}
+		if (info.relative_offset_of_local_header >= ZIP_ZIP64_MARKER) {
+			le_uint64_write(zip64+zip64_pos, info.relative_offset_of_local_header);
+			zip64_pos += 8;
+		}
+		le_uint16_write(zip64+ZIP_XO_header_id, ZIP_X_zip64);
+		le_uint16_write(zip64+ZIP_XO_data_size, zip64_pos - ZIP_XO_FIXED);
+		zip64_length = zip64_pos;
+	}
+
 	le_uint32_write(buf+ZIP_CO_central_file_header_signature, ZIP_C_signature);
 	le_uint8_write(buf+ZIP_CO_version_made_by, info.version_made_by);
 	le_uint8_write(buf+ZIP_CO_host_os, info.host_os);
-	le_uint8_write(buf+ZIP_CO_version_needed_to_extract, info.version_needed_to_extract);
+	le_uint8_write(buf+ZIP_CO_version_needed_to_extract, version_needed_get());
 	le_uint8_write(buf+ZIP_CO_os_needed_to_extract, info.os_needed_to_extract);
 	// clear the "data descriptor" bit
 	le_uint16_write(buf+ZIP_CO_general_purpose_bit_flag, info.general_purpose_bit_flag & ~ZIP_GEN_FLAGS_DEFLATE_ZERO);
@@ -753,15 +1186,15 @@ void zip_entry::save_cent(FILE* f)
 	le_uint16_write(buf+ZIP_CO_last_mod_file_time, info.last_mod_file_time);
 	le_uint16_write(buf+ZIP_CO_last_mod_file_date, info.last_mod_file_date);
 	le_uint32_write(buf+ZIP_CO_crc32, info.crc32);
-	le_uint32_write(buf+ZIP_CO_compressed_size, info.compressed_size);
-	le_uint32_write(buf+ZIP_CO_uncompressed_size, info.uncompressed_size);
+	le_uint32_write(buf+ZIP_CO_compressed_size, info.compressed_size >= ZIP_ZIP64_MARKER ? ZIP_ZIP64_MARKER : info.compressed_size);
+	le_uint32_write(buf+ZIP_CO_uncompressed_size, info.uncompressed_size >= ZIP_ZIP64_MARKER ? ZIP_ZIP64_MARKER : info.uncompressed_size);
 	le_uint16_write(buf+ZIP_CO_filename_length, info.filename_length);
-	le_uint16_write(buf+ZIP_CO_extra_field_length, info.central_extra_field_length);
+	le_uint16_write(buf+ZIP_CO_extra_field_length, zip64_length + info.central_extra_field_length);
 	le_uint16_write(buf+ZIP_CO_file_comment_length, info.file_comment_length);
 	le_uint16_write(buf+ZIP_CO_disk_number_start, ZIP_UNIQUE_DISK);
 	le_uint16_write(buf+ZIP_CO_internal_file_attrib, info.internal_file_attrib);
 	le_uint32_write(buf+ZIP_CO_external_file_attrib, info.external_file_attrib);
-	le_uint32_write(buf+ZIP_CO_relative_offset_of_local_header, info.relative_offset_of_local_header);
+	le_uint32_write(buf+ZIP_CO_relative_offset_of_local_header, info.relative_offset_of_local_header >= ZIP_ZIP64_MARKER ? ZIP_ZIP64_MARKER : info.relative_offset_of_local_header);
 
 	if (fwrite(buf, ZIP_CO_FIXED, 1, f) != 1) {
 		throw error() << "Failed write";
@@ -773,6 +1206,9 @@ void zip_entry::save_cent(FILE* f)
 	}
 
 	// write extra field
+	if (zip64_length && fwrite(zip64, zip64_length, 1, f) != 1) {
+		throw error() << "Failed write";
+	}
 	if (info.central_extra_field_length && fwrite(central_extra_field, info.central_extra_field_length, 1, f) != 1) {
 		throw error() << "Failed write";
 	}
@@ -789,6 +1225,8 @@ zip::zip(const std::string& Apath) : path(Apath)
 	flag.read = false;
 	flag.modify = false;
 	zipfile_comment = 0;
+	mmap_ptr = 0;
+	mmap_size = 0;
 }
 
 zip::zip(const zip& A) : map(A.map), path(A.path)
@@ -796,6 +1234,9 @@ zip::zip(const zip& A) : map(A.map), path(A.path)
 	flag = A.flag;
 	info = A.info;
 	zipfile_comment = data_dup(A.zipfile_comment, A.info.zipfile_comment_length);
+	// the copied entries own their data, the mapping isn't shared
+	mmap_ptr = 0;
+	mmap_size = 0;
 }
 
 zip::~zip()
@@ -832,25 +1273,42 @@ void zip::open()
 		return;
 	}
 
-	unsigned length = s.st_size;
-
-	// open file
-	FILE* f = fopen(path.c_str(), "rb");
-	if (!f)
-		throw error() << "Failed open for reading";
+	unsigned long long length = s.st_size;
 
 	unsigned char* data = 0;
 	unsigned data_size = 0;
+	unsigned char* cent_buffer = 0; // allocated cent data, if the file is not mapped
 
-	try {
-		if (!cent_read(f, length, data, data_size))
+	mmap_open(length);
+
+	if (mmap_ptr) {
+		// the cent data is used directly from the mapped file
+		unsigned long long start_of_cent_dir;
+		if (!cent_map(mmap_ptr, length, start_of_cent_dir)) {
+			mmap_close();
 			throw error_invalid() << "Failed read end of central directory";
-	} catch (...) {
+		}
+
+		data = mmap_ptr + start_of_cent_dir;
+		data_size = length - start_of_cent_dir;
+	} else {
+		// open file
+		FILE* f = fopen(path.c_str(), "rb");
+		if (!f)
+			throw error() << "Failed open for reading";
+
+		try {
+			if (!cent_read(f, length, cent_buffer, data_size))
+				throw error_invalid() << "Failed read end of central directory";
+		} catch (...) {
+			fclose(f);
+			throw;
+		}
+
 		fclose(f);
-		throw;
-	}
 
-	fclose(f);
+		data = cent_buffer;
+	}
 
 	// position in data
 	unsigned data_pos = 0;
@@ -872,6 +1330,28 @@ void zip::open()
 			data_pos += skip;
 		}
 
+		// zip64 end of central dir
+		bool zip64 = false;
+		unsigned long long zip64_offset_to_start_of_cent_dir = 0;
+		if (data_pos + 4 <= data_size && le_uint32_read(data+data_pos) == ZIP_E64_signature) {
+			if (data_pos+ZIP_E64O_FIXED > data_size)
+				throw error_invalid() << "Truncated zip64 end of central dir";
+
+			// the size of the record doesn't include the leading 12 bytes
+			unsigned long long record_size = le_uint64_read(data+data_pos+ZIP_E64O_size_of_record) + 12;
+			if (record_size < ZIP_E64O_FIXED || record_size + ZIP_E64LO_FIXED > data_size - data_pos)
+				throw error_invalid() << "Truncated zip64 end of central dir";
+
+			zip64 = true;
+			zip64_offset_to_start_of_cent_dir = le_uint64_read(data+data_pos+ZIP_E64O_offset_to_start_of_cent_dir);
+			data_pos += record_size;
+
+			// zip64 end of central dir locator
+			if (le_uint32_read(data+data_pos) != ZIP_E64L_signature)
+				throw error_invalid() << "Invalid zip64 end of central dir locator signature";
+			data_pos += ZIP_E64LO_FIXED;
+		}
+
 		if (data_pos+ZIP_EO_FIXED > data_size)
 			throw error_invalid() << "Truncated end of central dir";
 
@@ -883,6 +1363,9 @@ void zip::open()
 		info.zipfile_comment_length = le_uint16_read(data+data_pos+ZIP_EO_zipfile_comment_length);
 		data_pos += ZIP_EO_FIXED;
 
+		if (zip64 && info.offset_to_start_of_cent_dir == ZIP_ZIP64_MARKER)
+			info.offset_to_start_of_cent_dir = zip64_offset_to_start_of_cent_dir;
+
 		if (info.offset_to_start_of_cent_dir != length - data_size)
 			throw error_invalid() << "Invalid end of central directory start address";
 
@@ -896,17 +1379,20 @@ void zip::open()
 		data_pos += info.zipfile_comment_length;
 
 	} catch (...) {
-		data_free(data);
+		data_free(cent_buffer);
+		mmap_close();
 		throw;
 	}
 
 	// delete cent data
-	data_free(data);
+	data_free(cent_buffer);
 
 	if (pedantic) {
 		// don't accept garbage at the end of file
-		if (data_pos != data_size)
+		if (data_pos != data_size) {
+			mmap_close();
 			throw error_invalid() << data_size - data_pos << " unused bytes at the end of the central directory";
+		}
 	}
 
 	flag.open = true;
@@ -927,6 +1413,56 @@ void zip::close()
 	zipfile_comment = 0;
 	path = "";
 	map.erase(map.begin(), map.end());
+
+	// the entries may point into the mapped file, so unmap only after them
+	mmap_close();
+}
+
+/**
+ * Map the zip file in memory.
+ * If the mapping isn't available, the zip is read with the stdio functions.
+ * \param length Size of the file.
+ */
+void zip::mmap_open(unsigned long long length)
+{
+	mmap_ptr = 0;
+	mmap_size = 0;
+
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+	// empty files cannot be mapped
+	if (length == 0 || static_cast<size_t>(length) != length)
+		return;
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw error() << "Failed open for reading";
+
+	void* ptr = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	// the mapping remains valid after closing the file
+	::close(fd);
+
+	if (ptr == MAP_FAILED)
+		return;
+
+	mmap_ptr = static_cast<unsigned char*>(ptr);
+	mmap_size = length;
+#else
+	(void)length;
+#endif
+}
+
+/**
+ * Unmap the zip file.
+ */
+void zip::mmap_close()
+{
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+	if (mmap_ptr)
+		munmap(mmap_ptr, mmap_size);
+#endif
+	mmap_ptr = 0;
+	mmap_size = 0;
 }
 
 /**
@@ -955,6 +1491,11 @@ void zip::reopen()
 	open();
 }
 
+static bool offset_less(const zip::iterator& a, const zip::iterator& b)
+{
+	return a->offset_get() < b->offset_get();
+}
+
 /**
  * Load a zip file.
  */
@@ -964,69 +1505,69 @@ void zip::load()
 
 	flag.modify = false;
 
-	FILE* f = fopen(path.c_str(), "rb");
-	if (!f)
-		throw error() << "Failed open for reading";
+	// with the memory mapping the file is not read
+	FILE* f = 0;
+	if (!mmap_ptr) {
+		f = fopen(path.c_str(), "rb");
+		if (!f)
+			throw error() << "Failed open for reading";
+	}
 
 	try {
-		long offset = 0;
+		unsigned long long offset = 0;
 		unsigned count = 0;
 
-		while (static_cast<unsigned long>(offset) < info.offset_to_start_of_cent_dir) {
+		// sort the entries by offset, they may be in random order
+		vector<iterator> order;
+		order.reserve(size());
+		for(iterator i=begin();i!=end();++i)
+			order.push_back(i);
+		stable_sort(order.begin(), order.end(), offset_less);
+
+		vector<iterator>::iterator j = order.begin();
+
+		while (offset < info.offset_to_start_of_cent_dir) {
 			unsigned char buf[ZIP_LO_FIXED];
 
-			// search the next item, assume entries in random order
-			iterator next;
-			bool next_set = false;
-			for(iterator i=begin();i!=end();++i) {
-				if (i->offset_get() >= static_cast<unsigned long>(offset)) {
-					if (!next_set || i->offset_get() < next->offset_get()) {
-						next_set = true;
-						next = i;
-					}
-				}
-			}
+			// search the next item
+			while (j != order.end() && (*j)->offset_get() < offset)
+				++j;
 
 			// if not found exit
-			if (!next_set) {
+			if (j == order.end()) {
 				if (pedantic)
-					throw error_invalid() << info.offset_to_start_of_cent_dir - static_cast<unsigned long>(offset) << " unused bytes after the last local header at offset " << offset;
+					throw error_invalid() << info.offset_to_start_of_cent_dir - offset << " unused bytes after the last local header at offset " << offset;
 				else
 					break;
 			}
 
+			iterator next = *j;
+
 			// check for invalid start
 			if (next->offset_get() >= info.offset_to_start_of_cent_dir) {
 				throw error_invalid() << "Overflow in central directory";
 			}
 
-			// check for a data hole
-			if (next->offset_get() > static_cast<unsigned long>(offset)) {
-				if (pedantic)
-					throw error_invalid() << next->offset_get() - static_cast<unsigned long>(offset) << " unused bytes at offset " << offset;
+			// check for a data hole, allowing the padding of save_append()
+			if (next->offset_get() > offset) {
+				if (pedantic && !is_padding(offset, next->offset_get()))
+					throw error_invalid() << next->offset_get() - offset << " unused bytes at offset " << offset;
 				else {
 					// set the correct position
-					if (fseek(f, next->offset_get(), SEEK_SET) != 0)
+					if (f && fseeko(f, next->offset_get(), SEEK_SET) != 0)
 						throw error() << "Failed fseek";
 					offset = next->offset_get();
 				}
 			}
 
-			// search the next item, assume entries in random order
-			iterator next_next;
-			bool next_next_set = false;
-			for(iterator i=begin();i!=end();++i) {
-				if (i->offset_get() > static_cast<unsigned long>(offset)) {
-					if (!next_next_set || i->offset_get() < next_next->offset_get()) {
-						next_next_set = true;
-						next_next = i;
-					}
-				}
-			}
+			// search the next item after this one
+			vector<iterator>::iterator j_next = j;
+			while (j_next != order.end() && (*j_next)->offset_get() <= offset)
+				++j_next;
 
-			unsigned long end_offset;
-			if (next_next_set)
-				end_offset = next_next->offset_get();
+			unsigned long long end_offset;
+			if (j_next != order.end())
+				end_offset = (*j_next)->offset_get();
 			else
 				end_offset = info.offset_to_start_of_cent_dir;
 
@@ -1034,19 +1575,24 @@ void zip::load()
 				throw error_invalid() << "Invalid local header size at offset " << offset;
 			}
 
-			if (fread(buf, ZIP_LO_FIXED, 1, f) != 1)
-				throw error() << "Failed read";
+			if (mmap_ptr) {
+				offset += next->load_local(mmap_ptr + offset, end_offset - offset, offset);
+			} else {
+				if (fread(buf, ZIP_LO_FIXED, 1, f) != 1)
+					throw error() << "Failed read";
 
-			next->load_local(buf, f, end_offset - next->offset_get() - ZIP_LO_FIXED);
+				next->load_local(buf, f, end_offset - next->offset_get() - ZIP_LO_FIXED);
 
-			++count;
+				off_t pos = ftello(f);
+				if (pos < 0)
+					throw error() << "Failed tell";
+				offset = pos;
+			}
 
-			offset = ftell(f);
-			if (offset < 0)
-				throw error() << "Failed tell";
+			++count;
 		}
 
-		if (static_cast<unsigned long>(offset) != info.offset_to_start_of_cent_dir) {
+		if (offset != info.offset_to_start_of_cent_dir) {
 			if (pedantic)
 				throw error_invalid() << "Invalid central directory start";
 		}
@@ -1055,11 +1601,13 @@ void zip::load()
 			throw error_invalid() << "Invalid central directory, expected " << size() << " local headers, got " << count;
 
 	} catch (...) {
-		fclose(f);
+		if (f)
+			fclose(f);
 		throw;
 	}
 
-	fclose(f);
+	if (f)
+		fclose(f);
 
 	flag.read = true;
 }
@@ -1078,6 +1626,112 @@ unsigned zip::size_not_zero() const
 	return count;
 }
 
+/**
+ * Save the central directory and the end of central directory.
+ * \param f File seeked after the last local header.
+ */
+void zip::save_directory(FILE* f)
+{
+	off_t cent_offset = ftello(f);
+	if (cent_offset<0)
+		throw error() << "Failed tell";
+
+	// new cent start
+	info.offset_to_start_of_cent_dir = cent_offset;
+
+	// write cent dir
+	for(iterator i=begin();i!=end();++i)
+		i->save_cent(f);
+
+	off_t end_cent_offset = ftello(f);
+	if (end_cent_offset<0)
+		throw error() << "Failed tell";
+
+	unsigned long long cent_start = cent_offset;
+	unsigned long long cent_size = end_cent_offset - cent_offset;
+	unsigned entries = size();
+
+	// write the zip64 end of cent dir if something doesn't fit
+	if (entries >= ZIP_ZIP64_MARKER16 || cent_start >= ZIP_ZIP64_MARKER || cent_size >= ZIP_ZIP64_MARKER) {
+		unsigned char buf64[ZIP_E64O_FIXED];
+		le_uint32_write(buf64+ZIP_E64O_end_of_central_dir_signature, ZIP_E64_signature);
+		le_uint64_write(buf64+ZIP_E64O_size_of_record, ZIP_E64O_FIXED - 12);
+		le_uint16_write(buf64+ZIP_E64O_version_made_by, ZIP_ZIP64_VERSION);
+		le_uint16_write(buf64+ZIP_E64O_version_needed_to_extract, ZIP_ZIP64_VERSION);
+		le_uint32_write(buf64+ZIP_E64O_number_of_this_disk, ZIP_UNIQUE_DISK);
+		le_uint32_write(buf64+ZIP_E64O_number_of_disk_start_cent_dir, ZIP_UNIQUE_DISK);
+		le_uint64_write(buf64+ZIP_E64O_total_entries_cent_dir_this_disk, entries);
+		le_uint64_write(buf64+ZIP_E64O_total_entries_cent_dir, entries);
+		le_uint64_write(buf64+ZIP_E64O_size_of_cent_dir, cent_size);
+		le_uint64_write(buf64+ZIP_E64O_offset_to_start_of_cent_dir, cent_start);
+
+		if (fwrite(buf64, ZIP_E64O_FIXED, 1, f) != 1)
+			throw error() << "Failed write";
+
+		unsigned char loc[ZIP_E64LO_FIXED];
+		le_uint32_write(loc+ZIP_E64LO_locator_signature, ZIP_E64L_signature);
+		le_uint32_write(loc+ZIP_E64LO_number_of_disk_start_end_cent_dir, ZIP_UNIQUE_DISK);
+		le_uint64_write(loc+ZIP_E64LO_offset_to_end_of_cent_dir, end_cent_offset);
+		le_uint32_write(loc+ZIP_E64LO_total_number_of_disks, 1);
+
+		if (fwrite(loc, ZIP_E64LO_FIXED, 1, f) != 1)
+			throw error() << "Failed write";
+	}
+
+	// write end of cent dir
+	unsigned char buf[ZIP_EO_FIXED];
+	le_uint32_write(buf+ZIP_EO_end_of_central_dir_signature, ZIP_E_signature);
+	le_uint16_write(buf+ZIP_EO_number_of_this_disk, ZIP_UNIQUE_DISK);
+	le_uint16_write(buf+ZIP_EO_number_of_disk_start_cent_dir, ZIP_UNIQUE_DISK);
+	le_uint16_write(buf+ZIP_EO_total_entries_cent_dir_this_disk, entries >= ZIP_ZIP64_MARKER16 ? ZIP_ZIP64_MARKER16 : entries);
+	le_uint16_write(buf+ZIP_EO_total_entries_cent_dir, entries >= ZIP_ZIP64_MARKER16 ? ZIP_ZIP64_MARKER16 : entries);
+	le_uint32_write(buf+ZIP_EO_size_of_cent_dir, cent_size >= ZIP_ZIP64_MARKER ? ZIP_ZIP64_MARKER : cent_size);
+	le_uint32_write(buf+ZIP_EO_offset_to_start_of_cent_dir, cent_start >= ZIP_ZIP64_MARKER ? ZIP_ZIP64_MARKER : cent_start);
+	le_uint16_write(buf+ZIP_EO_zipfile_comment_length, info.zipfile_comment_length);
+
+	if (fwrite(buf, ZIP_EO_FIXED, 1, f) != 1)
+		throw error() << "Failed write";
+
+	// write comment
+	if (info.zipfile_comment_length && fwrite(zipfile_comment, info.zipfile_comment_length, 1, f) != 1)
+		throw error() << "Failed write";
+}
+
+/**
+ * Replace the zip file with the saved one.
+ * \param save_path Temporary file saved.
+ */
+void zip::save_replace(const string& save_path)
+{
+	// delete the file if exists
+	if (access(path.c_str(), F_OK) == 0) {
+		if (remove(path.c_str()) != 0) {
+			remove(save_path.c_str());
+			throw error() << "Failed delete of " << path;
+		}
+	}
+
+	// rename the new version with the correct name
+	if (::rename(save_path.c_str(), path.c_str()) != 0) {
+		throw error() << "Failed rename of " << save_path << " to " << path;
+	}
+}
+
+/**
+ * Delete the zip file, if it exists.
+ */
+void zip::save_empty()
+{
+	// reset the cent start
+	info.offset_to_start_of_cent_dir = 0;
+
+	// delete the file if exists
+	if (access(path.c_str(), F_OK) == 0) {
+		if (remove(path.c_str()) != 0)
+			throw error() << "Failed delete of " << path;
+	}
+}
+
 /**
  * Save a zip file.
  */
@@ -1103,39 +1757,7 @@ void zip::save()
 			for(iterator i=begin();i!=end();++i)
 				i->save_local(f);
 
-			long cent_offset = ftell(f);
-			if (cent_offset<0)
-				throw error() << "Failed tell";
-
-			// new cent start
-			info.offset_to_start_of_cent_dir = cent_offset;
-
-			// write cent dir
-			for(iterator i=begin();i!=end();++i)
-				i->save_cent(f);
-
-			long end_cent_offset = ftell(f);
-			if (end_cent_offset<0)
-				throw error() << "Failed tell";
-
-			// write end of cent dir
-			unsigned char buf[ZIP_EO_FIXED];
-			le_uint32_write(buf+ZIP_EO_end_of_central_dir_signature, ZIP_E_signature);
-			le_uint16_write(buf+ZIP_EO_number_of_this_disk, ZIP_UNIQUE_DISK);
-			le_uint16_write(buf+ZIP_EO_number_of_disk_start_cent_dir, ZIP_UNIQUE_DISK);
-			le_uint16_write(buf+ZIP_EO_total_entries_cent_dir_this_disk, size());
-			le_uint16_write(buf+ZIP_EO_total_entries_cent_dir, size());
-			le_uint32_write(buf+ZIP_EO_size_of_cent_dir, end_cent_offset - cent_offset);
-			le_uint32_write(buf+ZIP_EO_offset_to_start_of_cent_dir, cent_offset);
-			le_uint16_write(buf+ZIP_EO_zipfile_comment_length, info.zipfile_comment_length);
-
-			if (fwrite(buf, ZIP_EO_FIXED, 1, f) != 1)
-				throw error() << "Failed write";
-
-			// write comment
-			if (info.zipfile_comment_length && fwrite(zipfile_comment, info.zipfile_comment_length, 1, f) != 1)
-				throw error() << "Failed write";
-
+			save_directory(f);
 		} catch (...) {
 			fclose(f);
 			remove(save_path.c_str());
@@ -1144,29 +1766,275 @@ void zip::save()
 
 		fclose(f);
 
-		// delete the file if exists
-		if (access(path.c_str(), F_OK) == 0) {
-			if (remove(path.c_str()) != 0) {
-				remove(save_path.c_str());
-				throw error() << "Failed delete of " << path;
-			}
+		save_replace(save_path);
+	} else {
+		save_empty();
+	}
+}
+
+/**
+ * Write the padding that marks the unused space left by save_append().
+ * It's a sequence of local headers without name, with the old data stored as is.
+ * These headers are not in the central directory, and is_padding() recognizes them.
+ */
+static void save_padding(FILE* f, unsigned long long offset, unsigned long long size)
+{
+	while (size > 0) {
+		unsigned char buf[ZIP_LO_FIXED];
+		unsigned long long run = size;
+
+		// the sizes of a local header are 32 bits
+		if (run > 0x80000000ULL) {
+			run = 0x80000000ULL;
+			if (size - run < ZIP_LO_FIXED)
+				run -= ZIP_LO_FIXED;
 		}
 
-		// rename the new version with the correct name
-		if (::rename(save_path.c_str(), path.c_str()) != 0) {
-			throw error() << "Failed rename of " << save_path << " to " << path;
+		memset(buf, 0, sizeof(buf));
+		le_uint32_write(buf+ZIP_LO_local_file_header_signature, ZIP_L_signature);
+		buf[ZIP_LO_version_needed_to_extract] = 10;
+		le_uint16_write(buf+ZIP_LO_compression_method, ZIP_METHOD_STORE);
+		le_uint32_write(buf+ZIP_LO_compressed_size, run - ZIP_LO_FIXED);
+		le_uint32_write(buf+ZIP_LO_uncompressed_size, run - ZIP_LO_FIXED);
+
+		if (fseeko(f, offset, SEEK_SET) != 0)
+			throw error() << "Failed seek";
+		if (fwrite(buf, ZIP_LO_FIXED, 1, f) != 1)
+			throw error() << "Failed write";
+
+		offset += run;
+		size -= run;
+	}
+}
+
+/**
+ * Restore the data overwritten by save_append().
+ * Errors are ignored, as it's already called on an error.
+ */
+static void save_append_restore(FILE* f, unsigned long long offset, const unsigned char* data, unsigned long long size)
+{
+	if (fseeko(f, offset, SEEK_SET) != 0)
+		return;
+	if (size != 0 && fwrite(data, size, 1, f) != 1)
+		return;
+	if (fflush(f) != 0)
+		return;
+	if (ftruncate(fileno(f), offset + size) != 0)
+		return;
+}
+
+/**
+ * Save a zip file, writing only the changed entries.
+ * The unchanged entries are kept in place, the others are written after
+ * the last unchanged one, followed by a new central directory.
+ * The space of the removed entries before this point is left unused.
+ * The old data overwritten is kept in memory, and restored on failure.
+ * \param compact Percentage of unused space that triggers a full save().
+ * With 100 the full save() is never forced.
+ */
+void zip::save_append(unsigned compact)
+{
+	assert(flag.open && flag.read);
+
+	unsigned long long append_offset = 0; // end of the unchanged entries
+	unsigned long long used = 0; // space used by the unchanged entries
+	bool full = false;
+
+	vector< pair<unsigned long long, unsigned long long> > kept; // space of the unchanged entries
+
+	for(iterator i=begin();i!=end();++i) {
+		if (i->local_unchanged()) {
+			if (static_cast<unsigned long long>(i->local_end) > append_offset)
+				append_offset = i->local_end;
+			used += i->local_end - i->offset_get();
+			kept.push_back(make_pair(i->offset_get(), static_cast<unsigned long long>(i->local_end)));
+		} else if (!i->data_owned) {
+			// the data in the mapped file may be overwritten before being written
+			full = true;
 		}
+	}
 
-	} else {
-		// reset the cent start
-		info.offset_to_start_of_cent_dir = 0;
+	// if nothing is kept, or too much space is lost, write a new file
+	if (used == 0 || empty())
+		full = true;
+	if (compact < 100 && (append_offset - used) * 100 > append_offset * compact)
+		full = true;
+
+	if (full) {
+		save();
+		return;
+	}
+
+	sort(kept.begin(), kept.end());
+
+	flag.modify = false;
+
+	// prevent external signal
+	sig_auto_lock sal;
+
+	FILE* f = fopen(path.c_str(), "r+b");
+	if (!f)
+		throw error() << "Failed open for writing of " << path;
 
-		// delete the file if exists
-		if (access(path.c_str(), F_OK) == 0) {
-			if (remove(path.c_str()) != 0)
-				throw error() << "Failed delete of " << path;
+	// copy of the old data overwritten, with the old central directory
+	unsigned char* backup = 0;
+	unsigned long long backup_size = 0;
+	bool backup_dirty = false;
+
+	try {
+		if (fseeko(f, 0, SEEK_END) != 0)
+			throw error() << "Failed seek";
+		off_t old_end = ftello(f);
+		if (old_end < 0)
+			throw error() << "Failed tell";
+		if (static_cast<unsigned long long>(old_end) < append_offset)
+			throw error() << "Invalid size of " << path;
+
+		backup_size = old_end - append_offset;
+		backup = data_alloc(backup_size);
+
+		if (fseeko(f, append_offset, SEEK_SET) != 0)
+			throw error() << "Failed seek";
+		if (backup_size != 0 && fread(backup, backup_size, 1, f) != 1)
+			throw error() << "Failed read";
+		if (fseeko(f, append_offset, SEEK_SET) != 0)
+			throw error() << "Failed seek";
+
+		backup_dirty = true;
+
+		for(iterator i=begin();i!=end();++i) {
+			if (!i->local_unchanged())
+				i->save_local(f);
+		}
+
+		save_directory(f);
+
+		off_t end_offset = ftello(f);
+		if (end_offset < 0)
+			throw error() << "Failed tell";
+
+		// remove the old data after the new central directory
+		if (fflush(f) != 0)
+			throw error() << "Failed write";
+		if (ftruncate(fileno(f), end_offset) != 0)
+			throw error() << "Failed truncate of " << path;
+	} catch (...) {
+		// restore the old data, to keep the original archive valid
+		if (backup_dirty)
+			save_append_restore(f, append_offset, backup, backup_size);
+		data_free(backup);
+		fclose(f);
+		throw;
+	}
+
+	data_free(backup);
+
+	// mark the space of the replaced entries, only now that the old central
+	// directory doesn't reference them anymore
+	try {
+		unsigned long long offset = 0;
+
+		for(unsigned k=0;k<kept.size();++k) {
+			if (kept[k].first > offset)
+				save_padding(f, offset, kept[k].first - offset);
+			offset = kept[k].second;
+		}
+	} catch (...) {
+		fclose(f);
+		throw;
+	}
+
+	if (fclose(f) != 0)
+		throw error() << "Failed close of " << path;
+}
+
+/**
+ * Compute the end of the space available to each local header.
+ * It's the start of the next local header, or the start of the central directory.
+ * \param bound Resulting end, in the same order of the entries.
+ */
+void zip::local_bound(vector<unsigned long long>& bound)
+{
+	// sort the entries by offset, they may be in random order
+	vector< pair<unsigned long long, unsigned> > order;
+	order.reserve(size());
+	for(iterator i=begin();i!=end();++i)
+		order.push_back(make_pair(i->offset_get(), static_cast<unsigned>(order.size())));
+	sort(order.begin(), order.end());
+
+	bound.resize(order.size());
+	for(unsigned k=0;k<order.size();++k) {
+		unsigned long long offset = order[k].first;
+
+		if (offset >= info.offset_to_start_of_cent_dir)
+			throw error_invalid() << "Overflow in central directory";
+
+		if (k + 1 < order.size()) {
+			if (order[k+1].first == offset)
+				throw error_invalid() << "Duplicate local header at offset " << offset;
+			bound[order[k].second] = order[k+1].first;
+		} else {
+			bound[order[k].second] = info.offset_to_start_of_cent_dir;
 		}
 	}
+
+	if (pedantic && !order.empty() && order[0].first != 0 && !is_padding(0, order[0].first))
+		throw error_invalid() << order[0].first << " unused bytes at offset 0";
+}
+
+/**
+ * Check if the space is filled by the padding written by save_padding().
+ * \param offset Start of the space.
+ * \param end End of the space.
+ */
+bool zip::is_padding(unsigned long long offset, unsigned long long end) const
+{
+	FILE* f = 0;
+
+	if (!mmap_ptr) {
+		f = fopen(path.c_str(), "rb");
+		if (!f)
+			return false;
+	}
+
+	bool valid = true;
+
+	while (valid && offset < end) {
+		unsigned char local[ZIP_LO_FIXED];
+		const unsigned char* buf;
+
+		if (end - offset < ZIP_LO_FIXED) {
+			valid = false;
+			break;
+		}
+
+		if (mmap_ptr) {
+			buf = mmap_ptr + offset;
+		} else {
+			if (fseeko(f, offset, SEEK_SET) != 0 || fread(local, ZIP_LO_FIXED, 1, f) != 1) {
+				valid = false;
+				break;
+			}
+			buf = local;
+		}
+
+		unsigned long long size = le_uint32_read(buf+ZIP_LO_compressed_size);
+
+		valid = le_uint32_read(buf+ZIP_LO_local_file_header_signature) == ZIP_L_signature
+			&& le_uint16_read(buf+ZIP_LO_general_purpose_bit_flag) == 0
+			&& le_uint16_read(buf+ZIP_LO_compression_method) == ZIP_METHOD_STORE
+			&& le_uint16_read(buf+ZIP_LO_filename_length) == 0
+			&& le_uint16_read(buf+ZIP_LO_extra_field_length) == 0
+			&& le_uint32_read(buf+ZIP_LO_uncompressed_size) == size
+			&& size <= end - offset - ZIP_LO_FIXED;
+
+		offset += ZIP_LO_FIXED + size;
+	}
+
+	if (f)
+		fclose(f);
+
+	return valid;
 }
 
 /**
@@ -1234,12 +2102,12 @@ zip::iterator zip::insert(const zip_entry& A, const string& Aname)
  * Add data to a zip file.
  * The data is deflated or stored. No filename overwrite check.
  */
-zip::iterator zip::insert_uncompressed(const string& Aname, const unsigned char* data, unsigned size, unsigned crc, time_t tod, bool is_text)
+zip::iterator zip::insert_uncompressed(const string& Aname, const unsigned char* data, unsigned long long size, unsigned crc, time_t tod, bool is_text)
 {
 	iterator i;
 
 	assert(flag.read);
-	assert(crc == crc32(0, (const unsigned char*)data, size));
+	assert(crc == zip_crc32(0, data, size));
 
 	unsigned date = 0;
 	unsigned time = 0;
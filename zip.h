@@ -28,6 +28,7 @@
 #endif
 
 #include <list>
+#include <vector>
 #include <sstream>
 
 // --------------------------------------------------------------------------
@@ -89,6 +90,8 @@
 #define ZIP_L_signature 0x04034b50
 #define ZIP_C_signature 0x02014b50
 #define ZIP_E_signature 0x06054b50
+#define ZIP_E64_signature 0x06064b50
+#define ZIP_E64L_signature 0x07064b50
 
 // Offsets in end of central directory structure
 #define ZIP_EO_end_of_central_dir_signature 0x00
@@ -102,6 +105,26 @@
 #define ZIP_EO_FIXED 0x16 // size of fixed data structure
 #define ZIP_EO_zipfile_comment 0x16
 
+// Offsets in zip64 end of central directory record
+#define ZIP_E64O_end_of_central_dir_signature 0x00
+#define ZIP_E64O_size_of_record 0x04 // size of the remaining record
+#define ZIP_E64O_version_made_by 0x0C
+#define ZIP_E64O_version_needed_to_extract 0x0E
+#define ZIP_E64O_number_of_this_disk 0x10
+#define ZIP_E64O_number_of_disk_start_cent_dir 0x14
+#define ZIP_E64O_total_entries_cent_dir_this_disk 0x18
+#define ZIP_E64O_total_entries_cent_dir 0x20
+#define ZIP_E64O_size_of_cent_dir 0x28
+#define ZIP_E64O_offset_to_start_of_cent_dir 0x30
+#define ZIP_E64O_FIXED 0x38 // size of fixed data structure
+
+// Offsets in zip64 end of central directory locator
+#define ZIP_E64LO_locator_signature 0x00
+#define ZIP_E64LO_number_of_disk_start_end_cent_dir 0x04
+#define ZIP_E64LO_offset_to_end_of_cent_dir 0x08
+#define ZIP_E64LO_total_number_of_disks 0x10
+#define ZIP_E64LO_FIXED 0x14 // size of fixed data structure
+
 // Offsets in central directory entry structure
 #define ZIP_CO_central_file_header_signature 0x00
 #define ZIP_CO_version_made_by 0x04
@@ -132,6 +155,13 @@
 #define ZIP_DO_uncompressed_size 0x0C
 #define ZIP_DO_FIXED 0x10 // size of fixed data structure
 
+// Offsets in zip64 data descriptor structure
+#define ZIP_DO64_header_signature 0x00 // this field may be missing
+#define ZIP_DO64_crc32 0x04
+#define ZIP_DO64_compressed_size 0x08
+#define ZIP_DO64_uncompressed_size 0x10
+#define ZIP_DO64_FIXED 0x18 // size of fixed data structure
+
 // Offsets in local file header structure
 #define ZIP_LO_local_file_header_signature 0x00
 #define ZIP_LO_version_needed_to_extract 0x04
@@ -148,10 +178,31 @@
 #define ZIP_LO_FIXED 0x1E // size of fixed data structure
 #define ZIP_LO_filename 0x1E
 
+// Extra field header
+#define ZIP_XO_header_id 0x00
+#define ZIP_XO_data_size 0x02
+#define ZIP_XO_FIXED 0x04 // size of fixed data structure
+
+// Zip64 extended information extra field
+// The sizes and the offset are present only if the corresponding
+// field in the header is set to ZIP_ZIP64_MARKER. In the local header
+// both the sizes are always present.
+#define ZIP_X_zip64 0x0001
+#define ZIP_X_zip64_size_max 0x1C // max size of the data
+
+// Values marking a field stored in the zip64 structures
+#define ZIP_ZIP64_MARKER 0xFFFFFFFFULL
+#define ZIP_ZIP64_MARKER16 0xFFFFU
+
+// Version needed to extract a zip64 entry
+#define ZIP_ZIP64_VERSION 45
+
 void time2zip(time_t tod, unsigned& date, unsigned& time);
 
 time_t zip2time(unsigned date, unsigned time);
 
+unsigned zip_crc32(unsigned crc, const unsigned char* data, unsigned long long size);
+
 class zip;
 
 class zip_entry {
@@ -174,15 +225,15 @@ private:
 		unsigned last_mod_file_time;
 		unsigned last_mod_file_date;
 		unsigned crc32;
-		unsigned compressed_size;
-		unsigned uncompressed_size;
+		unsigned long long compressed_size;
+		unsigned long long uncompressed_size;
 		unsigned filename_length;
 		unsigned central_extra_field_length;
 		unsigned local_extra_field_length;
 		unsigned file_comment_length;
 		unsigned internal_file_attrib;
 		unsigned external_file_attrib;
-		unsigned relative_offset_of_local_header;
+		unsigned long long relative_offset_of_local_header;
 	} info;
 
 	std::string parent_name; // parent
@@ -191,34 +242,51 @@ private:
 	unsigned char* local_extra_field;
 	unsigned char* central_extra_field;
 	unsigned char* data;
+	bool data_owned; // data is allocated, and not pointing into the memory mapped zip
+	off_t data_offset; // position of the unchanged compressed data in the parent zip, or -1 if unknown
+	off_t local_end; // end of the unchanged local header, data and data descriptor in the parent zip, or -1 if changed
 
 	void check_cent(const unsigned char* buf, unsigned buf_size) const;
 	void check_local(const unsigned char* buf) const;
 	void check_descriptor(const unsigned char* buf) const;
+	void check_descriptor64(const unsigned char* buf) const;
+	bool check_local_extra(const unsigned char* buf, const unsigned char* extra, unsigned extra_length) const;
+	void load_zip64();
+	bool is_zip64_size() const;
+	bool is_zip64() const;
+	unsigned version_needed_get() const;
+	bool local_unchanged() const;
+#ifdef USE_COMPRESS
+	bool verify_compressed(const unsigned char* c_data, unsigned c_size, unsigned c_met, const unsigned char* u_data) const;
+#endif
 
 	zip_entry();
 	zip_entry& operator=(const zip_entry&);
 	bool operator==(const zip_entry&) const;
 	bool operator!=(const zip_entry&) const;
 
+	friend class zip;
 public:
 	zip_entry(const zip& Aparent);
 	zip_entry(const zip_entry& A);
 	~zip_entry();
 
-	void load_local(const unsigned char* buf, FILE* f, unsigned size);
-	void save_local(FILE* f);
+	void load_local(const unsigned char* buf, FILE* f, unsigned long long size);
+	unsigned long long load_local(const unsigned char* buf, unsigned long long size, off_t offset);
+	void save_local(FILE* f, FILE* parent = 0);
 	void load_cent(const unsigned char* buf, unsigned size, unsigned& skip);
 	void save_cent(FILE* f);
 	void unload();
+	void data_discard(unsigned char* ptr);
 
 	method_t method_get() const;
-	void set(method_t method, const std::string& name, const unsigned char* compdata, unsigned compsize, unsigned size, unsigned crc, unsigned date, unsigned time, bool is_text);
+	void set(method_t method, const std::string& name, const unsigned char* compdata, unsigned long long compsize, unsigned long long size, unsigned crc, unsigned date, unsigned time, bool is_text);
 
-	unsigned compressed_size_get() const { return info.compressed_size; }
-	unsigned uncompressed_size_get() const { return info.uncompressed_size; }
+	unsigned long long compressed_size_get() const { return info.compressed_size; }
+	unsigned long long uncompressed_size_get() const { return info.uncompressed_size; }
 	unsigned crc_get() const { return info.crc32; }
 	bool is_text() const;
+	bool is_large() const { return info.compressed_size > UINT_MAX || info.uncompressed_size > UINT_MAX; } // too big for the 32 bit compressors
 
 	void compressed_seek(FILE* f) const;
 	void compressed_read(unsigned char* outdata) const;
@@ -227,7 +295,7 @@ public:
 	const std::string& parentname_get() const { return parent_name; }
 	void name_set(const std::string& Aname);
 	std::string name_get() const;
-	unsigned offset_get() const { return info.relative_offset_of_local_header; }
+	unsigned long long offset_get() const { return info.relative_offset_of_local_header; }
 
 	unsigned zipdate_get() const { return info.last_mod_file_date; }
 	unsigned ziptime_get() const { return info.last_mod_file_time; }
@@ -251,23 +319,35 @@ class zip {
 	} flag;
 
 	struct {
-		unsigned offset_to_start_of_cent_dir;
+		unsigned long long offset_to_start_of_cent_dir;
 		unsigned zipfile_comment_length;
 	} info;
 
 	unsigned char* zipfile_comment;
 	zip_entry_list map;
 	std::string path;
+	unsigned char* mmap_ptr; // memory mapped zip, or 0 if not mapped
+	unsigned long long mmap_size;
 
 	zip& operator=(const zip&);
 	bool operator==(const zip&) const;
 	bool operator!=(const zip&) const;
 
 	static bool pedantic;
+	static bool verify;
+
+	void save_directory(FILE* f);
+	void save_replace(const std::string& save_path);
+	void save_empty();
+	void local_bound(std::vector<unsigned long long>& bound);
+	bool is_padding(unsigned long long offset, unsigned long long end) const;
+	void mmap_open(unsigned long long length);
+	void mmap_close();
 
 	friend class zip_entry;
 public:
 	static void pedantic_set(bool Apedantic) { pedantic = Apedantic; }
+	static void verify_set(bool Averify) { verify = Averify; }
 
 	zip(const std::string& Apath);
 	zip(const zip& A);
@@ -292,6 +372,7 @@ public:
 	void close();
 	void reopen();
 	void save();
+	void save_append(unsigned compact);
 	void load();
 	void unload();
 
@@ -303,13 +384,16 @@ public:
 	void rename(iterator i, const std::string& Aname);
 
 	iterator insert(const zip_entry& A, const std::string& Aname);
-	iterator insert_uncompressed(const std::string& Aname, const unsigned char* data, unsigned size, unsigned crc, time_t tod, bool is_text);
+	iterator insert_uncompressed(const std::string& Aname, const unsigned char* data, unsigned long long size, unsigned crc, time_t tod, bool is_text);
 
 #ifdef USE_COMPRESS
 	void shrink(bool standard, shrink_t level);
+	void shrink_stream(bool standard, shrink_t level);
+	void dedup_scan();
+	static void dedup_clear();
 #endif
 
-	void test() const;
+	void test(unsigned jobs = 1) const;
 };
 
 #endif
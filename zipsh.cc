@@ -21,11 +21,17 @@
 #include "portable.h"
 
 #include "zip.h"
+#include "block.h"
+#include "cache.h"
 #include "data.h"
+#include "file.h"
+#include "siglock.h"
+#include "thread.h"
 
 #include <zlib.h>
 
 #include <iostream>
+#include <map>
 
 using namespace std;
 
@@ -33,8 +39,12 @@ void zip_entry::uncompressed_read(unsigned char* uncompressed_data) const
 {
 	assert(data);
 
+	if (is_large() && info.compression_method != ZIP_METHOD_STORE) {
+		throw error_unsupported() << "Unsupported compression method on large file " << name_get();
+	}
+
 	if (info.compression_method == ZIP_METHOD_DEFLATE) {
-		if (!decompress_deflate_zlib(data, compressed_size_get(), uncompressed_data, uncompressed_size_get())) {
+		if (!decompress_deflate(data, compressed_size_get(), uncompressed_data, uncompressed_size_get())) {
 			throw error_invalid() << "Invalid compressed data on file " << name_get();
 		}
 #if USE_BZIP2
@@ -54,16 +64,82 @@ void zip_entry::uncompressed_read(unsigned char* uncompressed_data) const
 	}
 }
 
+#define TEST_BLOCK_SIZE (1024*1024)
+
+/**
+ * Compute the crc of a deflate stream of any size, decompressing it in blocks.
+ */
+static bool test_deflate_large(const unsigned char* in_data, unsigned long long in_size, unsigned long long out_size, unsigned& crc)
+{
+	z_stream stream;
+	unsigned long long out_total;
+	int r;
+
+	memset(&stream, 0, sizeof(stream));
+
+	if (inflateInit2(&stream, -15) != Z_OK)
+		return false;
+
+	unsigned char* out_data = data_alloc(TEST_BLOCK_SIZE);
+
+	crc = 0;
+	out_total = 0;
+	do {
+		if (stream.avail_in == 0 && in_size > 0) {
+			unsigned run = in_size > 0x40000000 ? 0x40000000 : in_size;
+			stream.next_in = const_cast<unsigned char*>(in_data);
+			stream.avail_in = run;
+			in_data += run;
+			in_size -= run;
+		}
+
+		stream.next_out = out_data;
+		stream.avail_out = TEST_BLOCK_SIZE;
+
+		r = inflate(&stream, Z_NO_FLUSH);
+
+		unsigned run = TEST_BLOCK_SIZE - stream.avail_out;
+		crc = libdeflate_crc32(crc, out_data, run);
+		out_total += run;
+	} while (r == Z_OK);
+
+	inflateEnd(&stream);
+	data_free(out_data);
+
+	return r == Z_STREAM_END && out_total == out_size;
+}
+
 void zip_entry::test() const
 {
 	assert(data);
 
+	// large entries are checked without decompressing them all in memory
+	if (is_large()) {
+		unsigned crc;
+
+		if (info.compression_method == ZIP_METHOD_DEFLATE) {
+			if (!test_deflate_large(data, compressed_size_get(), uncompressed_size_get(), crc)) {
+				throw error_invalid() << "Invalid compressed data on file " << name_get();
+			}
+		} else if (info.compression_method == ZIP_METHOD_STORE) {
+			crc = zip_crc32(0, data, uncompressed_size_get());
+		} else {
+			throw error_unsupported() << "Unsupported compression method on large file " << name_get();
+		}
+
+		if (info.crc32 != crc) {
+			throw error_invalid() << "Invalid crc on file " << name_get();
+		}
+
+		return;
+	}
+
 	unsigned char* uncompressed_data = data_alloc(uncompressed_size_get());
 
 	try {
 		uncompressed_read(uncompressed_data);
 
-		if (info.crc32 != crc32(0, uncompressed_data, uncompressed_size_get())) {
+		if (info.crc32 != zip_crc32(0, uncompressed_data, uncompressed_size_get())) {
 			throw error_invalid() << "Invalid crc on file " << name_get();
 		}
 	} catch (...) {
@@ -74,6 +150,188 @@ void zip_entry::test() const
 	data_free(uncompressed_data);
 }
 
+/**
+ * Payloads present more than once in the archives.
+ * The first copy compressed shares its result with the others.
+ */
+struct dedup_result {
+	string key; /**< Key of the payload, to distinguish payloads with the same crc and size. */
+	unsigned char* data;
+	unsigned size;
+	unsigned info;
+};
+
+struct dedup_group {
+	unsigned left; /**< Entries not yet compressed. */
+	vector<dedup_result> result;
+};
+
+typedef map<pair<unsigned, unsigned long long>, dedup_group> dedup_map;
+
+static dedup_map dedup;
+static thread_mutex dedup_mutex;
+
+/**
+ * Count the payloads of the archive, to find the duplicates.
+ * Call it for all the archives before compressing them.
+ */
+void zip::dedup_scan()
+{
+	thread_auto_lock lock(dedup_mutex);
+
+	for(const_iterator i=begin();i!=end();++i) {
+		if (i->is_large() || i->uncompressed_size_get() == 0)
+			continue;
+
+		dedup_group& group = dedup[make_pair(i->crc_get(), i->uncompressed_size_get())];
+
+		++group.left;
+	}
+}
+
+/**
+ * Clear all the counted payloads.
+ */
+void zip::dedup_clear()
+{
+	thread_auto_lock lock(dedup_mutex);
+
+	for(dedup_map::iterator i=dedup.begin();i!=dedup.end();++i) {
+		for(unsigned j=0;j<i->second.result.size();++j)
+			data_free(i->second.result[j].data);
+	}
+
+	dedup.clear();
+}
+
+static bool dedup_is_shared(unsigned crc, unsigned long long size)
+{
+	thread_auto_lock lock(dedup_mutex);
+
+	dedup_map::iterator i = dedup.find(make_pair(crc, size));
+
+	return i != dedup.end() && (i->second.left > 1 || !i->second.result.empty());
+}
+
+/**
+ * Get a copy of the result of a duplicate already compressed.
+ */
+static bool dedup_get(unsigned crc, unsigned long long size, const cache_key& key, unsigned& info, unsigned char*& data, unsigned& data_size)
+{
+	thread_auto_lock lock(dedup_mutex);
+
+	dedup_map::iterator i = dedup.find(make_pair(crc, size));
+	if (i == dedup.end())
+		return false;
+
+	for(unsigned j=0;j<i->second.result.size();++j) {
+		const dedup_result& r = i->second.result[j];
+		if (r.key == key.name_get()) {
+			info = r.info;
+			data = data_dup(r.data, r.size);
+			data_size = r.size;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Set the result of a compressed entry, and release the results not needed anymore.
+ */
+static void dedup_put(unsigned crc, unsigned long long size, const cache_key& key, unsigned info, const unsigned char* data, unsigned data_size)
+{
+	thread_auto_lock lock(dedup_mutex);
+
+	dedup_map::iterator i = dedup.find(make_pair(crc, size));
+	if (i == dedup.end())
+		return;
+
+	dedup_group& group = i->second;
+
+	if (group.left)
+		--group.left;
+
+	// when all the duplicates are done the results are not needed anymore
+	if (!group.left) {
+		for(unsigned j=0;j<group.result.size();++j)
+			data_free(group.result[j].data);
+		dedup.erase(i);
+		return;
+	}
+
+	for(unsigned j=0;j<group.result.size();++j) {
+		dedup_result& r = group.result[j];
+		if (r.key == key.name_get()) {
+			// keep the best result
+			if (data_size < r.size) {
+				data_free(r.data);
+				r.data = data_dup(data, data_size);
+				r.size = data_size;
+				r.info = info;
+			}
+			return;
+		}
+	}
+
+	dedup_result r;
+	r.key = key.name_get();
+	r.data = data_dup(data, data_size);
+	r.size = data_size;
+	r.info = info;
+	group.result.push_back(r);
+}
+
+/**
+ * Verify that new compressed data decompresses to the original data.
+ * The verification is done only if enabled with zip::verify_set().
+ * \param c_data Compressed data.
+ * \param c_size Size of the compressed data.
+ * \param c_met Compression method.
+ * \param u_data Original data of size uncompressed_size_get().
+ * \return If the compressed data can be accepted.
+ */
+bool zip_entry::verify_compressed(const unsigned char* c_data, unsigned c_size, unsigned c_met, const unsigned char* u_data) const
+{
+	if (!zip::verify || !c_data)
+		return true;
+
+	unsigned u_size = uncompressed_size_get();
+
+	if (c_met == ZIP_METHOD_STORE)
+		return c_size == u_size && memcmp(c_data, u_data, u_size) == 0;
+
+	unsigned char* check_data = data_alloc(u_size);
+	bool ok;
+
+	if (c_met == ZIP_METHOD_DEFLATE) {
+		ok = decompress_deflate(c_data, c_size, check_data, u_size);
+#if USE_BZIP2
+	} else if (c_met == ZIP_METHOD_BZIP2) {
+		ok = decompress_bzip2(c_data, c_size, check_data, u_size);
+#endif
+	} else if (c_met == ZIP_METHOD_LZMA) {
+		ok = decompress_lzma_7z(c_data, c_size, check_data, u_size);
+	} else {
+		ok = false;
+	}
+
+	ok = ok && memcmp(check_data, u_data, u_size) == 0;
+
+	data_free(check_data);
+
+	return ok;
+}
+
+/**
+ * Check if the compressed data can be used in the zip.
+ */
+static bool acceptable(const unsigned char* data, unsigned met, bool standard)
+{
+	return data != 0 && (!standard || met <= ZIP_METHOD_DEFLATE);
+}
+
 static bool got(unsigned char* c0_data, unsigned c0_size, unsigned c0_met, unsigned char* c1_data, unsigned c1_size, unsigned c1_met, bool substitute_if_equal, bool standard, bool store)
 {
 	bool c0_acceptable = c0_data!=0;
@@ -104,6 +362,39 @@ static bool got(unsigned char* c0_data, unsigned c0_size, unsigned c0_met, unsig
 	return false;
 }
 
+/**
+ * Compressed data of an entry.
+ */
+struct shrink_candidate {
+	unsigned char* data;
+	unsigned size;
+	unsigned ver;
+	unsigned met;
+	unsigned fla;
+};
+
+/**
+ * Keep the better between the current data and a new candidate.
+ * The data not kept is freed, except the original data of the entry,
+ * that is needed if the final verification fails.
+ * \return If the candidate is kept.
+ */
+static bool take(shrink_candidate& c0, shrink_candidate& c1, const unsigned char* original, bool substitute_if_equal, bool standard, bool store)
+{
+	if (!got(c0.data, c0.size, c0.met, c1.data, c1.size, c1.met, substitute_if_equal, standard, store)) {
+		if (c1.data)
+			data_free(c1.data);
+		return false;
+	}
+
+	if (c0.data != original)
+		data_free(c0.data);
+
+	c0 = c1;
+
+	return true;
+}
+
 bool zip_entry::shrink(bool standard, shrink_t level)
 {
 	assert(data);
@@ -129,12 +420,20 @@ bool zip_entry::shrink(bool standard, shrink_t level)
 	file_comment = 0;
 	info.file_comment_length = 0;
 
+	// the compressors support only 32 bit sizes, keep the data as is
+	if (is_large())
+		return modify;
+
+	// from here, a modification means that the compressed data is changed
+	bool modify_extra = modify;
+	modify = false;
+
 	unsigned char* uncompressed_data = data_alloc(uncompressed_size_get());
 
 	try {
 		uncompressed_read(uncompressed_data);
 
-		if (info.crc32 != crc32(0, uncompressed_data, uncompressed_size_get())) {
+		if (info.crc32 != zip_crc32(0, uncompressed_data, uncompressed_size_get())) {
 			throw error_invalid() << "Invalid crc on file " << name_get();
 		}
 
@@ -143,26 +442,61 @@ bool zip_entry::shrink(bool standard, shrink_t level)
 		throw;
 	}
 
-	unsigned char* c0_data;
-	unsigned c0_size;
-	unsigned c0_ver;
-	unsigned c0_met;
-	unsigned c0_fla;
+	shrink_candidate c0;
 
 	// previous compressed data
-	c0_data = data;
-	c0_size = info.compressed_size;
-	c0_ver = info.version_needed_to_extract;
-	c0_met = info.compression_method;
-	c0_fla = info.general_purpose_bit_flag;
+	c0.data = data;
+	c0.size = info.compressed_size;
+	c0.ver = info.version_needed_to_extract;
+	c0.met = info.compression_method;
+	c0.fla = info.general_purpose_bit_flag;
+
+	shrink_candidate original = c0;
+
+	// payloads with duplicates in the archives are compressed only once
+	bool shared = level.level != shrink_none && dedup_is_shared(info.crc32, uncompressed_size_get());
+
+	cache_key key;
+	bool cached = false;
+	if (level.level != shrink_none && (shared || cache_enabled())) {
+		shrink_candidate c1;
+		unsigned c1_info = 0;
 
-	if (level.level != shrink_none) {
+		c1.data = 0;
+		c1.size = 0;
+
+		key.set(cache_zip, level, standard, uncompressed_data, uncompressed_size_get());
+
+		// search the result of a duplicate already compressed
+		if (shared)
+			dedup_get(info.crc32, uncompressed_size_get(), key, c1_info, c1.data, c1.size);
+
+		// search the result of a previous run in the cache
+		if (!c1.data && cache_enabled()) {
+			if (cache_get(key, c1_info, c1.data, c1.size) && !c1.data) {
+				// the compression was not able to go below this size
+				cached = acceptable(c0.data, c0.met, standard) && c0.size <= c1.size;
+			}
+
+			cache_stat(cached || c1.data != 0);
+		}
+
+		if (c1.data) {
+			cached = true;
+
+			c1.met = c1_info & 0xFF;
+			c1.ver = (c1_info >> 8) & 0xFF;
+			c1.fla = c1_info >> 16;
+
+			if (take(c0, c1, data, false, standard, false))
+				modify = true;
+		}
+	}
+
+	if (level.level != shrink_none && !cached) {
 		// test compressed data
-		unsigned char* c1_data;
-		unsigned c1_size;
-		unsigned c1_ver;
-		unsigned c1_met;
-		unsigned c1_fla;
+		shrink_candidate c1;
+		deflate_mixer mixer(uncompressed_size_get());
 
 		if (level.level != shrink_fast && !standard) {
 			unsigned lzma_algo;
@@ -190,28 +524,19 @@ bool zip_entry::shrink(bool standard, shrink_t level)
 			}
 
 			// compress with lzma
-			c1_data = data_alloc(uncompressed_size_get());
-			c1_size = uncompressed_size_get();
-			c1_ver = 20;
-			c1_met = ZIP_METHOD_LZMA;
-			c1_fla = 0;
-
-			if (!compress_lzma_7z(uncompressed_data, uncompressed_size_get(), c1_data, c1_size, lzma_algo, lzma_dictsize, lzma_fastbytes)) {
-				data_free(c1_data);
-				c1_data = 0;
+			c1.data = data_alloc(uncompressed_size_get());
+			c1.size = uncompressed_size_get();
+			c1.ver = 20;
+			c1.met = ZIP_METHOD_LZMA;
+			c1.fla = 0;
+
+			if (!compress_lzma_7z(uncompressed_data, uncompressed_size_get(), c1.data, c1.size, lzma_algo, lzma_dictsize, lzma_fastbytes)) {
+				data_free(c1.data);
+				c1.data = 0;
 			}
 
-			if (got(c0_data, c0_size, c0_met, c1_data, c1_size, c1_met, true, standard, level.level == shrink_none)) {
-				data_free(c0_data);
-				c0_data = c1_data;
-				c0_size = c1_size;
-				c0_ver = c1_ver;
-				c0_met = c1_met;
-				c0_fla = c1_fla;
+			if (take(c0, c1, data, true, standard, level.level == shrink_none))
 				modify = true;
-			} else {
-				data_free(c1_data);
-			}
 		}
 
 #if USE_BZIP2
@@ -237,28 +562,19 @@ bool zip_entry::shrink(bool standard, shrink_t level)
 			}
 
 			// compress with bzip2
-			c1_data = data_alloc(uncompressed_size_get());
-			c1_size = uncompressed_size_get();
-			c1_ver = 20;
-			c1_met = ZIP_METHOD_BZIP2;
-			c1_fla = 0;
-
-			if (!compress_bzip2(uncompressed_data, uncompressed_size_get(), c1_data, c1_size, bzip2_level, bzip2_workfactor)) {
-				data_free(c1_data);
-				c1_data = 0;
+			c1.data = data_alloc(uncompressed_size_get());
+			c1.size = uncompressed_size_get();
+			c1.ver = 20;
+			c1.met = ZIP_METHOD_BZIP2;
+			c1.fla = 0;
+
+			if (!compress_bzip2(uncompressed_data, uncompressed_size_get(), c1.data, c1.size, bzip2_level, bzip2_workfactor)) {
+				data_free(c1.data);
+				c1.data = 0;
 			}
 
-			if (got(c0_data, c0_size, c0_met, c1_data, c1_size, c1_met, true, standard, level.level == shrink_none)) {
-				data_free(c0_data);
-				c0_data = c1_data;
-				c0_size = c1_size;
-				c0_ver = c1_ver;
-				c0_met = c1_met;
-				c0_fla = c1_fla;
+			if (take(c0, c1, data, true, standard, level.level == shrink_none))
 				modify = true;
-			} else {
-				data_free(c1_data);
-			}
 		}
 #endif
 
@@ -266,33 +582,27 @@ bool zip_entry::shrink(bool standard, shrink_t level)
 		// otherwise assume that lzma is better
 		if (level.level == shrink_insane && (standard || uncompressed_size_get() <= RETRY_FOR_SMALL_FILES)) {
 			ZopfliOptions opt_zopfli;
+			ZopfliStats stats;
 			size_t size;
 		
-			ZopfliInitOptions(&opt_zopfli);
-			opt_zopfli.numiterations = level.iter > 5 ? level.iter : 5;
-
-			c1_data = 0;
-			c1_size = 0;
-			c1_ver = 20;
-			c1_met = ZIP_METHOD_DEFLATE;
-			c1_fla = ZIP_GEN_FLAGS_DEFLATE_MAXIMUM;
-
-			size = c1_size;
-			ZopfliCompress(&opt_zopfli, ZOPFLI_FORMAT_DEFLATE, uncompressed_data, uncompressed_size_get(), &c1_data, &size);
-			c1_size = size;
+			compress_zopfli_init(level, uncompressed_data, uncompressed_size_get(), opt_zopfli, stats);
+
+			c1.data = 0;
+			c1.size = 0;
+			c1.ver = 20;
+			c1.met = ZIP_METHOD_DEFLATE;
+			c1.fla = ZIP_GEN_FLAGS_DEFLATE_MAXIMUM;
+
+			size = c1.size;
+			ZopfliCompress(&opt_zopfli, ZOPFLI_FORMAT_DEFLATE, uncompressed_data, uncompressed_size_get(), &c1.data, &size);
+			c1.size = size;
+
+			compress_zopfli_done(opt_zopfli, stats);
+
+			mixer.add(c1.data, c1.size);
 			
-			if (got(c0_data, c0_size, c0_met, c1_data, c1_size, c1_met, false, standard, false)) {
-				data_free(c0_data);
-				c0_data = c1_data;
-				c0_size = c1_size;
-				c0_ver = c1_ver;
-				c0_met = c1_met;
-				c0_fla = c1_fla;
+			if (take(c0, c1, data, false, standard, false))
 				modify = true;
-			} else {
-				if (c1_data)
-					data_free(c1_data);
-			}
 		}
 
 		// try only for small files or if standard compression is required
@@ -311,27 +621,20 @@ bool zip_entry::shrink(bool standard, shrink_t level)
 			}
 
 			// compress with 7z
-			c1_data = data_alloc(uncompressed_size_get());
-			c1_size = uncompressed_size_get();
-			c1_ver = 20;
-			c1_met = ZIP_METHOD_DEFLATE;
-			c1_fla = ZIP_GEN_FLAGS_DEFLATE_MAXIMUM;
-			if (!compress_deflate_7z(uncompressed_data, uncompressed_size_get(), c1_data, c1_size, sz_passes, sz_fastbytes)) {
-				data_free(c1_data);
-				c1_data = 0;
+			c1.data = data_alloc(uncompressed_size_get());
+			c1.size = uncompressed_size_get();
+			c1.ver = 20;
+			c1.met = ZIP_METHOD_DEFLATE;
+			c1.fla = ZIP_GEN_FLAGS_DEFLATE_MAXIMUM;
+			if (!compress_deflate_7z(uncompressed_data, uncompressed_size_get(), c1.data, c1.size, sz_passes, sz_fastbytes)) {
+				data_free(c1.data);
+				c1.data = 0;
 			}
 
-			if (got(c0_data, c0_size, c0_met, c1_data, c1_size, c1_met, true, standard, level.level == shrink_none)) {
-				data_free(c0_data);
-				c0_data = c1_data;
-				c0_size = c1_size;
-				c0_ver = c1_ver;
-				c0_met = c1_met;
-				c0_fla = c1_fla;
+			mixer.add(c1.data, c1.size);
+
+			if (take(c0, c1, data, true, standard, level.level == shrink_none))
 				modify = true;
-			} else {
-				data_free(c1_data);
-			}
 		}
 
 		// try only for small files or if standard compression is required
@@ -356,87 +659,135 @@ bool zip_entry::shrink(bool standard, shrink_t level)
 			}
 
 			// compress with 7z
-			c1_data = data_alloc(uncompressed_size_get());
-			c1_size = uncompressed_size_get();
-			c1_ver = 20;
-			c1_met = ZIP_METHOD_DEFLATE;
-			c1_fla = ZIP_GEN_FLAGS_DEFLATE_MAXIMUM;
-
-			if (!compress_deflate_libdeflate(uncompressed_data, uncompressed_size_get(), c1_data, c1_size, compression_level)) {
-				data_free(c1_data);
-				c1_data = 0;
+			c1.data = data_alloc(uncompressed_size_get());
+			c1.size = uncompressed_size_get();
+			c1.ver = 20;
+			c1.met = ZIP_METHOD_DEFLATE;
+			c1.fla = ZIP_GEN_FLAGS_DEFLATE_MAXIMUM;
+
+			if (!compress_deflate_libdeflate(uncompressed_data, uncompressed_size_get(), c1.data, c1.size, compression_level)) {
+				data_free(c1.data);
+				c1.data = 0;
 			}
 
-			if (got(c0_data, c0_size, c0_met, c1_data, c1_size, c1_met, true, standard, level.level == shrink_none)) {
-				data_free(c0_data);
-				c0_data = c1_data;
-				c0_size = c1_size;
-				c0_ver = c1_ver;
-				c0_met = c1_met;
-				c0_fla = c1_fla;
+			if (level.level != shrink_normal)
+				mixer.add(c1.data, c1.size);
+
+			if (take(c0, c1, data, true, standard, level.level == shrink_none))
 				modify = true;
-			} else {
-				data_free(c1_data);
+		}
+
+		// join the best blocks of the deflate streams
+		if ((level.level == shrink_extra || level.level == shrink_insane) && mixer.enabled()) {
+			c1.data = data_alloc(uncompressed_size_get());
+			c1.size = uncompressed_size_get();
+			c1.ver = 20;
+			c1.met = ZIP_METHOD_DEFLATE;
+			c1.fla = ZIP_GEN_FLAGS_DEFLATE_MAXIMUM;
+
+			if (!mixer.run(c1.data, c1.size, uncompressed_data)) {
+				data_free(c1.data);
+				c1.data = 0;
 			}
+
+			if (take(c0, c1, data, false, standard, false))
+				modify = true;
 		}
 
 		if (level.level == shrink_fast) {
 			// compress with zlib Z_BEST_COMPRESSION/Z_DEFAULT_STRATEGY/MAX_MEM_LEVEL
-			c1_data = data_alloc(uncompressed_size_get());
-			c1_size = uncompressed_size_get();
-			c1_ver = 20;
-			c1_met = ZIP_METHOD_DEFLATE;
-			c1_fla = ZIP_GEN_FLAGS_DEFLATE_MAXIMUM;
-
-			if (!compress_deflate_zlib(uncompressed_data, uncompressed_size_get(), c1_data, c1_size, Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY, MAX_MEM_LEVEL)) {
-				data_free(c1_data);
-				c1_data = 0;
+			c1.data = data_alloc(uncompressed_size_get());
+			c1.size = uncompressed_size_get();
+			c1.ver = 20;
+			c1.met = ZIP_METHOD_DEFLATE;
+			c1.fla = ZIP_GEN_FLAGS_DEFLATE_MAXIMUM;
+
+			if (!compress_deflate_zlib(uncompressed_data, uncompressed_size_get(), c1.data, c1.size, Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY, MAX_MEM_LEVEL)) {
+				data_free(c1.data);
+				c1.data = 0;
 			}
 
-			if (got(c0_data, c0_size, c0_met, c1_data, c1_size, c1_met, true, standard, level.level == shrink_none)) {
-				data_free(c0_data);
-				c0_data = c1_data;
-				c0_size = c1_size;
-				c0_ver = c1_ver;
-				c0_met = c1_met;
-				c0_fla = c1_fla;
+			if (take(c0, c1, data, true, standard, level.level == shrink_none))
 				modify = true;
-			} else {
-				data_free(c1_data);
-			}
 		}
 	}
 
+	// verify only the best data found, and if it doesn't match keep the original
+	bool verified = !modify || verify_compressed(c0.data, c0.size, c0.met, uncompressed_data);
+	if (!verified) {
+		data_free(c0.data);
+		c0 = original;
+		modify = false;
+	}
+
+	// save the result for the next run
+	if (level.level != shrink_none && !cached && verified && key.is_set()) {
+		if (modify)
+			cache_put(key, c0.met | c0.ver << 8 | c0.fla << 16, c0.data, c0.size);
+		else if (acceptable(c0.data, c0.met, standard))
+			cache_put_nogain(key, c0.size);
+	}
+
 	// store
-	if (got(c0_data, c0_size, c0_met, uncompressed_data, uncompressed_size_get(), ZIP_METHOD_STORE, true, standard, level.level == shrink_none)) {
-		data_free(c0_data);
-		c0_data = uncompressed_data;
-		c0_size = uncompressed_size_get();
-		c0_ver = 10;
-		c0_met = ZIP_METHOD_STORE;
-		c0_fla = 0;
+	shrink_candidate c2;
+	c2.data = uncompressed_data;
+	c2.size = uncompressed_size_get();
+	c2.ver = 10;
+	c2.met = ZIP_METHOD_STORE;
+	c2.fla = 0;
+
+	if (take(c0, c2, data, true, standard, level.level == shrink_none))
 		modify = true;
-	} else {
-		data_free(uncompressed_data);
-	}
 
-	// set the best option found
-	data = c0_data;
-	info.compressed_size = c0_size;
-	info.version_needed_to_extract = c0_ver;
-	info.compression_method = c0_met;
+	// share the result with the next duplicates
+	if (shared)
+		dedup_put(info.crc32, uncompressed_size_get(), key, c0.met | c0.ver << 8 | c0.fla << 16, c0.data, c0.size);
+
+	// set the best option found, now allocated if different than the original
+	if (c0.data != data) {
+		data_discard(data);
+		data = c0.data;
+		data_owned = true;
+	}
+	info.compressed_size = c0.size;
+	info.version_needed_to_extract = c0.ver;
+	info.compression_method = c0.met;
 	// preserve original EFS flag
-	info.general_purpose_bit_flag = c0_fla | (info.general_purpose_bit_flag & ZIP_GEN_FLAGS_EFS);
+	info.general_purpose_bit_flag = c0.fla | (info.general_purpose_bit_flag & ZIP_GEN_FLAGS_EFS);
 
-	return modify;
+	// the data in the parent zip is now different
+	if (modify)
+		data_offset = -1;
+	if (modify || modify_extra)
+		local_end = -1;
+
+	return modify || modify_extra;
 }
 
-void zip::test() const
+static void test_run(void* arg, unsigned index)
+{
+	const zip::const_iterator* list = static_cast<const zip::const_iterator*>(arg);
+
+	list[index]->test();
+}
+
+void zip::test(unsigned jobs) const
 {
 	assert(flag.read);
 
+	if (jobs <= 1) {
+		for(const_iterator i = begin();i!=end();++i)
+			i->test();
+		return;
+	}
+
+	// the entries are read only, and they can be tested concurrently
+	vector<const_iterator> list;
 	for(const_iterator i = begin();i!=end();++i)
-		i->test();
+		list.push_back(i);
+
+	if (list.size())
+		thread_for(jobs, list.size(), test_run, &list[0]);
 }
 
 void zip::shrink(bool standard, shrink_t level)
@@ -455,3 +806,111 @@ void zip::shrink(bool standard, shrink_t level)
 			flag.modify = true;
 }
 
+
+/**
+ * Shrink and save a zip file, one entry at a time.
+ * The data of every entry is read, shrunk, written in the new file and
+ * then discarded, limiting the memory used to the biggest entry.
+ * The result is the same of load(), shrink() and save().
+ */
+void zip::shrink_stream(bool standard, shrink_t level)
+{
+	assert(flag.open && !flag.read);
+
+	// remove unneeded data
+	data_free(zipfile_comment);
+	zipfile_comment = 0;
+	info.zipfile_comment_length = 0;
+
+	vector<unsigned long long> bound;
+	local_bound(bound);
+
+	FILE* fi = fopen(path.c_str(), "rb");
+	if (!fi)
+		throw error() << "Failed open for reading";
+
+	// an archive without files is deleted, but still checked
+	string save_path;
+	FILE* fo = 0;
+	if (!empty()) {
+		save_path = file_temp(path);
+
+		fo = fopen(save_path.c_str(), "wb");
+		if (!fo) {
+			fclose(fi);
+			throw error() << "Failed open for writing of " << save_path;
+		}
+	}
+
+	// the shrink can be interrupted, but the partial file is removed
+	sig_auto_remove sar(save_path.c_str());
+
+	try {
+		unsigned k = 0;
+		for(iterator i=begin();i!=end();++i, ++k) {
+			unsigned char buf[ZIP_LO_FIXED];
+			unsigned long long offset = i->offset_get();
+
+			if (bound[k] < offset + ZIP_LO_FIXED)
+				throw error_invalid() << "Invalid local header size at offset " << offset;
+
+			unsigned long long pos;
+			if (mmap_ptr) {
+				pos = offset + i->load_local(mmap_ptr + offset, bound[k] - offset, offset);
+			} else {
+				if (fseeko(fi, offset, SEEK_SET) != 0)
+					throw error() << "Failed fseek";
+
+				if (fread(buf, ZIP_LO_FIXED, 1, fi) != 1)
+					throw error() << "Failed read";
+
+				i->load_local(buf, fi, bound[k] - offset - ZIP_LO_FIXED);
+
+				off_t tell = ftello(fi);
+				if (tell < 0)
+					throw error() << "Failed tell";
+				pos = tell;
+			}
+
+			if (pedantic && pos != bound[k])
+				throw error_invalid() << bound[k] - pos << " unused bytes at offset " << pos;
+
+			i->shrink(standard, level);
+
+			// the unchanged data is copied directly from the original file
+			if (fo)
+				i->save_local(fo, fi);
+
+			i->unload();
+		}
+	} catch (...) {
+		fclose(fi);
+		if (fo) {
+			fclose(fo);
+			remove(save_path.c_str());
+		}
+		throw;
+	}
+
+	fclose(fi);
+
+	// prevent external signal
+	sig_auto_lock sal;
+
+	if (fo) {
+		try {
+			save_directory(fo);
+		} catch (...) {
+			fclose(fo);
+			remove(save_path.c_str());
+			throw;
+		}
+
+		fclose(fo);
+		save_replace(save_path);
+	} else {
+		save_empty();
+	}
+
+	flag.modify = false;
+}
@@ -286,7 +286,7 @@ void ZopfliBlockSplit(const ZopfliOptions* options,
 
   ZopfliInitLZ77Store(in, &store);
   ZopfliInitBlockState(options, instart, inend, 0, &s);
-  ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, h);
+  ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, options->binarytree, h);
 
   *npoints = 0;
   *splitpoints = 0;
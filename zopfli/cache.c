@@ -25,30 +25,78 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
 
-void ZopfliInitCache(size_t blocksize, ZopfliLongestMatchCache* lmc) {
+/*
+Size of the chunks of the pool. A position never spans two chunks, and the
+chunks are never moved, so the pool grows without copying.
+*/
+#define CHUNK_SIZE 65536
+
+void ZopfliInitCache(size_t blocksize, size_t maxentries,
+                     ZopfliLongestMatchCache* lmc) {
   size_t i;
   lmc->length = (unsigned short*)malloc(sizeof(unsigned short) * blocksize);
   lmc->dist = (unsigned short*)malloc(sizeof(unsigned short) * blocksize);
-  /* Rather large amount of memory. */
-  lmc->sublen = (unsigned char*)malloc(ZOPFLI_CACHE_LENGTH * 3 * blocksize);
-  if(lmc->sublen == NULL) {
+  lmc->offset = (unsigned*)malloc(sizeof(unsigned) * blocksize);
+  lmc->count = (unsigned char*)malloc(blocksize);
+  if (!lmc->length || !lmc->dist || !lmc->offset || !lmc->count) {
     fprintf(stderr,
         "Error: Out of memory. Tried allocating %lu bytes of memory.\n",
-        (unsigned long)ZOPFLI_CACHE_LENGTH * 3 * blocksize);
+        (unsigned long)blocksize * 9);
     exit (EXIT_FAILURE);
   }
+  if (maxentries > 255) maxentries = 255;
+  lmc->maxentries = maxentries;
+  lmc->chunks = 0;
+  lmc->numchunks = 0;
+  lmc->chunkused = CHUNK_SIZE;
+  lmc->blocksize = blocksize;
 
   /* length > 0 and dist 0 is invalid combination, which indicates on purpose
   that this cache value is not filled in yet. */
   for (i = 0; i < blocksize; i++) lmc->length[i] = 1;
   for (i = 0; i < blocksize; i++) lmc->dist[i] = 0;
-  for (i = 0; i < ZOPFLI_CACHE_LENGTH * blocksize * 3; i++) lmc->sublen[i] = 0;
+  for (i = 0; i < blocksize; i++) lmc->count[i] = 0;
 }
 
 void ZopfliCleanCache(ZopfliLongestMatchCache* lmc) {
+  size_t i;
   free(lmc->length);
   free(lmc->dist);
-  free(lmc->sublen);
+  free(lmc->offset);
+  free(lmc->count);
+  for (i = 0; i < lmc->numchunks; i++) free(lmc->chunks[i]);
+  free(lmc->chunks);
+}
+
+/*
+Reserves space in the pool for the given number of sublen entries, and returns
+the offset of the reserved space.
+*/
+static unsigned ReservePool(size_t entries, ZopfliLongestMatchCache* lmc) {
+  size_t size = entries * 3;
+  if (lmc->chunkused + size > CHUNK_SIZE) {
+    lmc->chunks = (unsigned char**)realloc(lmc->chunks,
+        sizeof(*lmc->chunks) * (lmc->numchunks + 1));
+    if (!lmc->chunks) exit(-1); /* Allocation failed. */
+    lmc->chunks[lmc->numchunks] = (unsigned char*)malloc(CHUNK_SIZE);
+    if (!lmc->chunks[lmc->numchunks]) {
+      fprintf(stderr,
+          "Error: Out of memory. Tried allocating %lu bytes of memory.\n",
+          (unsigned long)CHUNK_SIZE);
+      exit (EXIT_FAILURE);
+    }
+    lmc->numchunks++;
+    lmc->chunkused = 0;
+  }
+  lmc->chunkused += size;
+  return (lmc->numchunks - 1) * CHUNK_SIZE + lmc->chunkused - size;
+}
+
+/* Returns the sublen entries of the position. */
+static unsigned char* PoolEntries(const ZopfliLongestMatchCache* lmc,
+                                  size_t pos) {
+  unsigned offset = lmc->offset[pos];
+  return &lmc->chunks[offset / CHUNK_SIZE][offset % CHUNK_SIZE];
 }
 
 void ZopfliSublenToCache(const unsigned short* sublen,
@@ -56,15 +104,24 @@ void ZopfliSublenToCache(const unsigned short* sublen,
                          ZopfliLongestMatchCache* lmc) {
   size_t i;
   size_t j = 0;
+  size_t entries = 0;
   unsigned bestlength = 0;
   unsigned char* cache;
 
-#if ZOPFLI_CACHE_LENGTH == 0
-  return;
-#endif
-
-  cache = &lmc->sublen[ZOPFLI_CACHE_LENGTH * pos * 3];
+  if (lmc->maxentries == 0) return;
   if (length < 3) return;
+
+  /* Count the entries first, to store them packed. */
+  for (i = 3; i <= length; i++) {
+    if (i == length || sublen[i] != sublen[i + 1]) {
+      entries++;
+      if (entries >= lmc->maxentries) break;
+    }
+  }
+
+  lmc->offset[pos] = ReservePool(entries, lmc);
+  lmc->count[pos] = entries;
+  cache = PoolEntries(lmc, pos);
   for (i = 3; i <= length; i++) {
     if (i == length || sublen[i] != sublen[i + 1]) {
       cache[j * 3] = i - 3;
@@ -72,12 +129,11 @@ void ZopfliSublenToCache(const unsigned short* sublen,
       cache[j * 3 + 2] = (sublen[i] >> 8) % 256;
       bestlength = i;
       j++;
-      if (j >= ZOPFLI_CACHE_LENGTH) break;
+      if (j >= entries) break;
     }
   }
-  if (j < ZOPFLI_CACHE_LENGTH) {
+  if (j < lmc->maxentries) {
     assert(bestlength == length);
-    cache[(ZOPFLI_CACHE_LENGTH - 1) * 3] = bestlength - 3;
   } else {
     assert(bestlength <= length);
   }
@@ -88,21 +144,16 @@ void ZopfliCacheToSublen(const ZopfliLongestMatchCache* lmc,
                          size_t pos, size_t length,
                          unsigned short* sublen) {
   size_t i, j;
-  unsigned maxlength = ZopfliMaxCachedSublen(lmc, pos, length);
   unsigned prevlength = 0;
-  unsigned char* cache;
-#if ZOPFLI_CACHE_LENGTH == 0
-  return;
-#endif
+  const unsigned char* cache;
   if (length < 3) return;
-  cache = &lmc->sublen[ZOPFLI_CACHE_LENGTH * pos * 3];
-  for (j = 0; j < ZOPFLI_CACHE_LENGTH; j++) {
+  cache = PoolEntries(lmc, pos);
+  for (j = 0; j < lmc->count[pos]; j++) {
     unsigned length = cache[j * 3] + 3;
     unsigned dist = cache[j * 3 + 1] + 256 * cache[j * 3 + 2];
     for (i = prevlength; i <= length; i++) {
       sublen[i] = dist;
     }
-    if (length == maxlength) break;
     prevlength = length + 1;
   }
 }
@@ -112,14 +163,16 @@ Returns the length up to which could be stored in the cache.
 */
 unsigned ZopfliMaxCachedSublen(const ZopfliLongestMatchCache* lmc,
                                size_t pos, size_t length) {
-  unsigned char* cache;
-#if ZOPFLI_CACHE_LENGTH == 0
-  return 0;
-#endif
-  cache = &lmc->sublen[ZOPFLI_CACHE_LENGTH * pos * 3];
+  size_t count = lmc->count[pos];
   (void)length;
-  if (cache[1] == 0 && cache[2] == 0) return 0;  /* No sublen cached. */
-  return cache[(ZOPFLI_CACHE_LENGTH - 1) * 3] + 3;
+  if (count == 0) return 0;  /* No sublen cached. */
+  return PoolEntries(lmc, pos)[(count - 1) * 3] + 3;
+}
+
+size_t ZopfliCacheMemory(const ZopfliLongestMatchCache* lmc) {
+  return lmc->blocksize * (sizeof(*lmc->length) + sizeof(*lmc->dist)
+      + sizeof(*lmc->offset) + sizeof(*lmc->count))
+      + lmc->numchunks * CHUNK_SIZE;
 }
 
 #endif  /* ZOPFLI_LONGEST_MATCH_CACHE */
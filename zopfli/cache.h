@@ -33,17 +33,26 @@ Cache used by ZopfliFindLongestMatch to remember previously found length/dist
 values.
 This is needed because the squeeze runs will ask these values multiple times for
 the same position.
-Uses large amounts of memory, since it has to remember the distance belonging
-to every possible shorter-than-the-best length (the so called "sublen" array).
+It also remembers the distance belonging to every possible shorter-than-the-best
+length (the so called "sublen" array). Only the lengths where the distance
+changes are stored, packed in chunks allocated as needed, up to maxentries for
+each position.
 */
 typedef struct ZopfliLongestMatchCache {
   unsigned short* length;
   unsigned short* dist;
-  unsigned char* sublen;
+  unsigned* offset;  /* Offset in the chunks of the sublen of each position. */
+  unsigned char* count;  /* Number of sublen entries of each position. */
+  unsigned char** chunks;  /* Sublen entries, three bytes each. */
+  size_t numchunks;
+  size_t chunkused;  /* Bytes used in the last chunk. */
+  size_t maxentries;
+  size_t blocksize;
 } ZopfliLongestMatchCache;
 
 /* Initializes the ZopfliLongestMatchCache. */
-void ZopfliInitCache(size_t blocksize, ZopfliLongestMatchCache* lmc);
+void ZopfliInitCache(size_t blocksize, size_t maxentries,
+                     ZopfliLongestMatchCache* lmc);
 
 /* Frees up the memory of the ZopfliLongestMatchCache. */
 void ZopfliCleanCache(ZopfliLongestMatchCache* lmc);
@@ -61,6 +70,9 @@ void ZopfliCacheToSublen(const ZopfliLongestMatchCache* lmc,
 unsigned ZopfliMaxCachedSublen(const ZopfliLongestMatchCache* lmc,
                                size_t pos, size_t length);
 
+/* Returns the memory used by the cache, in bytes. */
+size_t ZopfliCacheMemory(const ZopfliLongestMatchCache* lmc);
+
 #endif  /* ZOPFLI_LONGEST_MATCH_CACHE */
 
 #endif  /* ZOPFLI_CACHE_H_ */
@@ -24,6 +24,7 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <stdlib.h>
 
 #include "blocksplitter.h"
+#include "seed.h"
 #include "squeeze.h"
 #include "symbols.h"
 #include "tree.h"
@@ -744,10 +745,14 @@ static void AddLZ77Block(const ZopfliOptions* options, int btype, int final,
   }
 }
 
+/*
+Adds a block of the type giving the smallest size.
+reparse: whether the fixed tree block can use a new LZ77 parse optimized for it
+*/
 static void AddLZ77BlockAutoType(const ZopfliOptions* options, int final,
                                  const ZopfliLZ77Store* lz77,
                                  size_t lstart, size_t lend,
-                                 size_t expected_data_size,
+                                 size_t expected_data_size, int reparse,
                                  unsigned char* bp,
                                  unsigned char** out, size_t* outsize) {
   double uncompressedcost = ZopfliCalculateBlockSize(lz77, lstart, lend, 0);
@@ -757,7 +762,8 @@ static void AddLZ77BlockAutoType(const ZopfliOptions* options, int final,
   /* Whether to perform the expensive calculation of creating an optimal block
   with fixed huffman tree to check if smaller. Only do this for small blocks or
   blocks which already are pretty good with fixed huffman tree. */
-  int expensivefixed = (lz77->size < 1000) || fixedcost <= dyncost * 1.1;
+  int expensivefixed = reparse &&
+      ((lz77->size < 1000) || fixedcost <= dyncost * 1.1);
 
   ZopfliLZ77Store fixedstore;
   if (lstart == lend) {
@@ -819,6 +825,8 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
   size_t* splitpoints = 0;
   double totalcost = 0;
   ZopfliLZ77Store lz77;
+  ZopfliLZ77Store seed;
+  int seeded = 0;
 
   /* If btype=2 is specified, it tries all block types. If a lesser btype is
   given, then however it forces that one. Neither of the lesser types needs
@@ -849,6 +857,15 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
     splitpoints = (size_t*)malloc(sizeof(*splitpoints) * npoints);
   }
 
+  ZopfliInitLZ77Store(in, &seed);
+  if (options->seed) {
+    seeded = ZopfliReadSeed(options->seed, options->seedsize, instart, inend,
+                            &seed);
+    if (options->verbose && !seeded) {
+      fprintf(stderr, "seed invalid\n");
+    }
+  }
+
   ZopfliInitLZ77Store(in, &lz77);
 
   for (i = 0; i <= npoints; i++) {
@@ -858,8 +875,16 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
     ZopfliLZ77Store store;
     ZopfliInitLZ77Store(in, &store);
     ZopfliInitBlockState(options, start, end, 1, &s);
+    if (seeded) s.seed = &seed;
     ZopfliLZ77Optimal(&s, in, start, end, options->numiterations, &store);
     totalcost += ZopfliCalculateBlockSizeAutoType(&store, 0, store.size);
+#ifdef ZOPFLI_LONGEST_MATCH_CACHE
+    if (options->verbose) {
+      fprintf(stderr, "cache memory: %lu (%dk) (unc: %d)\n",
+             (unsigned long)ZopfliCacheMemory(s.lmc),
+             (int)(ZopfliCacheMemory(s.lmc) / 1024), (int)(end - start));
+    }
+#endif
 
     ZopfliAppendLZ77Store(&store, &lz77);
     if (i < npoints) splitpoints[i] = lz77.size;
@@ -896,11 +921,12 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
     size_t start = i == 0 ? 0 : splitpoints[i - 1];
     size_t end = i == npoints ? lz77.size : splitpoints[i];
     AddLZ77BlockAutoType(options, i == npoints && final,
-                         &lz77, start, end, 0,
+                         &lz77, start, end, 0, 1,
                          bp, out, outsize);
   }
 
   ZopfliCleanLZ77Store(&lz77);
+  ZopfliCleanLZ77Store(&seed);
   free(splitpoints);
   free(splitpoints_uncompressed);
 }
@@ -929,3 +955,51 @@ void ZopfliDeflate(const ZopfliOptions* options, int btype, int final,
             100.0 * (double)(insize - (*outsize - offset)) / (double)insize);
   }
 }
+
+int ZopfliDeflateReentropy(const ZopfliOptions* options, int final,
+                           const unsigned char* stream, size_t streamsize,
+                           const unsigned char* in, size_t insize,
+                           unsigned char* bp, unsigned char** out,
+                           size_t* outsize) {
+  size_t offset = *outsize;
+  size_t* splitpoints = 0;
+  size_t npoints = 0;
+  int maxblocks = options->blocksplittingmax;
+  size_t i;
+  ZopfliLZ77Store lz77;
+
+  ZopfliInitLZ77Store(in, &lz77);
+  if (!ZopfliReadSeed(stream, streamsize, 0, insize, &lz77)
+      || ZopfliLZ77GetByteRange(&lz77, 0, lz77.size) != insize) {
+    ZopfliCleanLZ77Store(&lz77);
+    return 0;
+  }
+
+  /* All the data is split at once, allowing as many blocks as the master
+  blocks of ZopfliDeflate() would have. */
+  if (options->blocksplitting) {
+    if (maxblocks > 0) {
+      maxblocks *= (int)(insize / ZOPFLI_MASTER_BLOCK_SIZE + 1);
+    }
+    ZopfliBlockSplitLZ77(options, &lz77, maxblocks, &splitpoints, &npoints);
+  }
+
+  for (i = 0; i <= npoints; i++) {
+    size_t start = i == 0 ? 0 : splitpoints[i - 1];
+    size_t end = i == npoints ? lz77.size : splitpoints[i];
+    AddLZ77BlockAutoType(options, i == npoints && final,
+                         &lz77, start, end, 0, 0,
+                         bp, out, outsize);
+  }
+
+  if (options->verbose) {
+    fprintf(stderr,
+            "Original Size: %lu, Reentropy: %lu, Blocks: %lu\n",
+            (unsigned long)insize, (unsigned long)(*outsize - offset),
+            (unsigned long)(npoints + 1));
+  }
+
+  ZopfliCleanLZ77Store(&lz77);
+  free(splitpoints);
+  return 1;
+}
@@ -69,6 +69,20 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
                        unsigned char* bp, unsigned char** out,
                        size_t* outsize);
 
+/*
+Like ZopfliDeflate, but keeps the LZ77 data of an existing deflate stream of
+the same input, computing again only the block splitting and the Huffman
+codes. It's much faster, as no LZ77 search is done.
+stream: the existing deflate stream of in
+streamsize: size of the deflate stream
+Returns 1 if successful, or 0 if the stream is invalid or of different data.
+*/
+int ZopfliDeflateReentropy(const ZopfliOptions* options, int final,
+                           const unsigned char* stream, size_t streamsize,
+                           const unsigned char* in, size_t insize,
+                           unsigned char* bp, unsigned char** out,
+                           size_t* outsize);
+
 /*
 Calculates block size in bits.
 litlens: lz77 lit/lengths
@@ -26,7 +26,9 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #define HASH_SHIFT 5
 #define HASH_MASK 32767
 
-void ZopfliAllocHash(size_t window_size, ZopfliHash* h) {
+#define TREE_NIL ((size_t)-1)
+
+void ZopfliAllocHash(size_t window_size, int tree, ZopfliHash* h) {
   h->head = (int*)malloc(sizeof(*h->head) * 65536);
   h->prev = (unsigned short*)malloc(sizeof(*h->prev) * window_size);
   h->hashval = (int*)malloc(sizeof(*h->hashval) * window_size);
@@ -40,6 +42,13 @@ void ZopfliAllocHash(size_t window_size, ZopfliHash* h) {
   h->prev2 = (unsigned short*)malloc(sizeof(*h->prev2) * window_size);
   h->hashval2 = (int*)malloc(sizeof(*h->hashval2) * window_size);
 #endif
+
+  h->tree_head = 0;
+  h->tree_son = 0;
+  if (tree) {
+    h->tree_head = (size_t*)malloc(sizeof(*h->tree_head) * 65536);
+    h->tree_son = (size_t*)malloc(sizeof(*h->tree_son) * 2 * window_size);
+  }
 }
 
 void ZopfliResetHash(size_t window_size, ZopfliHash* h) {
@@ -70,6 +79,14 @@ void ZopfliResetHash(size_t window_size, ZopfliHash* h) {
     h->hashval2[i] = -1;
   }
 #endif
+
+  if (h->tree_head) {
+    for (i = 0; i < 65536; i++) {
+      h->tree_head[i] = TREE_NIL;
+    }
+  }
+  h->tree_pos = TREE_NIL;
+  h->tree_length = 0;
 }
 
 void ZopfliCleanHash(ZopfliHash* h) {
@@ -86,6 +103,9 @@ void ZopfliCleanHash(ZopfliHash* h) {
 #ifdef ZOPFLI_HASH_SAME
   free(h->same);
 #endif
+
+  free(h->tree_head);
+  free(h->tree_son);
 }
 
 /*
@@ -97,6 +117,92 @@ static void UpdateHashValue(ZopfliHash* h, unsigned char c) {
   h->val = (((h->val) << HASH_SHIFT) ^ (c)) & HASH_MASK;
 }
 
+/*
+Inserts the position as root of the binary tree of its hash value, finding in
+the same walk the smallest distance for each match length.
+The most recent position sharing a prefix of any length with the current one is
+always on the walk, because it's the root of the subtree containing all the
+positions with that prefix. So the results are the same of an unlimited walk of
+the hash chain.
+*/
+static void UpdateHashTree(const unsigned char* array, size_t pos, size_t end,
+                           ZopfliHash* h) {
+  size_t* ptr0;  /* Where to link the next smaller position. */
+  size_t* ptr1;  /* Where to link the next greater position. */
+  size_t len0 = 0;  /* Common prefix with the smaller positions. */
+  size_t len1 = 0;  /* Common prefix with the greater positions. */
+  size_t bestlength = ZOPFLI_MIN_MATCH - 1;
+  size_t limit = end - pos < ZOPFLI_MAX_MATCH ? end - pos : ZOPFLI_MAX_MATCH;
+  size_t cur;
+
+  h->tree_pos = pos;
+  h->tree_length = 0;
+
+  if (pos + ZOPFLI_MIN_MATCH > end) return;
+
+  cur = h->tree_head[h->val];
+  h->tree_head[h->val] = pos;
+  ptr0 = &h->tree_son[2 * (pos & ZOPFLI_WINDOW_MASK)];
+  ptr1 = &h->tree_son[2 * (pos & ZOPFLI_WINDOW_MASK) + 1];
+
+  for (;;) {
+    size_t* pair;
+    size_t len;
+
+    /* The older positions are out of the window, and so all their subtree. */
+    if (cur == TREE_NIL || pos - cur >= ZOPFLI_WINDOW_SIZE) {
+      *ptr0 = TREE_NIL;
+      *ptr1 = TREE_NIL;
+      break;
+    }
+
+    pair = &h->tree_son[2 * (cur & ZOPFLI_WINDOW_MASK)];
+    len = len0 < len1 ? len0 : len1;
+
+#ifdef ZOPFLI_HASH_SAME
+    /* Skip the repetitions of the same byte present in both. */
+    if (len < limit && array[cur] == array[pos]) {
+      size_t same0 = h->same[pos & ZOPFLI_WINDOW_MASK];
+      size_t same1 = h->same[cur & ZOPFLI_WINDOW_MASK];
+      size_t same = same0 < same1 ? same0 : same1;
+      if (same > limit) same = limit;
+      if (same > len) len = same;
+    }
+#endif
+
+    while (len < limit && array[cur + len] == array[pos + len]) len++;
+
+    if (len > bestlength) {
+      size_t j;
+      for (j = bestlength + 1; j <= len; j++) {
+        h->tree_sublen[j] = pos - cur;
+      }
+      bestlength = len;
+    }
+
+    /* The current position replaces an equal one, taking its subtrees. */
+    if (len >= limit) {
+      *ptr0 = pair[0];
+      *ptr1 = pair[1];
+      break;
+    }
+
+    if (array[cur + len] < array[pos + len]) {
+      *ptr0 = cur;
+      ptr0 = &pair[1];
+      cur = *ptr0;
+      len0 = len;
+    } else {
+      *ptr1 = cur;
+      ptr1 = &pair[0];
+      cur = *ptr1;
+      len1 = len;
+    }
+  }
+
+  if (bestlength >= ZOPFLI_MIN_MATCH) h->tree_length = bestlength;
+}
+
 void ZopfliUpdateHash(const unsigned char* array, size_t pos, size_t end,
                 ZopfliHash* h) {
   unsigned short hpos = pos & ZOPFLI_WINDOW_MASK;
@@ -134,6 +240,8 @@ void ZopfliUpdateHash(const unsigned char* array, size_t pos, size_t end,
   else h->prev2[hpos] = hpos;
   h->head2[h->val2] = hpos;
 #endif
+
+  if (h->tree_head) UpdateHashTree(array, pos, end, h);
 }
 
 void ZopfliWarmupHash(const unsigned char* array, size_t pos, size_t end,
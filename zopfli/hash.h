@@ -44,10 +44,24 @@ typedef struct ZopfliHash {
 #ifdef ZOPFLI_HASH_SAME
   unsigned short* same;  /* Amount of repetitions of same byte after this .*/
 #endif
+
+  /*
+  Binary trees of the positions with the same hash value, used instead of the
+  hash chains if allocated. Each tree is sorted by the string at its positions,
+  and each subtree has its most recent position as root.
+  */
+  size_t* tree_head;  /* Hash value to root of its tree. */
+  size_t* tree_son;  /* Index to the smaller and greater subtree. */
+  size_t tree_pos;  /* Position of the matches found by the last update. */
+  unsigned short tree_length;  /* Longest match found, or 0 if none. */
+  unsigned short tree_sublen[259];  /* Smallest distance for each length. */
 } ZopfliHash;
 
-/* Allocates ZopfliHash memory. */
-void ZopfliAllocHash(size_t window_size, ZopfliHash* h);
+/*
+Allocates ZopfliHash memory.
+tree: if true, finds the matches with binary trees instead of hash chains.
+*/
+void ZopfliAllocHash(size_t window_size, int tree, ZopfliHash* h);
 
 /* Resets all fields of ZopfliHash. */
 void ZopfliResetHash(size_t window_size, ZopfliHash* h);
@@ -58,6 +72,7 @@ void ZopfliCleanHash(ZopfliHash* h);
 /*
 Updates the hash values based on the current position in the array. All calls
 to this must be made for consecutive bytes.
+With the binary trees, it also finds the matches at this position.
 */
 void ZopfliUpdateHash(const unsigned char* array, size_t pos, size_t end,
                       ZopfliHash* h);
@@ -223,10 +223,11 @@ void ZopfliInitBlockState(const ZopfliOptions* options,
   s->options = options;
   s->blockstart = blockstart;
   s->blockend = blockend;
+  s->seed = 0;
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
   if (add_lmc) {
     s->lmc = (ZopfliLongestMatchCache*)malloc(sizeof(ZopfliLongestMatchCache));
-    ZopfliInitCache(blockend - blockstart, s->lmc);
+    ZopfliInitCache(blockend - blockstart, options->cachelength, s->lmc);
   } else {
     s->lmc = 0;
   }
@@ -236,6 +237,10 @@ void ZopfliInitBlockState(const ZopfliOptions* options,
 void ZopfliCleanBlockState(ZopfliBlockState* s) {
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
   if (s->lmc) {
+    ZopfliStats* stats = s->options->stats;
+    if (stats && ZopfliCacheMemory(s->lmc) > stats->cachememory) {
+      stats->cachememory = ZopfliCacheMemory(s->lmc);
+    }
     ZopfliCleanCache(s->lmc);
     free(s->lmc);
   }
@@ -355,8 +360,12 @@ static int TryGetFromLongestMatchCache(ZopfliBlockState* s,
           lmcpos, s->lmc->length[lmcpos]) >= *limit));
 
   if (s->lmc && limit_ok_for_cache && cache_available) {
-    if (!sublen || s->lmc->length[lmcpos]
-        <= ZopfliMaxCachedSublen(s->lmc, lmcpos, s->lmc->length[lmcpos])) {
+    unsigned maxcached = ZopfliMaxCachedSublen(s->lmc, lmcpos,
+                                               s->lmc->length[lmcpos]);
+    /* With the binary tree a partial cache still gives the shorter lengths
+       requested. */
+    if (!sublen || s->lmc->length[lmcpos] <= maxcached
+        || (s->options->binarytree && *limit <= maxcached)) {
       *length = s->lmc->length[lmcpos];
       if (*length > *limit) *length = *limit;
       if (sublen) {
@@ -405,7 +414,11 @@ static void StoreInLongestMatchCache(ZopfliBlockState* s,
 }
 #endif
 
-void ZopfliFindLongestMatch(ZopfliBlockState* s, const ZopfliHash* h,
+/*
+Finds the longest match walking the hash chain, with the same parameters of
+ZopfliFindLongestMatch. The limit is already reduced to the available data.
+*/
+static void FindLongestMatchChain(const ZopfliHash* h,
     const unsigned char* array,
     size_t pos, size_t size, size_t limit,
     unsigned short* sublen, unsigned short* distance, unsigned short* length) {
@@ -427,28 +440,6 @@ void ZopfliFindLongestMatch(ZopfliBlockState* s, const ZopfliHash* h,
   int* hhashval = h->hashval;
   int hval = h->val;
 
-#ifdef ZOPFLI_LONGEST_MATCH_CACHE
-  if (TryGetFromLongestMatchCache(s, pos, &limit, sublen, distance, length)) {
-    assert(pos + *length <= size);
-    return;
-  }
-#endif
-
-  assert(limit <= ZOPFLI_MAX_MATCH);
-  assert(limit >= ZOPFLI_MIN_MATCH);
-  assert(pos < size);
-
-  if (size - pos < ZOPFLI_MIN_MATCH) {
-    /* The rest of the code assumes there are at least ZOPFLI_MIN_MATCH bytes to
-       try. */
-    *length = 0;
-    *distance = 0;
-    return;
-  }
-
-  if (pos + limit > size) {
-    limit = size - pos;
-  }
   arrayend = &array[pos] + limit;
   arrayend_safe = arrayend - 8;
 
@@ -531,6 +522,72 @@ void ZopfliFindLongestMatch(ZopfliBlockState* s, const ZopfliHash* h,
 #endif
   }
 
+  *distance = bestdist;
+  *length = bestlength;
+}
+
+/*
+Gets the longest match already found by the binary tree update at this
+position, with the same parameters of ZopfliFindLongestMatch.
+*/
+static void FindLongestMatchTree(const ZopfliHash* h, size_t pos, size_t limit,
+    unsigned short* sublen, unsigned short* distance, unsigned short* length) {
+  unsigned short j;
+
+  assert(h->tree_pos == pos);
+  (void)pos;
+
+  *distance = 0;
+  *length = 1;
+
+  if (h->tree_length < ZOPFLI_MIN_MATCH) return;
+
+  *length = h->tree_length < limit ? h->tree_length : limit;
+  *distance = h->tree_sublen[*length];
+  if (sublen) {
+    for (j = ZOPFLI_MIN_MATCH; j <= *length; j++) {
+      sublen[j] = h->tree_sublen[j];
+    }
+  }
+}
+
+void ZopfliFindLongestMatch(ZopfliBlockState* s, const ZopfliHash* h,
+    const unsigned char* array,
+    size_t pos, size_t size, size_t limit,
+    unsigned short* sublen, unsigned short* distance, unsigned short* length) {
+  unsigned short bestdist;
+  unsigned short bestlength;
+
+#ifdef ZOPFLI_LONGEST_MATCH_CACHE
+  if (TryGetFromLongestMatchCache(s, pos, &limit, sublen, distance, length)) {
+    assert(pos + *length <= size);
+    return;
+  }
+#endif
+
+  assert(limit <= ZOPFLI_MAX_MATCH);
+  assert(limit >= ZOPFLI_MIN_MATCH);
+  assert(pos < size);
+
+  if (size - pos < ZOPFLI_MIN_MATCH) {
+    /* The rest of the code assumes there are at least ZOPFLI_MIN_MATCH bytes to
+       try. */
+    *length = 0;
+    *distance = 0;
+    return;
+  }
+
+  if (pos + limit > size) {
+    limit = size - pos;
+  }
+
+  if (h->tree_head) {
+    FindLongestMatchTree(h, pos, limit, sublen, &bestdist, &bestlength);
+  } else {
+    FindLongestMatchChain(h, array, pos, size, limit, sublen, &bestdist,
+                          &bestlength);
+  }
+
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
   StoreInLongestMatchCache(s, pos, limit, sublen, bestdist, bestlength);
 #endif
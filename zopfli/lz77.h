@@ -94,6 +94,9 @@ typedef struct ZopfliBlockState {
   /* The start (inclusive) and end (not inclusive) of the current block. */
   size_t blockstart;
   size_t blockend;
+
+  /* LZ77 data used instead of the greedy run, or null. */
+  const ZopfliLZ77Store* seed;
 } ZopfliBlockState;
 
 void ZopfliInitBlockState(const ZopfliOptions* options,
@@ -0,0 +1,281 @@
+/*
+Copyright 2024 Andrea Mazzoleni. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "parse.h"
+
+/* Bit reader of the deflate stream. */
+typedef struct ParseReader {
+  const unsigned char* data;
+  size_t size;
+  size_t bitpos;
+} ParseReader;
+
+/* Canonical Huffman code, decoded one bit at time. */
+typedef struct ParseHuffman {
+  unsigned short count[16];  /* Number of codes of each bit length. */
+  unsigned short symbol[288];  /* Symbols ordered by code. */
+} ParseHuffman;
+
+static const unsigned short kLengthBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const unsigned char kLengthExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const unsigned short kDistBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385,
+  24577
+};
+
+static const unsigned char kDistExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* Reads n bits. Returns -1 at the end of the stream. */
+static int ReadBits(ParseReader* r, int n) {
+  int value = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    if ((r->bitpos >> 3) >= r->size) return -1;
+    value |= ((r->data[r->bitpos >> 3] >> (r->bitpos & 7)) & 1) << i;
+    r->bitpos++;
+  }
+  return value;
+}
+
+/*
+Builds the code from the bit lengths of the symbols. Returns 0 if the lengths
+are over-subscribed.
+*/
+static int BuildHuffman(const unsigned char* lengths, int n, ParseHuffman* h) {
+  unsigned short offset[16];
+  int left = 1;
+  int i;
+  for (i = 0; i < 16; i++) h->count[i] = 0;
+  for (i = 0; i < n; i++) h->count[lengths[i]]++;
+  for (i = 1; i < 16; i++) {
+    left <<= 1;
+    left -= h->count[i];
+    if (left < 0) return 0;
+  }
+  offset[1] = 0;
+  for (i = 1; i < 15; i++) offset[i + 1] = offset[i] + h->count[i];
+  for (i = 0; i < n; i++) {
+    if (lengths[i]) h->symbol[offset[lengths[i]]++] = i;
+  }
+  return 1;
+}
+
+/* Decodes a symbol. Returns -1 if the code is invalid. */
+static int DecodeSymbol(ParseReader* r, const ParseHuffman* h) {
+  int code = 0;
+  int first = 0;
+  int index = 0;
+  int len;
+  for (len = 1; len < 16; len++) {
+    int bit = ReadBits(r, 1);
+    if (bit < 0) return -1;
+    code |= bit;
+    if (code - h->count[len] < first) {
+      return h->symbol[index + (code - first)];
+    }
+    index += h->count[len];
+    first += h->count[len];
+    first <<= 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+static void GetFixedHuffman(ParseHuffman* ll, ParseHuffman* d) {
+  unsigned char lengths[288];
+  int i;
+  for (i = 0; i < 144; i++) lengths[i] = 8;
+  for (i = 144; i < 256; i++) lengths[i] = 9;
+  for (i = 256; i < 280; i++) lengths[i] = 7;
+  for (i = 280; i < 288; i++) lengths[i] = 8;
+  BuildHuffman(lengths, 288, ll);
+  for (i = 0; i < 30; i++) lengths[i] = 5;
+  BuildHuffman(lengths, 30, d);
+}
+
+/* Reads the codes of a dynamic block. Returns 0 if invalid. */
+static int GetDynamicHuffman(ParseReader* r, ParseHuffman* ll, ParseHuffman* d) {
+  static const unsigned char order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+  };
+  unsigned char lengths[286 + 30];
+  ParseHuffman clcode;
+  int hlit = ReadBits(r, 5);
+  int hdist = ReadBits(r, 5);
+  int hclen = ReadBits(r, 4);
+  int n;
+  int i;
+
+  if (hlit < 0 || hdist < 0 || hclen < 0) return 0;
+  hlit += 257;
+  hdist += 1;
+  hclen += 4;
+  if (hlit > 286 || hdist > 30) return 0;
+
+  for (i = 0; i < 19; i++) lengths[order[i]] = 0;
+  for (i = 0; i < hclen; i++) {
+    int value = ReadBits(r, 3);
+    if (value < 0) return 0;
+    lengths[order[i]] = value;
+  }
+  if (!BuildHuffman(lengths, 19, &clcode)) return 0;
+
+  n = 0;
+  while (n < hlit + hdist) {
+    int symbol = DecodeSymbol(r, &clcode);
+    int value = 0;
+    int repeat;
+    if (symbol < 0) return 0;
+    if (symbol < 16) {
+      lengths[n++] = symbol;
+      continue;
+    }
+    if (symbol == 16) {
+      if (n == 0) return 0;
+      value = lengths[n - 1];
+      repeat = ReadBits(r, 2);
+      if (repeat < 0) return 0;
+      repeat += 3;
+    } else if (symbol == 17) {
+      repeat = ReadBits(r, 3);
+      if (repeat < 0) return 0;
+      repeat += 3;
+    } else {
+      repeat = ReadBits(r, 7);
+      if (repeat < 0) return 0;
+      repeat += 11;
+    }
+    if (n + repeat > hlit + hdist) return 0;
+    while (repeat--) lengths[n++] = value;
+  }
+
+  if (!BuildHuffman(lengths, hlit, ll)) return 0;
+  if (!BuildHuffman(lengths + hlit, hdist, d)) return 0;
+  return 1;
+}
+
+int ZopfliParseDeflate(const unsigned char* data, size_t size,
+                       const ZopfliParseCallback* callback) {
+  ParseReader r;
+  size_t pos = 0;
+  int final = 0;
+
+  r.data = data;
+  r.size = size;
+  r.bitpos = 0;
+
+  while (!final) {
+    ZopfliParseBlock b;
+    ParseHuffman ll;
+    ParseHuffman d;
+
+    b.bitbegin = r.bitpos;
+    b.posbegin = pos;
+
+    final = ReadBits(&r, 1);
+    b.type = ReadBits(&r, 2);
+    if (final < 0 || b.type < 0) return 0;
+
+    if (b.type == 0) {
+      size_t start;
+      size_t len;
+      r.bitpos = (r.bitpos + 7) & ~(size_t)7;
+      start = r.bitpos >> 3;
+      if (start + 4 > r.size) return 0;
+      len = data[start] + 256 * data[start + 1];
+      if ((len ^ 0xffff) != data[start + 2] + 256u * data[start + 3]) return 0;
+      start += 4;
+      if (start + len > r.size) return 0;
+      b.bitdata = start << 3;
+      if (callback->stored
+          && !callback->stored(callback->context, data + start, len, pos)) {
+        return 1;
+      }
+      pos += len;
+      r.bitpos = (start + len) << 3;
+      b.biteob = r.bitpos;
+    } else {
+      if (b.type == 1) {
+        GetFixedHuffman(&ll, &d);
+      } else if (b.type == 2) {
+        if (!GetDynamicHuffman(&r, &ll, &d)) return 0;
+      } else {
+        return 0;
+      }
+
+      b.bitdata = r.bitpos;
+
+      for (;;) {
+        size_t bit = r.bitpos;
+        int symbol = DecodeSymbol(&r, &ll);
+        int extra;
+        unsigned length;
+        unsigned dist;
+
+        if (symbol < 0) return 0;
+        if (symbol == 256) {
+          b.biteob = bit;
+          break;
+        }
+        if (symbol < 256) {
+          if (callback->symbol
+              && !callback->symbol(callback->context, bit, pos, symbol, 0)) {
+            return 1;
+          }
+          pos++;
+          continue;
+        }
+
+        symbol -= 257;
+        if (symbol >= 29) return 0;
+        extra = ReadBits(&r, kLengthExtra[symbol]);
+        if (extra < 0) return 0;
+        length = kLengthBase[symbol] + extra;
+
+        symbol = DecodeSymbol(&r, &d);
+        if (symbol < 0 || symbol >= 30) return 0;
+        extra = ReadBits(&r, kDistExtra[symbol]);
+        if (extra < 0) return 0;
+        dist = kDistBase[symbol] + extra;
+        if (dist > pos) return 0;
+
+        if (callback->symbol
+            && !callback->symbol(callback->context, bit, pos, length, dist)) {
+          return 1;
+        }
+        pos += length;
+      }
+    }
+
+    b.bitend = r.bitpos;
+    b.posend = pos;
+    if (callback->block && !callback->block(callback->context, &b)) return 1;
+  }
+
+  return 1;
+}
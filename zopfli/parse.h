@@ -0,0 +1,79 @@
+/*
+Copyright 2024 Andrea Mazzoleni. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+Parser of an existing deflate stream, reporting its blocks and symbols with
+their bit positions without storing the decompressed data.
+*/
+
+#ifndef ZOPFLI_PARSE_H_
+#define ZOPFLI_PARSE_H_
+
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Block of a deflate stream, with the bit positions in the stream. */
+typedef struct ZopfliParseBlock {
+  int type;  /* 0 stored, 1 fixed Huffman, 2 dynamic Huffman. */
+  size_t bitbegin;  /* Position of the block header. */
+  size_t bitdata;  /* Position of the first symbol, or of the stored data. */
+  size_t biteob;  /* Position of the end of block symbol. */
+  size_t bitend;  /* Position after the end of block. */
+  size_t posbegin;  /* Uncompressed position of the first byte. */
+  size_t posend;  /* Uncompressed position after the last byte. */
+} ZopfliParseBlock;
+
+/*
+Callbacks of ZopfliParseDeflate. Each one returns 1 to continue, or 0 to stop
+the parsing. Any of them may be 0.
+*/
+typedef struct ZopfliParseCallback {
+  void* context;
+
+  /*
+  Called for each literal and match of the Huffman blocks. For literals
+  litlen is the byte and dist is 0.
+  bit: position of the symbol in the stream
+  pos: uncompressed position
+  */
+  int (*symbol)(void* context, size_t bit, size_t pos,
+                unsigned litlen, unsigned dist);
+
+  /* Called with the data of each stored block, at the uncompressed pos. */
+  int (*stored)(void* context, const unsigned char* data, size_t size,
+                size_t pos);
+
+  /* Called at the end of each block. */
+  int (*block)(void* context, const ZopfliParseBlock* block);
+} ZopfliParseCallback;
+
+/*
+Parses the deflate stream up to the final block, or until a callback stops it.
+The match distances are checked against the uncompressed position, but the
+data is not decompressed.
+Returns 1 if successful, or 0 if the stream is invalid.
+*/
+int ZopfliParseDeflate(const unsigned char* data, size_t size,
+                       const ZopfliParseCallback* callback);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  /* ZOPFLI_PARSE_H_ */
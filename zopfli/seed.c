@@ -0,0 +1,99 @@
+/*
+Copyright 2024 Andrea Mazzoleni. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "seed.h"
+
+#include "parse.h"
+
+/* State of the seed reading, passed to the parser callbacks. */
+typedef struct SeedState {
+  const unsigned char* in;
+  size_t instart;
+  size_t inend;
+  ZopfliLZ77Store* store;
+  int ok;  /* 0 if the data of the stream is different. */
+} SeedState;
+
+static int SeedSymbol(void* context, size_t bit, size_t pos,
+                      unsigned litlen, unsigned dist) {
+  SeedState* state = (SeedState*)context;
+  const unsigned char* in = state->in;
+  size_t end = dist ? pos + litlen : pos + 1;
+  size_t i;
+  (void)bit;
+
+  if (pos >= state->inend) return 0;
+
+  /* A match crossing the start or the end is stored as literals. */
+  if (dist == 0 || pos < state->instart || end > state->inend) {
+    for (i = pos; i < end && i < state->inend; i++) {
+      int c = dist ? in[i - dist] : (int)litlen;
+      if (i < state->instart) continue;
+      if (in[i] != c) {
+        state->ok = 0;
+        return 0;
+      }
+      ZopfliStoreLitLenDist(in[i], 0, i, state->store);
+    }
+    return end < state->inend;
+  }
+
+  for (i = pos; i < end; i++) {
+    if (in[i] != in[i - dist]) {
+      state->ok = 0;
+      return 0;
+    }
+  }
+  ZopfliStoreLitLenDist(litlen, dist, pos, state->store);
+  return end < state->inend;
+}
+
+static int SeedStored(void* context, const unsigned char* data, size_t size,
+                      size_t pos) {
+  SeedState* state = (SeedState*)context;
+  const unsigned char* in = state->in;
+  size_t i;
+
+  for (i = 0; i < size && pos < state->inend; i++, pos++) {
+    if (pos < state->instart) continue;
+    if (data[i] != in[pos]) {
+      state->ok = 0;
+      return 0;
+    }
+    ZopfliStoreLitLenDist(in[pos], 0, pos, state->store);
+  }
+  return pos < state->inend;
+}
+
+int ZopfliReadSeed(const unsigned char* seed, size_t seedsize,
+                   size_t instart, size_t inend,
+                   ZopfliLZ77Store* store) {
+  SeedState state;
+  ZopfliParseCallback callback;
+
+  state.in = store->data;
+  state.instart = instart;
+  state.inend = inend;
+  state.store = store;
+  state.ok = 1;
+
+  callback.context = &state;
+  callback.symbol = SeedSymbol;
+  callback.stored = SeedStored;
+  callback.block = 0;
+
+  return ZopfliParseDeflate(seed, seedsize, &callback) && state.ok;
+}
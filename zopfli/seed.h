@@ -0,0 +1,44 @@
+/*
+Copyright 2024 Andrea Mazzoleni. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+Reads the LZ77 data of an existing deflate stream, to use it as the starting
+point of the optimization instead of the greedy parse.
+*/
+
+#ifndef ZOPFLI_SEED_H_
+#define ZOPFLI_SEED_H_
+
+#include <stdlib.h>
+
+#include "lz77.h"
+
+/*
+Reads the deflate stream seed, which must decompress to the data of the store.
+Only the part from instart to inend is stored, and the matches crossing them
+are stored as literals.
+seed: the deflate stream of all the data
+seedsize: size of the deflate stream
+instart: start of the data to store
+inend: end of the data to store
+store: where the LZ77 data is appended
+Returns 1 if successful, or 0 if the stream is invalid or its data is different.
+*/
+int ZopfliReadSeed(const unsigned char* seed, size_t seedsize,
+                   size_t instart, size_t inend,
+                   ZopfliLZ77Store* store);
+
+#endif  /* ZOPFLI_SEED_H_ */
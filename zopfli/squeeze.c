@@ -358,6 +358,7 @@ static void FollowPath(ZopfliBlockState* s,
     unsigned short length = path[i];
     unsigned short dummy_length;
     unsigned short dist;
+    unsigned short sublen[259];
     assert(pos < inend);
 
     ZopfliUpdateHash(in, pos, inend, h);
@@ -365,8 +366,10 @@ static void FollowPath(ZopfliBlockState* s,
     /* Add to output. */
     if (length >= ZOPFLI_MIN_MATCH) {
       /* Get the distance by recalculating longest match. The found length
-      should match the length from the path. */
-      ZopfliFindLongestMatch(s, h, in, pos, inend, length, 0,
+      should match the length from the path. The binary tree fills the sublen
+      cache, so asking for it avoids walking the chains again. */
+      ZopfliFindLongestMatch(s, h, in, pos, inend, length,
+                             s->options->binarytree ? sublen : 0,
                              &dist, &dummy_length);
       assert(!(dummy_length != length && length > 2 && dummy_length > 2));
       ZopfliVerifyLenDist(in, inend, pos, dist, length);
@@ -410,6 +413,41 @@ static void GetStatistics(const ZopfliLZ77Store* store, SymbolStats* stats) {
   CalculateStatistics(stats);
 }
 
+/*
+Fills the longest match cache with a single pass of the binary tree match
+finder. The following runs keep using the hash chains, which are cheaper to
+update, and fall back to them only for the positions not fully cached.
+*/
+static void FillLongestMatchCache(ZopfliBlockState* s,
+                                  const unsigned char* in,
+                                  size_t instart, size_t inend) {
+  ZopfliHash hash;
+  ZopfliHash* h = &hash;
+  unsigned short sublen[259];
+  unsigned short dist;
+  unsigned short leng;
+  size_t windowstart = instart > ZOPFLI_WINDOW_SIZE
+      ? instart - ZOPFLI_WINDOW_SIZE : 0;
+  size_t i;
+
+  if (!s->lmc || instart == inend) return;
+
+  ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, 1, h);
+  ZopfliResetHash(ZOPFLI_WINDOW_SIZE, h);
+  ZopfliWarmupHash(in, windowstart, inend, h);
+  for (i = windowstart; i < instart; i++) {
+    ZopfliUpdateHash(in, i, inend, h);
+  }
+
+  for (i = instart; i < inend; i++) {
+    ZopfliUpdateHash(in, i, inend, h);
+    ZopfliFindLongestMatch(s, h, in, i, inend, ZOPFLI_MAX_MATCH, sublen,
+                           &dist, &leng);
+  }
+
+  ZopfliCleanHash(h);
+}
+
 /*
 Does a single run for ZopfliLZ77Optimal. For good compression, repeated runs
 with updated statistics should be performed.
@@ -443,6 +481,31 @@ static double LZ77OptimalRun(ZopfliBlockState* s,
   return cost;
 }
 
+/*
+Copies the LZ77 data of the seed in the block to the store.
+*/
+static void CopySeed(const ZopfliLZ77Store* seed,
+                     size_t instart, size_t inend, ZopfliLZ77Store* store) {
+  size_t i;
+  for (i = 0; i < seed->size; i++) {
+    if (seed->pos[i] >= instart && seed->pos[i] < inend) {
+      ZopfliStoreLitLenDist(seed->litlens[i], seed->dists[i], seed->pos[i],
+                            store);
+    }
+  }
+}
+
+/*
+Returns the range of ZopfliStats of the iteration, counting from 1.
+*/
+static int GetStatsRange(int iteration) {
+  int range = 0;
+  while (range < ZOPFLI_STATS_RANGES - 1 && (iteration >> (range + 1)) != 0) {
+    range++;
+  }
+  return range;
+}
+
 void ZopfliLZ77Optimal(ZopfliBlockState *s,
                        const unsigned char* in, size_t instart, size_t inend,
                        int numiterations,
@@ -465,6 +528,12 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
   /* Try randomizing the costs a bit once the size stabilizes. */
   RanState ran_state;
   int lastrandomstep = -1;
+  /* Iteration and cost of the last reduction by more than stopepsilon. */
+  int lastgain = 0;
+  double lastgaincost = ZOPFLI_LARGE_FLOAT;
+  /* Cost before the gains counted in the statistics. */
+  double statcost = ZOPFLI_LARGE_FLOAT;
+  ZopfliStats* stats_out = s->options->stats;
 
   if (!costs) exit(-1); /* Allocation failed. */
   if (!length_array) exit(-1); /* Allocation failed. */
@@ -472,14 +541,23 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
   InitRanState(&ran_state);
   InitStats(&stats);
   ZopfliInitLZ77Store(in, &currentstore);
-  ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, h);
+  ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, 0, h);
+
+  if (s->options->binarytree) FillLongestMatchCache(s, in, instart, inend);
 
   /* Do regular deflate, then loop multiple shortest path runs, each time using
   the statistics of the previous run. */
 
   /* Initial run. */
-  ZopfliLZ77Greedy(s, in, instart, inend, &currentstore, h);
+  if (s->seed) {
+    CopySeed(s->seed, instart, inend, &currentstore);
+  } else {
+    ZopfliLZ77Greedy(s, in, instart, inend, &currentstore, h);
+  }
   GetStatistics(&currentstore, &stats);
+  if (stats_out) {
+    statcost = ZopfliCalculateBlockSize(&currentstore, 0, currentstore.size, 2);
+  }
 
   /* Repeat statistics with each time the cost model from the previous stat
   run. */
@@ -493,6 +571,12 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
     if (s->options->verbose_more || (s->options->verbose && cost < bestcost)) {
       fprintf(stderr, "Iteration %d: %d bit\n", i, (int) cost);
     }
+    if (stats_out && cost < statcost) {
+      int range = GetStatsRange(i + 1);
+      stats_out->gains[range]++;
+      stats_out->gain[range] += statcost - cost;
+      statcost = cost;
+    }
     if (cost < bestcost) {
       /* Copy to the output store. */
       ZopfliCopyLZ77Store(&currentstore, store);
@@ -516,6 +600,24 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
       lastrandomstep = i;
     }
     lastcost = cost;
+    if (cost < lastgaincost - s->options->stopepsilon) {
+      lastgain = i;
+      lastgaincost = cost;
+    }
+    if (s->options->stopiterations > 0
+        && i - lastgain >= s->options->stopiterations) {
+      i++;
+      break;
+    }
+  }
+
+  if (stats_out) {
+    stats_out->blocks++;
+    stats_out->iterations += i;
+    if (i < numiterations) {
+      stats_out->stopped++;
+      stats_out->skipped += numiterations - i;
+    }
   }
 
   free(length_array);
@@ -543,11 +645,13 @@ void ZopfliLZ77OptimalFixed(ZopfliBlockState *s,
   if (!costs) exit(-1); /* Allocation failed. */
   if (!length_array) exit(-1); /* Allocation failed. */
 
-  ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, h);
+  ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, 0, h);
 
   s->blockstart = instart;
   s->blockend = inend;
 
+  if (s->options->binarytree) FillLongestMatchCache(s, in, instart, inend);
+
   /* Shortest path for fixed tree This one should give the shortest possible
   result for fixed tree, no repeated runs are needed since the tree is known. */
   LZ77OptimalRun(s, in, instart, inend, &path, &pathsize,
@@ -32,4 +32,11 @@ void ZopfliInitOptions(ZopfliOptions* options) {
   options->blocksplitting = 1;
   options->blocksplittinglast = 0;
   options->blocksplittingmax = 15;
+  options->binarytree = 0;
+  options->cachelength = ZOPFLI_CACHE_LENGTH;
+  options->stopiterations = 0;
+  options->stopepsilon = 0;
+  options->stats = 0;
+  options->seed = 0;
+  options->seedsize = 0;
 }
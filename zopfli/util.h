@@ -65,10 +65,11 @@ Used to initialize costs for example
 #define ZOPFLI_LARGE_FLOAT 1e30
 
 /*
-For longest match cache. max 256. Uses huge amounts of memory but makes it
-faster. Uses this many times three bytes per single byte of the input data.
-This is so because longest match finding has to find the exact distance
-that belongs to each length for the best lz77 strategy.
+Default for the cachelength option, the maximum number of sublen entries of
+the longest match cache for each byte. max 255. Uses up to this many times three
+bytes per single byte of the input data, but makes it faster. This is so because
+longest match finding has to find the exact distance that belongs to each length
+for the best lz77 strategy.
 Good values: e.g. 5, 8.
 */
 #define ZOPFLI_CACHE_LENGTH 8
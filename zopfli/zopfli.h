@@ -27,6 +27,25 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 extern "C" {
 #endif
 
+/*
+Number of ranges of iterations in ZopfliStats. The range k has the iterations
+from 2^k to 2^(k+1)-1, counting from 1, and the last one all the others.
+*/
+#define ZOPFLI_STATS_RANGES 16
+
+/*
+Statistics of the iterations of the blocks.
+*/
+typedef struct ZopfliStats {
+  size_t blocks;  /* Number of blocks optimized. */
+  size_t iterations;  /* Number of iterations done. */
+  size_t stopped;  /* Number of blocks stopped before the last iteration. */
+  size_t skipped;  /* Number of iterations skipped by the early stop. */
+  size_t gains[ZOPFLI_STATS_RANGES];  /* Iterations improving the block. */
+  double gain[ZOPFLI_STATS_RANGES];  /* Bits saved by the iterations. */
+  size_t cachememory;  /* Biggest memory used by the cache of a block. */
+} ZopfliStats;
+
 /*
 Options used throughout the program.
 */
@@ -61,6 +80,43 @@ typedef struct ZopfliOptions {
   extreme results that hurt compression on some files). Default value: 15.
   */
   int blocksplittingmax;
+
+  /*
+  If true, finds the matches with binary trees instead of hash chains. The
+  matches found are the same or longer, because the search is not limited, and
+  it's a lot faster on very repetitive data. Default: false (0).
+  */
+  int binarytree;
+
+  /*
+  Maximum number of different match distances remembered for each position of
+  the block, from 0 to 255. The memory used is about 9 bytes plus 3 bytes for
+  each distance remembered for every byte of the block. Lower values use less
+  memory, but more matches have to be searched again. Default value: 8.
+  */
+  int cachelength;
+
+  /*
+  Stops the iterations of a block when the last stopiterations ones didn't
+  reduce the cost by more than stopepsilon bits. numiterations remains the
+  maximum. Default value: 0, never stops.
+  */
+  int stopiterations;
+  double stopepsilon;
+
+  /*
+  If not null, the statistics of the iterations are added to it. Default value:
+  null.
+  */
+  ZopfliStats* stats;
+
+  /*
+  If not null, deflate stream of the same data used as the starting point. Its
+  LZ77 data replaces the greedy run used for the initial statistics of the
+  iterations of each block. It's ignored if invalid. Default value: null.
+  */
+  const unsigned char* seed;
+  size_t seedsize;
 } ZopfliOptions;
 
 /* Initializes options with default values. */